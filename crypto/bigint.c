@@ -67,6 +67,7 @@
 #include <time.h>
 #include "os_port.h"
 #include "bigint.h"
+#include "os_alloc.h"
 
 #define V1      v->comps[v->size-1]                 /**< v1 for division */
 #define V2      v->comps[v->size-2]                 /**< v2 for division */
@@ -640,6 +641,36 @@ bigint *bi_import(BI_CTX *ctx, const uint8_t *data, int size)
     return trim(biR);
 }
 
+/**
+ * @brief Import a bigint that is stored as an array of components.
+ *
+ * The components are least significant first, with each one stored as
+ * COMP_BYTE_SIZE little-endian bytes - i.e. the internal layout on the 
+ * ESP8266. This is cheaper than bi_import() for data that has been prepared 
+ * ahead of time.
+ * @param ctx [in]  The bigint session context.
+ * @param data [in] The component data.
+ * @param num_comps [in] The number of components.
+ * @return A bigint representing this data.
+ */
+bigint *bi_import_comps(BI_CTX *ctx, const uint8_t *data, int num_comps)
+{
+    bigint *biR = alloc(ctx, num_comps);
+    int i, j;
+
+    for (i = 0; i < num_comps; i++)
+    {
+        comp c = 0;
+
+        for (j = COMP_BYTE_SIZE-1; j >= 0; j--)
+            c = (c << 8) | data[i*COMP_BYTE_SIZE+j];
+
+        biR->comps[i] = c;
+    }
+
+    return trim(biR);
+}
+
 #ifdef CONFIG_SSL_FULL_MODE
 /**
  * @brief The testharness uses this code to import text hex-streams and 
@@ -778,6 +809,32 @@ void bi_set_mod(BI_CTX *ctx, bigint *bim, int mod_offset)
 #endif
 }
 
+#ifdef CONFIG_BIGINT_BARRETT
+/**
+ * @brief Set the modulus using a Barrett constant that was worked out earlier.
+ *
+ * This is the same as bi_set_mod(), except that the (expensive) division to 
+ * find mu is skipped. Used when loading prepared keys.
+ * @param ctx [in]  The bigint session context.
+ * @param bim [in]  The bigint modulus that will be used.
+ * @param bimu [in] The Barrett constant mu for this modulus.
+ * @param mod_offset [in] The modulus offset (see bi_set_mod()).
+ * @see bi_set_mod(), bi_free_mod().
+ */
+void bi_set_mod_mu(BI_CTX *ctx, bigint *bim, bigint *bimu, int mod_offset)
+{
+    int k = bim->size;
+    comp d = (comp)((long_comp)COMP_RADIX/(bim->comps[k-1]+1));
+
+    ctx->bi_mod[mod_offset] = bim;
+    bi_permanent(ctx->bi_mod[mod_offset]);
+    ctx->bi_normalised_mod[mod_offset] = bi_int_multiply(ctx, bim, d);
+    bi_permanent(ctx->bi_normalised_mod[mod_offset]);
+    ctx->bi_mu[mod_offset] = bimu;
+    bi_permanent(ctx->bi_mu[mod_offset]);
+}
+#endif
+
 /**
  * @brief Used when cleaning various bigints at the end of a session.
  * @param ctx [in]  The bigint session context.
@@ -801,6 +858,43 @@ void bi_free_mod(BI_CTX *ctx, int mod_offset)
     bi_free(ctx, ctx->bi_normalised_mod[mod_offset]);
 }
 
+/*
+ * r[0..n-1] += a[0..n-1]*b, returning the carry out of the top. This is the
+ * inner loop of both the multiply and the square, so it is unrolled to cut 
+ * down on the loop overhead.
+ */
+static comp mul_add_row(comp *r, const comp *a, comp b, int n)
+{
+    long_comp tmp;
+    comp carry = 0;
+
+#define MUL_ADD_COMP(I)                                     \
+    tmp = r[I] + (long_comp)a[I]*b + carry;                 \
+    r[I] = (comp)tmp;                                       \
+    carry = tmp >> COMP_BIT_SIZE
+
+    while (n >= 4)
+    {
+        MUL_ADD_COMP(0);
+        MUL_ADD_COMP(1);
+        MUL_ADD_COMP(2);
+        MUL_ADD_COMP(3);
+        r += 4;
+        a += 4;
+        n -= 4;
+    }
+
+    while (n-- > 0)
+    {
+        MUL_ADD_COMP(0);
+        r++;
+        a++;
+    }
+
+#undef MUL_ADD_COMP
+    return carry;
+}
+
 /** 
  * Perform a standard multiplication between two bigints.
  *
@@ -827,9 +921,10 @@ static bigint *regular_multiply(BI_CTX *ctx, bigint *bia, bigint *bib,
 
     do 
     {
-        long_comp tmp;
         comp carry = 0;
+        comp b = sb[i];
         int r_index = i;
+        int j_end = n;
         j = 0;
 
         if (outer_partial && outer_partial-i > 0 && outer_partial < n)
@@ -838,17 +933,16 @@ static bigint *regular_multiply(BI_CTX *ctx, bigint *bia, bigint *bib,
             j = outer_partial-i-1;
         }
 
-        do
-        {
-            if (inner_partial && r_index >= inner_partial) 
-            {
-                break;
-            }
+        /* work out where the inner partial cuts this row off, rather than 
+           testing for it on every component */
+        if (inner_partial && j_end-j > inner_partial-r_index)
+            j_end = j + inner_partial-r_index;
 
-            tmp = sr[r_index] + ((long_comp)sa[j])*sb[i] + carry;
-            sr[r_index++] = (comp)tmp;              /* downsize */
-            carry = tmp >> COMP_BIT_SIZE;
-        } while (++j < n);
+        if (j < j_end)
+        {
+            carry = mul_add_row(&sr[r_index], &sa[j], b, j_end-j);
+            r_index += j_end-j;
+        }
 
         sr[r_index] = carry;
     } while (++i < t);
@@ -941,53 +1035,48 @@ bigint *bi_multiply(BI_CTX *ctx, bigint *bia, bigint *bib)
 
 #ifdef CONFIG_BIGINT_SQUARE
 /*
- * Perform the actual square operion. It takes into account overflow.
+ * Perform the actual square operation. The cross products x[i]*x[j] (i < j) 
+ * are worked out once and doubled with a shift, and then the squares on the 
+ * diagonal are added in. None of these steps can overflow a long_comp, so the
+ * inner loop is a plain multiply-accumulate.
  */
 static bigint *regular_square(BI_CTX *ctx, bigint *bi)
 {
     int t = bi->size;
-    int i = 0, j;
+    int i;
     bigint *biR = alloc(ctx, t*2+1);
     comp *w = biR->comps;
     comp *x = bi->comps;
-    long_comp carry;
+    long_comp tmp;
+    comp carry;
     memset(w, 0, biR->size*COMP_BYTE_SIZE);
 
-    do
+    /* the cross products */
+    for (i = 0; i < t-1; i++)
     {
-        long_comp tmp = w[2*i] + (long_comp)x[i]*x[i];
-        w[2*i] = (comp)tmp;
-        carry = tmp >> COMP_BIT_SIZE;
-
-        for (j = i+1; j < t; j++)
-        {
-            uint8_t c = 0;
-            long_comp xx = (long_comp)x[i]*x[j];
-            if ((COMP_MAX-xx) < xx)
-                c = 1;
-
-            tmp = (xx<<1);
-
-            if ((COMP_MAX-tmp) < w[i+j])
-                c = 1;
-
-            tmp += w[i+j];
-
-            if ((COMP_MAX-tmp) < carry)
-                c = 1;
-
-            tmp += carry;
-            w[i+j] = (comp)tmp;
-            carry = tmp >> COMP_BIT_SIZE;
+        w[i+t] = mul_add_row(&w[2*i+1], &x[i+1], x[i], t-i-1);
+    }
 
-            if (c)
-                carry += COMP_RADIX;
-        }
+    /* double them - the sum is less than half of x^2 so there is no carry 
+       out of the top */
+    carry = 0;
+    for (i = 0; i < t*2; i++)
+    {
+        comp top = w[i] >> (COMP_BIT_SIZE-1);
+        w[i] = (comp)(w[i] << 1) | carry;
+        carry = top;
+    }
 
-        tmp = w[i+t] + carry;
-        w[i+t] = (comp)tmp;
-        w[i+t+1] = tmp >> COMP_BIT_SIZE;
-    } while (++i < t);
+    /* add in the squares */
+    carry = 0;
+    for (i = 0; i < t; i++)
+    {
+        tmp = w[2*i] + (long_comp)x[i]*x[i] + carry;
+        w[2*i] = (comp)tmp;
+        tmp = w[2*i+1] + (tmp >> COMP_BIT_SIZE);
+        w[2*i+1] = (comp)tmp;
+        carry = tmp >> COMP_BIT_SIZE;
+    }
 
     bi_free(ctx, bi);
     return trim(biR);
@@ -1333,6 +1422,28 @@ static void precompute_slide_window(BI_CTX *ctx, int window, bigint *g1)
 }
 #endif
 
+/*
+ * Plain left-to-right square-and-multiply for an exponent that fits in a
+ * single comp (e.g. the usual RSA public exponent of 65537). The window table
+ * is not worth building here - 65537 is just 16 squarings and a multiply.
+ */
+static bigint *mod_power_short(BI_CTX *ctx, bigint *biR, bigint *bi, 
+        comp exp, int i)
+{
+    bi_free(ctx, biR);
+    biR = bi_copy(bi);      /* the top bit is always a 1 */
+
+    while (--i >= 0)
+    {
+        biR = bi_residue(ctx, bi_square(ctx, biR));
+
+        if ((exp >> i) & 1)
+            biR = bi_residue(ctx, bi_multiply(ctx, biR, bi_copy(bi)));
+    }
+
+    return biR;
+}
+
 /**
  * @brief Perform a modular exponentiation.
  *
@@ -1364,6 +1475,13 @@ bigint *bi_mod_power(BI_CTX *ctx, bigint *bi, bigint *biexp)
     check(bi);
     check(biexp);
 
+    /* short exponents (public keys) don't need the window table */
+    if (biexp->size == 1)
+    {
+        biR = mod_power_short(ctx, biR, bi, biexp->comps[0], i);
+        goto end_power;
+    }
+
 #ifdef CONFIG_BIGINT_SLIDING_WINDOW
     for (j = i; j > 32; j /= 5) /* work out an optimum size */
         window_size++;
@@ -1424,6 +1542,8 @@ bigint *bi_mod_power(BI_CTX *ctx, bigint *bi, bigint *biexp)
     }
 
     free(ctx->g);
+
+end_power:
     bi_free(ctx, bi);
     bi_free(ctx, biexp);
 #if defined CONFIG_BIGINT_MONTGOMERY
@@ -43,6 +43,7 @@ bigint *bi_copy(bigint *bi);
 bigint *bi_clone(BI_CTX *ctx, const bigint *bi);
 void bi_export(BI_CTX *ctx, bigint *bi, uint8_t *data, int size);
 bigint *bi_import(BI_CTX *ctx, const uint8_t *data, int len);
+bigint *bi_import_comps(BI_CTX *ctx, const uint8_t *data, int num_comps);
 bigint *int_to_bi(BI_CTX *ctx, comp i);
 
 /* the functions that actually do something interesting */
@@ -79,6 +80,7 @@ bigint *bi_mont(BI_CTX *ctx, bigint *bixy);
 #elif defined(CONFIG_BIGINT_BARRETT)
 #define bi_residue(A, B)         bi_barrett(A, B)
 bigint *bi_barrett(BI_CTX *ctx, bigint *bi);
+void bi_set_mod_mu(BI_CTX *ctx, bigint *bim, bigint *bimu, int mod_offset);
 #else /* if defined(CONFIG_BIGINT_CLASSICAL) */
 #define bi_residue(A, B)         bi_mod(A, B)
 #endif
@@ -248,6 +248,19 @@ void RSA_priv_key_new(RSA_CTX **rsa_ctx,
 void RSA_pub_key_new(RSA_CTX **rsa_ctx, 
         const uint8_t *modulus, int mod_len,
         const uint8_t *pub_exp, int pub_len);
+#if defined(CONFIG_BIGINT_CRT) && defined(CONFIG_BIGINT_BARRETT)
+/* 
+ * A prepared key is an 8 byte header ("AXPK", version, COMP_BYTE_SIZE and 
+ * the 16 bit little-endian key size in bytes) followed by m, e, d, p, q, dP, 
+ * dQ, qInv and the Barrett mu for each of m, p and q.
+ */
+#define RSA_PREPARED_MAGIC          "AXPK"
+#define RSA_PREPARED_VERSION        1
+#define RSA_PREPARED_HEADER_SIZE    8
+#define RSA_PREPARED_NUM_BIGINTS    11
+#define RSA_PREPARED_MAX_OCTETS     512     /* for a 4096 bit key */
+int RSA_priv_key_new_prepared(RSA_CTX **rsa_ctx, const uint8_t *buf, int len);
+#endif
 void RSA_free(RSA_CTX *ctx);
 int RSA_decrypt(const RSA_CTX *ctx, const uint8_t *in_data, uint8_t *out_data,
         int out_len, int is_decryption);
@@ -41,6 +41,7 @@
 #ifdef CONFIG_WIN32_USE_CRYPTO_LIB
 #include "wincrypt.h"
 #endif
+#include "os_alloc.h"
 
 #ifdef ESP8266
 #define CONFIG_SSL_SKELETON_MODE 1
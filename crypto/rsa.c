@@ -39,6 +39,29 @@
 #include <stdlib.h>
 #include "os_port.h"
 #include "crypto.h"
+#include "os_alloc.h"
+
+#if !defined(CONFIG_BIGINT_CRT) || defined(CONFIG_SSL_CERT_VERIFICATION) || \
+            defined(CONFIG_SSL_GENERATE_X509_CERT)
+/*
+ * Set up the reduction constants for the public modulus. This is done the 
+ * first time the public key is actually used rather than at load time, as 
+ * most keys (e.g. those in the CA store) are never used, and working out the 
+ * constants needs a bigint division.
+ */
+static void rsa_set_mod(const RSA_CTX *c)
+{
+    BI_CTX *bi_ctx = c->bi_ctx;
+
+    if (bi_ctx->bi_mod[BIGINT_M_OFFSET] == NULL)
+    {
+        bi_depermanent(c->m);   /* bi_set_mod() makes it permanent again */
+        bi_set_mod(bi_ctx, c->m, BIGINT_M_OFFSET);
+    }
+
+    bi_ctx->mod_offset = BIGINT_M_OFFSET;
+}
+#endif
 
 void RSA_priv_key_new(RSA_CTX **ctx, 
         const uint8_t *modulus, int mod_len,
@@ -72,6 +95,8 @@ void RSA_priv_key_new(RSA_CTX **ctx,
     bi_permanent(rsa_ctx->qInv);
     bi_set_mod(bi_ctx, rsa_ctx->p, BIGINT_P_OFFSET);
     bi_set_mod(bi_ctx, rsa_ctx->q, BIGINT_Q_OFFSET);
+#else
+    rsa_set_mod(rsa_ctx);
 #endif
     bi_clear_cache(bi_ctx);
 }
@@ -92,12 +117,112 @@ void RSA_pub_key_new(RSA_CTX **ctx,
     rsa_ctx->bi_ctx = bi_ctx;
     rsa_ctx->num_octets = mod_len;
     rsa_ctx->m = bi_import(bi_ctx, modulus, mod_len);
-    bi_set_mod(bi_ctx, rsa_ctx->m, BIGINT_M_OFFSET);
+    bi_permanent(rsa_ctx->m);
     rsa_ctx->e = bi_import(bi_ctx, pub_exp, pub_len);
     bi_permanent(rsa_ctx->e);
     bi_clear_cache(bi_ctx);
 }
 
+#if defined(CONFIG_BIGINT_CRT) && defined(CONFIG_BIGINT_BARRETT)
+/*
+ * Pull the next bigint out of a prepared key. Each one is a 16 bit 
+ * (little-endian) component count followed by the components.
+ */
+static bigint *get_prepared_bi(BI_CTX *bi_ctx, 
+        const uint8_t *buf, int len, int *offset)
+{
+    int num_comps;
+    bigint *bi;
+
+    if (*offset + 2 > len)
+        return NULL;
+
+    num_comps = buf[*offset] | (buf[*offset+1] << 8);
+    *offset += 2;
+
+    if (num_comps == 0 || *offset + num_comps*COMP_BYTE_SIZE > len)
+        return NULL;
+
+    bi = bi_import_comps(bi_ctx, &buf[*offset], num_comps);
+    *offset += num_comps*COMP_BYTE_SIZE;
+    return bi;
+}
+
+/**
+ * Load a private key that was prepared ahead of time (see 
+ * tools/make_prepared_key.py). Since the Barrett constants for m, p and q are
+ * part of the key, no bigint divisions are needed to get it ready for use.
+ */
+int RSA_priv_key_new_prepared(RSA_CTX **ctx, const uint8_t *buf, int len)
+{
+    RSA_CTX *rsa_ctx;
+    BI_CTX *bi_ctx;
+    bigint *bi[RSA_PREPARED_NUM_BIGINTS];
+    int i, num_octets, offset = RSA_PREPARED_HEADER_SIZE;
+
+    if (len < RSA_PREPARED_HEADER_SIZE || 
+            memcmp(buf, RSA_PREPARED_MAGIC, 4) ||
+            buf[4] != RSA_PREPARED_VERSION || buf[5] != COMP_BYTE_SIZE)
+        return -1;
+
+    bi_ctx = bi_initialize();
+    memset(bi, 0, sizeof(bi));
+
+    for (i = 0; i < RSA_PREPARED_NUM_BIGINTS; i++)
+    {
+        if ((bi[i] = get_prepared_bi(bi_ctx, buf, len, &offset)) == NULL)
+            goto error;
+    }
+
+    /* mu always has one more component than its modulus */
+    if (bi[8]->size != bi[0]->size+1 || bi[9]->size != bi[3]->size+1 ||
+            bi[10]->size != bi[4]->size+1)
+        goto error;
+
+    /* the key size has to be the modulus' size, and one that we can handle */
+    num_octets = buf[6] | (buf[7] << 8);
+
+    if (num_octets > RSA_PREPARED_MAX_OCTETS ||
+            (num_octets+COMP_BYTE_SIZE-1)/COMP_BYTE_SIZE != bi[0]->size)
+        goto error;
+
+    if (*ctx)   /* if we load multiple keys, dump the old one */
+        RSA_free(*ctx);
+
+    *ctx = (RSA_CTX *)calloc(1, sizeof(RSA_CTX));
+    rsa_ctx = *ctx;
+    rsa_ctx->bi_ctx = bi_ctx;
+    rsa_ctx->num_octets = num_octets;
+    rsa_ctx->m = bi[0];
+    rsa_ctx->e = bi[1];
+    rsa_ctx->d = bi[2];
+    rsa_ctx->p = bi[3];
+    rsa_ctx->q = bi[4];
+    rsa_ctx->dP = bi[5];
+    rsa_ctx->dQ = bi[6];
+    rsa_ctx->qInv = bi[7];
+    bi_permanent(rsa_ctx->e);
+    bi_permanent(rsa_ctx->d);
+    bi_permanent(rsa_ctx->dP);
+    bi_permanent(rsa_ctx->dQ);
+    bi_permanent(rsa_ctx->qInv);
+    bi_set_mod_mu(bi_ctx, rsa_ctx->m, bi[8], BIGINT_M_OFFSET);
+    bi_set_mod_mu(bi_ctx, rsa_ctx->p, bi[9], BIGINT_P_OFFSET);
+    bi_set_mod_mu(bi_ctx, rsa_ctx->q, bi[10], BIGINT_Q_OFFSET);
+    return 0;
+
+error:
+    for (i = 0; i < RSA_PREPARED_NUM_BIGINTS; i++)
+    {
+        if (bi[i])
+            bi_free(bi_ctx, bi[i]);
+    }
+
+    bi_terminate(bi_ctx);
+    return -1;
+}
+#endif
+
 /**
  * Free up any RSA context resources.
  */
@@ -111,7 +236,14 @@ void RSA_free(RSA_CTX *rsa_ctx)
 
     bi_depermanent(rsa_ctx->e);
     bi_free(bi_ctx, rsa_ctx->e);
-    bi_free_mod(rsa_ctx->bi_ctx, BIGINT_M_OFFSET);
+
+    if (bi_ctx->bi_mod[BIGINT_M_OFFSET])
+        bi_free_mod(rsa_ctx->bi_ctx, BIGINT_M_OFFSET);
+    else
+    {
+        bi_depermanent(rsa_ctx->m);
+        bi_free(bi_ctx, rsa_ctx->m);
+    }
 
     if (rsa_ctx->d)
     {
@@ -221,9 +353,8 @@ bigint *RSA_private(const RSA_CTX *c, bigint *bi_msg)
 #ifdef CONFIG_BIGINT_CRT
     return bi_crt(c->bi_ctx, bi_msg, c->dP, c->dQ, c->p, c->q, c->qInv);
 #else
-    BI_CTX *ctx = c->bi_ctx;
-    ctx->mod_offset = BIGINT_M_OFFSET;
-    return bi_mod_power(ctx, bi_msg, c->d);
+    rsa_set_mod(c);
+    return bi_mod_power(c->bi_ctx, bi_msg, c->d);
 #endif
 }
 
@@ -250,7 +381,7 @@ void RSA_print(const RSA_CTX *rsa_ctx)
  */
 bigint *RSA_public(const RSA_CTX * c, bigint *bi_msg)
 {
-    c->bi_ctx->mod_offset = BIGINT_M_OFFSET;
+    rsa_set_mod(c);
     return bi_mod_power(c->bi_ctx, bi_msg, c->e);
 }
 
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include "os_port.h"
 #include "ssl.h"
+#include "os_alloc.h"
 
 /**
  * Generate a basic X.509 certificate
@@ -351,16 +352,17 @@ EXP_FUNC int STDCALL ssl_x509_create(SSL_CTX *ssl_ctx, uint32_t options, const c
 {
     int ret = X509_OK, offset = 0, seq_offset;
     /* allocate enough space to load a new certificate */
-    uint8_t *buf = (uint8_t *)malloc(ssl_ctx->rsa_ctx->num_octets*2 + 512);
+    RSA_CTX *rsa_ctx = ssl_ctx->config->rsa_ctx;
+    uint8_t *buf = (uint8_t *)malloc(rsa_ctx->num_octets*2 + 512);
     uint8_t sha_dgst[SHA1_SIZE];
     int seq_size = pre_adjust_with_size(ASN1_SEQUENCE, 
                                     &seq_offset, buf, &offset);
 
-    if ((ret = gen_tbs_cert(dn, ssl_ctx->rsa_ctx, buf, &offset, sha_dgst)) < 0)
+    if ((ret = gen_tbs_cert(dn, rsa_ctx, buf, &offset, sha_dgst)) < 0)
         goto error;
 
     gen_signature_alg(buf, &offset);
-    gen_signature(ssl_ctx->rsa_ctx, sha_dgst, buf, &offset);
+    gen_signature(rsa_ctx, sha_dgst, buf, &offset);
     adjust_with_size(seq_size, seq_offset, buf, &offset);
     *cert_data = (uint8_t *)malloc(offset); /* create the exact memory for it */
     memcpy(*cert_data, buf, offset);
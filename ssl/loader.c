@@ -43,6 +43,7 @@
 #include <stdio.h>
 #include "os_port.h"
 #include "ssl.h"
+#include "os_alloc.h"
 
 static int do_obj(SSL_CTX *ssl_ctx, int obj_type, 
                     SSLObjLoader *ssl_obj, const char *password);
@@ -134,6 +135,14 @@ static int do_obj(SSL_CTX *ssl_ctx, int obj_type,
             ret = add_private_key(ssl_ctx, ssl_obj);
             break;
 
+#if defined(CONFIG_BIGINT_CRT) && defined(CONFIG_BIGINT_BARRETT)
+        case SSL_OBJ_RSA_PREPARED_KEY:
+            if (RSA_priv_key_new_prepared(&ssl_ctx->config->rsa_ctx, 
+                                    ssl_obj->buf, ssl_obj->len))
+                ret = SSL_ERROR_INVALID_KEY;
+            break;
+#endif
+
         case SSL_OBJ_X509_CERT:
             ret = add_cert(ssl_ctx, ssl_obj->buf, ssl_obj->len);
             break;
@@ -44,6 +44,7 @@
 #include <stdarg.h>
 #include "os_port.h"
 #include "ssl.h"
+#include "os_alloc.h"
 
 #define OPENSSL_CTX_ATTR  ((OPENSSL_CTX *)ssl_ctx->bonus_attr)
 
@@ -83,7 +84,9 @@ SSL * SSL_new(SSL_CTX *ssl_ctx)
     ssl_func_type_t ssl_func_type = OPENSSL_CTX_ATTR->ssl_func_type;
 #endif
 
-    ssl = ssl_new(ssl_ctx, -1);        /* fd is set later */
+    if ((ssl = ssl_new(ssl_ctx, -1)) == NULL)  /* fd is set later */
+        return NULL;
+
 #ifdef CONFIG_SSL_ENABLE_CLIENT
     if (ssl_func_type == SSLv3_client_method ||
         ssl_func_type == TLSv1_client_method)
@@ -101,7 +104,7 @@ SSL * SSL_new(SSL_CTX *ssl_ctx)
 
 int SSL_set_fd(SSL *s, int fd)
 {
-    s->client_fd = fd;
+    ssl_set_client_fd(s, fd);
     return 1;   /* always succeeds */
 }
 
@@ -237,6 +240,9 @@ void SSL_CTX_set_default_passwd_cb_userdata(SSL_CTX *ctx, void *u)
 
 int SSL_peek(SSL *ssl, void *buf, int num)
 {
+    if (ssl->bm_data == NULL)   /* the buffer has been released */
+        return 0;
+
     memcpy(buf, ssl->bm_data, num);
     return num;
 }
@@ -257,7 +263,7 @@ int SSL_state(SSL *ssl)
 
 void *SSL_get_peer_certificate(const SSL *ssl)
 {
-    return &ssl->ssl_ctx->certs[0];
+    return &ssl->config->certs[0];
 }
 
 int SSL_clear(SSL *ssl)
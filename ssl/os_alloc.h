@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2007-2016, Cameron Rich
+ * 
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the axTLS project nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file os_alloc.h
+ *
+ * Send the library's own allocations through the allocator that was given
+ * to ssl_set_allocator(). Only the library's source files include this, so
+ * an application's malloc() and free() are left alone.
+ */
+
+#ifndef HEADER_OS_ALLOC_H
+#define HEADER_OS_ALLOC_H
+
+#include "os_port.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *ax_malloc_hint(size_t s, int hint);
+void *ax_realloc_hint(void *y, size_t s, int hint);
+
+#undef strdup
+#define malloc(A)               ax_malloc(A)
+#define calloc(A,B)             ax_calloc(A,B)
+#define realloc(A,B)            ax_realloc(A,B)
+#define free(A)                 ax_free(A)
+#define strdup(A)               ax_strdup(A)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
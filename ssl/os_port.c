@@ -39,6 +39,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include "os_port.h"
+#include "os_alloc.h"
 
 #ifdef WIN32
 /**
@@ -91,3 +92,91 @@ EXP_FUNC int STDCALL getdomainname(char *buf, int buf_size)
 }
 #endif
 
+/* the C library is what these are built on */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+static ssl_alloc_cb g_alloc_fn;
+static ssl_realloc_cb g_realloc_fn;
+static ssl_free_cb g_free_fn;
+static void *g_alloc_arg;
+
+/*
+ * Use an allocator of the application's for all the library's memory.
+ */
+EXP_FUNC void STDCALL ssl_set_allocator(ssl_alloc_cb alloc_fn, 
+        ssl_realloc_cb realloc_fn, ssl_free_cb free_fn, void *arg)
+{
+    if (alloc_fn && realloc_fn && free_fn)
+    {
+        g_alloc_fn = alloc_fn;
+        g_realloc_fn = realloc_fn;
+        g_free_fn = free_fn;
+        g_alloc_arg = arg;
+    }
+    else    /* back to the C library */
+    {
+        g_alloc_fn = NULL;
+        g_realloc_fn = NULL;
+        g_free_fn = NULL;
+        g_alloc_arg = NULL;
+    }
+}
+
+void *ax_malloc_hint(size_t s, int hint)
+{
+    return g_alloc_fn ? g_alloc_fn(g_alloc_arg, s, hint) : malloc(s);
+}
+
+void *ax_realloc_hint(void *y, size_t s, int hint)
+{
+    return g_realloc_fn ? g_realloc_fn(g_alloc_arg, y, s, hint) : 
+                                                            realloc(y, s);
+}
+
+EXP_FUNC void * STDCALL ax_malloc(size_t s)
+{
+    return ax_malloc_hint(s, 0);  /* SSL_ALLOC_OTHER */
+}
+
+EXP_FUNC void * STDCALL ax_calloc(size_t n, size_t s)
+{
+    void *x;
+
+    if (s && n > (size_t)-1/s)   /* it would overflow */
+        return NULL;
+
+    if ((x = ax_malloc(n*s)) != NULL)
+        memset(x, 0, n*s);
+
+    return x;
+}
+
+EXP_FUNC void * STDCALL ax_realloc(void *y, size_t s)
+{
+    return ax_realloc_hint(y, s, 0);  /* SSL_ALLOC_OTHER */
+}
+
+EXP_FUNC void STDCALL ax_free(void *y)
+{
+    if (y == NULL)
+        return;
+
+    if (g_free_fn)
+        g_free_fn(g_alloc_arg, y);
+    else
+        free(y);
+}
+
+EXP_FUNC char * STDCALL ax_strdup(const char *s)
+{
+    size_t len = strlen(s)+1;
+    char *x = (char *)ax_malloc(len);
+
+    if (x)
+        memcpy(x, s, len);
+
+    return x;
+}
@@ -44,6 +44,8 @@ extern "C" {
 #include "os_int.h"
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef WIN32
 #define STDCALL                 __stdcall
@@ -300,6 +302,21 @@ void exit_now(const char *format, ...);
 #define SSL_CTX_UNLOCK(A)
 #endif
 
+/* 
+ * All the memory that the library uses goes through these, so that an 
+ * application can give it an allocator of its own (see ssl_set_allocator()).
+ * os_alloc.h points the library's own calls at them.
+ */
+typedef void *(*ssl_alloc_cb)(void *arg, size_t size, int hint);
+typedef void *(*ssl_realloc_cb)(void *arg, void *ptr, size_t size, int hint);
+typedef void (*ssl_free_cb)(void *arg, void *ptr);
+
+EXP_FUNC void * STDCALL ax_malloc(size_t s);
+EXP_FUNC void * STDCALL ax_calloc(size_t n, size_t s);
+EXP_FUNC void * STDCALL ax_realloc(void *y, size_t s);
+EXP_FUNC void STDCALL ax_free(void *y);
+EXP_FUNC char * STDCALL ax_strdup(const char *s);
+
 #ifndef PROGMEM
 #define PROGMEM
 #endif
@@ -64,6 +64,7 @@
 #include <stdio.h>
 #include "os_port.h"
 #include "ssl.h"
+#include "os_alloc.h"
 
 /* all commented out if not used */
 #ifdef CONFIG_SSL_USE_PKCS12
@@ -146,7 +147,7 @@ static int p8_add_key(SSL_CTX *ssl_ctx, uint8_t *priv_key)
             (len = asn1_next_obj(buf, &offset, ASN1_OCTET_STRING)) < 0)
         goto error;
 
-    ret = asn1_get_private_key(&buf[offset], len, &ssl_ctx->rsa_ctx);
+    ret = asn1_get_private_key(&buf[offset], len, &ssl_ctx->config->rsa_ctx);
 
 error:
     return ret;
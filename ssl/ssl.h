@@ -84,6 +84,14 @@ extern "C" {
 #define SSL_DISPLAY_RSA                         0x00400000
 #define SSL_CONNECT_IN_PARTS                    0x00800000
 #define SSL_READ_BLOCKING                       0x01000000
+#define SSL_SESSION_TICKETS                     0x02000000
+#define SSL_FALSE_START                         0x04000000
+#define SSL_RELEASE_BUFFERS                     0x08000000
+
+/* what an allocation is for (see ssl_set_allocator()) */
+#define SSL_ALLOC_OTHER                         0
+#define SSL_ALLOC_RECORD                        1
+#define SSL_ALLOC_CONNECTION                    2
 
 /* errors that can be generated */
 #define SSL_OK                                  0
@@ -175,6 +183,7 @@ extern "C" {
 #define SSL_OBJ_RSA_KEY                         3
 #define SSL_OBJ_PKCS8                           4
 #define SSL_OBJ_PKCS12                          5
+#define SSL_OBJ_RSA_PREPARED_KEY                6
 
 /**
  * @defgroup c_api Standard C API
@@ -215,6 +224,23 @@ extern "C" {
  * are passed during a handshake.
  * - SSL_CONNECT_IN_PARTS (client only): To use a non-blocking version of 
  * ssl_client_new().
+ * - SSL_FALSE_START (client only): Let the handshake complete (so data can
+ * be sent) once the client's finished message has gone, rather than waiting
+ * for the server's. This saves a round trip on a full handshake. The server's
+ * finished message is checked when it arrives and no data is read until it
+ * is. It isn't used with SSL_SERVER_VERIFY_LATER, since the data would go to
+ * a server that hasn't been authenticated.
+ * - SSL_SESSION_TICKETS: Resume sessions with session tickets (RFC 5077). A
+ * server keeps no state for these sessions, so it can resume them even when
+ * num_sessions is 0. A client keeps the tickets in its session cache, so 
+ * num_sessions must not be 0. Not available in skeleton mode.
+ * - SSL_RELEASE_BUFFERS: Free a connection's record buffer when it has 
+ * nothing part read or after ssl_write(), and get it back when the next 
+ * record arrives. A buffer that grew for a large record goes back to its 
+ * normal size. This saves memory with many idle connections, at the cost of
+ * an allocation for each record (see ssl_ctx_set_buffer_pool()). Data 
+ * returned by ssl_read() is only good until the next call to ssl_read() or
+ * ssl_write().
  * @param num_sessions [in] The number of sessions to be used for session
  * caching. If this value is 0, then there is no session caching. This option
  * is not used in skeleton mode.
@@ -231,6 +257,182 @@ EXP_FUNC SSL_CTX * STDCALL ssl_ctx_new(uint32_t options, int num_sessions);
  */
 EXP_FUNC void STDCALL ssl_ctx_free(SSL_CTX *ssl_ctx);
 
+/**
+ * @brief Change the key and certificates of a context that is in use.
+ *
+ * The new key, certificate chain and CA certificates are loaded into a
+ * context of their own (e.g. with ssl_obj_load()) and then moved over with
+ * this. New connections use them straight away. The connections already
+ * running keep the ones they started with, which are freed when the last of
+ * those connections is. So certificates can be renewed without a restart.
+ * @param ssl_ctx [in] The client/server context in use.
+ * @param new_ctx [in] The context with the new objects loaded. It must not
+ * have any connections. It is left empty, and still has to be freed with
+ * ssl_ctx_free().
+ * @return SSL_OK if all ok, or SSL_NOT_OK if new_ctx has connections or there
+ * wasn't the memory.
+ * @note The options of ssl_ctx are not changed.
+ */
+EXP_FUNC int STDCALL ssl_ctx_swap_config(SSL_CTX *ssl_ctx, SSL_CTX *new_ctx);
+
+/**
+ * @brief Give a server a key and certificates for one of its host names.
+ *
+ * A client that sends this name (with the SNI extension) gets these
+ * instead of the ones loaded into the server context. Other clients still
+ * get the server context's own. The hosts are kept in a hash table, so a
+ * context can serve any number of them, and they share its session cache.
+ * A session (or session ticket) is only resumed with the host name that it
+ * was made with, and sessions for a host aren't given to the session store.
+ * The key, certificate chain and CA certificates (for client authentication)
+ * are loaded into a context of their own and moved over, as with
+ * ssl_ctx_swap_config(). Adding a host that is already there replaces it
+ * while connections are running.
+ * @param ssl_ctx [in] The server context.
+ * @param host_name [in] The host name (case doesn't matter). A name like
+ * "*.example.com" matches any name with one label in place of the "*".
+ * @param host_ctx [in] The context with the objects for this host loaded.
+ * It must not have any connections. It is left empty, and still has to be
+ * freed with ssl_ctx_free(). NULL removes the host.
+ * @return SSL_OK if all ok, or SSL_NOT_OK if the name isn't valid, host_ctx
+ * has connections, there wasn't the memory, a host to remove isn't there or
+ * this is a skeleton build.
+ */
+EXP_FUNC int STDCALL ssl_ctx_add_host(SSL_CTX *ssl_ctx,
+        const char *host_name, SSL_CTX *host_ctx);
+
+/**
+ * @brief Set the key that a server uses to protect its session tickets.
+ *
+ * By default a random key is made when the first ticket is issued and 
+ * replaced once it is CONFIG_SSL_EXPIRY_TIME hours old. Servers that share
+ * their clients (e.g. behind a load balancer) need to use the same key, and 
+ * this call does just that. The key is then only changed by calling this 
+ * function again - the tickets protected with the previous key are still
+ * accepted until they expire.
+ * @param ssl_ctx [in] The server context.
+ * @param key [in] 64 bytes of key material: a 16 byte key name, a 16 byte 
+ * AES-128 key and a 32 byte HMAC-SHA256 key. It should be random and kept
+ * secret.
+ * @return SSL_OK if the key was set, or SSL_NOT_OK if there was no memory for
+ * it or in skeleton mode.
+ * @see SSL_SESSION_TICKETS
+ */
+EXP_FUNC int STDCALL ssl_ctx_set_ticket_key(SSL_CTX *ssl_ctx, const uint8_t *key);
+
+/**
+ * @brief Share the record buffers of a context's connections.
+ *
+ * A connection made with SSL_RELEASE_BUFFERS lets its record buffer go when
+ * it is idle. With a pool these buffers (and those of connections that are
+ * freed) are kept for the next connection that needs one instead of going 
+ * back to the heap, so the memory used follows the number of busy 
+ * connections and not the number of open ones. Buffers are only lent to 
+ * connections with the same record size. 
+ * @param ssl_ctx [in] The client/server context.
+ * @param num_buffers [in] The most idle buffers to keep. 0 (the default) 
+ * frees them and turns the pool off.
+ * @see SSL_RELEASE_BUFFERS
+ */
+EXP_FUNC void STDCALL ssl_ctx_set_buffer_pool(SSL_CTX *ssl_ctx, int num_buffers);
+
+/**
+ * @brief Set aside the objects for a number of connections.
+ *
+ * Each connection needs a few objects of a fixed size (its state, the 
+ * handshake state and the cipher contexts). This makes them for 
+ * num_connections in one allocation that the context keeps, and they are 
+ * recycled as connections come and go. A server with a lot of churn then
+ * doesn't fragment the heap. More connections than this still work, with 
+ * their objects taken from the heap.
+ * @param ssl_ctx [in] The client/server context.
+ * @param num_connections [in] The number of connections to make room for.
+ * @return SSL_OK, or SSL_NOT_OK if there wasn't the memory, it was already
+ * done or the context has connections.
+ */
+EXP_FUNC int STDCALL ssl_ctx_set_object_pool(SSL_CTX *ssl_ctx, int num_connections);
+
+/**
+ * @brief Give the library an allocator to use for all its memory.
+ *
+ * Every allocation that axTLS makes goes through these functions once they
+ * are set, e.g. to put it in an arena of its own or to cap what it uses. Set
+ * it before any context is made, and don't change it while anything that 
+ * the library allocated is still about. The application's own malloc() and
+ * free() aren't affected.
+ *
+ * Only some allocations may fail. If a record buffer or a connection object
+ * can't be had, ssl_ctx_new(), ssl_client_new() or ssl_server_new() return 
+ * null, or the connection gets an error. The library counts on every other
+ * allocation (certificates, keys, sessions etc) working.
+ * @param alloc_fn [in] Get size bytes. hint says what they are for:
+ * - SSL_ALLOC_OTHER: anything else.
+ * - SSL_ALLOC_RECORD: a record buffer (a few kB, lives as long as the 
+ * connection unless SSL_RELEASE_BUFFERS is used).
+ * - SSL_ALLOC_CONNECTION: the fixed size objects of a connection.
+ * @param realloc_fn [in] Resize an allocation, as realloc() does.
+ * @param free_fn [in] Free an allocation. It is never given NULL.
+ * @param arg [in] Passed to each of the functions.
+ * @note If any of the functions is NULL then the C library is used again.
+ */
+EXP_FUNC void STDCALL ssl_set_allocator(ssl_alloc_cb alloc_fn, 
+        ssl_realloc_cb realloc_fn, ssl_free_cb free_fn, void *arg);
+
+/**
+ * @brief Write out the session cache.
+ *
+ * The sessions can be read back with ssl_ctx_import_sessions() (e.g. after a 
+ * restart), so that a client doesn't need a full handshake the next time it
+ * connects to a server. The data includes the master secrets of the 
+ * sessions, so it needs to be kept somewhere safe.
+ * @param ssl_ctx [in] The client/server context.
+ * @param data [out] Where the sessions go. If this is null, then only the
+ * size that is needed is worked out.
+ * @param len [in] The size of data.
+ * @return The number of bytes written (or needed), or SSL_NOT_OK if data is
+ * too small or in skeleton mode.
+ */
+EXP_FUNC int STDCALL ssl_ctx_export_sessions(SSL_CTX *ssl_ctx, uint8_t *data, int len);
+
+/**
+ * @brief Read in sessions that were written out with 
+ * ssl_ctx_export_sessions().
+ *
+ * Sessions that have expired are ignored. If there are more sessions than 
+ * num_sessions in ssl_ctx_new(), then the most recently used are kept.
+ * @param ssl_ctx [in] The client/server context.
+ * @param data [in] The exported sessions.
+ * @param len [in] The size of data.
+ * @return The number of sessions read in, or SSL_NOT_OK if the data is bad 
+ * or in skeleton mode.
+ */
+EXP_FUNC int STDCALL ssl_ctx_import_sessions(SSL_CTX *ssl_ctx, const uint8_t *data, int len);
+
+/**
+ * @brief Keep the sessions in a store that is shared with other contexts.
+ *
+ * Each context has its own session cache, so a server made up of several 
+ * processes (or several contexts) can only resume the sessions that the same 
+ * process set up. A shared store (e.g. a memory mapped file) fixes this. The
+ * context's own cache is always looked at first and the store is then used
+ * for the sessions that aren't in it. num_sessions in ssl_ctx_new() may be 0
+ * for a server that only uses the store.
+ *
+ * The callbacks are made with the context locked (if CONFIG_SSL_CTX_MUTEXING 
+ * is used) but they need to do their own locking between processes. They
+ * must not call back into this library. Session ids are always 
+ * SSL_SESSION_ID_SIZE bytes and master secrets are 48 bytes.
+ * @param ssl_ctx [in] The client/server context.
+ * @param new_cb [in] Called with a new session once its handshake is done.
+ * @param get_cb [in] Called to find a session. It returns SSL_OK and fills 
+ * in the master secret and the time the session was made if it was found.
+ * Sessions older than CONFIG_SSL_EXPIRY_TIME hours aren't used.
+ * @param remove_cb [in] Called with a session that must not be resumed.
+ * @param arg [in] Passed to each callback.
+ * @return SSL_OK, or SSL_NOT_OK in skeleton mode.
+ */
+EXP_FUNC int STDCALL ssl_ctx_set_session_store(SSL_CTX *ssl_ctx, ssl_session_new_cb new_cb, ssl_session_get_cb get_cb, ssl_session_remove_cb remove_cb, void *arg);
+
 /**
  * @brief Allocates new SSL extensions structure and returns pointer to it
  *
@@ -284,8 +486,9 @@ EXP_FUNC SSL * STDCALL ssl_server_new(SSL_CTX *ssl_ctx, int client_fd);
  * @param ssl_ctx [in] The client context.
  * @param client_fd [in] The client's file descriptor.
  * @param session_id [in] A 32 byte session id for session resumption. This 
- * can be null if no session resumption is being used or required. This option
- * is not used in skeleton mode.
+ * can be null if no session resumption is being used or required. If it is
+ * null and a host name is set in ssl_ext, then the last session with that
+ * host (if any) is resumed. This option is not used in skeleton mode.
  * @param sess_id_size The size of the session id (max 32)
  * @param ssl_ext pointer to a structure with the activated SSL extensions 
  * and their values
@@ -342,11 +545,50 @@ EXP_FUNC int STDCALL ssl_write(SSL *ssl, const uint8_t *out_data, int out_len);
  */
 EXP_FUNC int STDCALL ssl_calculate_write_length(SSL *ssl, int out_len);
 
+/**
+ * @brief Write out the state of a connection so that another thread or
+ * process can carry it on with ssl_import_state().
+ *
+ * The handshake must be complete (and not being redone). The state is the
+ * cipher, its keys and sequence numbers and any record that is only part
+ * read - the data that ssl_read() last returned isn't part of it. Once the
+ * state is written out this connection neither reads nor writes, and
+ * ssl_free() doesn't send a "Close Notify". The peer's certificate isn't
+ * kept.
+ * @param ssl [in] An SSL object reference.
+ * @param data [out] Where the state goes. If this is null, then only the
+ * size that is needed is worked out.
+ * @param len [in] The size of data.
+ * @return The number of bytes written (or needed), or SSL_NOT_OK if data is
+ * too small, the connection can't be moved or in skeleton mode.
+ * @note The state has the keys in the clear, so don't let it out of the
+ * machine. It is only read by the same version of this library.
+ */
+EXP_FUNC int STDCALL ssl_export_state(SSL *ssl, uint8_t *data, int len);
+
+/**
+ * @brief Carry on a connection from a state that ssl_export_state() wrote
+ * out.
+ *
+ * The file descriptor is the same connection (e.g. passed to this process
+ * over a unix domain socket). The new connection uses the options, key and
+ * certificates of ssl_ctx. If the old connection is in ssl_ctx as well, free
+ * it first so that ssl_find() can't find it instead.
+ * @param ssl_ctx [in] The client/server context.
+ * @param client_fd [in] The file descriptor.
+ * @param data [in] The exported state.
+ * @param len [in] The size of data.
+ * @return An SSL object reference, or null if the state is bad or in
+ * skeleton mode.
+ */
+EXP_FUNC SSL * STDCALL ssl_import_state(SSL_CTX *ssl_ctx, int client_fd, const uint8_t *data, int len);
+
 /**
  * @brief Find an ssl object based on a file descriptor.
  *
- * Goes through the list of SSL objects maintained in a client/server context
- * to look for a file descriptor match.
+ * Looks the file descriptor up in the table of SSL objects maintained in a 
+ * client/server context. This takes a constant time, however many 
+ * connections the context has.
  * @param ssl_ctx [in] The client/server context.
  * @param client_fd [in]  The file descriptor.
  * @return A reference to the SSL object. Returns null if the object could not 
@@ -515,6 +757,8 @@ EXP_FUNC int STDCALL ssl_renegotiate(SSL *ssl);
  * - SSL_OBJ_RSA_KEY (AES128/AES256 PEM encryption supported)
  * - SSL_OBJ_PKCS8 (RC4-128 encrypted data supported)
  * - SSL_OBJ_PKCS12 (RC4-128 encrypted data supported)
+ * - SSL_OBJ_RSA_PREPARED_KEY (no password required - see 
+ * tools/make_prepared_key.py)
  *
  * PEM files are automatically detected (if supported). The object type is
  * also detected, and so is not relevant for these types of files.
@@ -561,7 +805,8 @@ EXP_FUNC int STDCALL ssl_obj_memory_load(SSL_CTX *ssl_ctx, int obj_type, const u
  *      - SSL_X509_CERT_ORGANIZATIONAL_NAME is optional.
  * @param cert_data [out] The certificate as a sequence of bytes.
  * @return < 0 if an error, or the size of the certificate in bytes.
- * @note cert_data must be freed when there is no more need for it.
+ * @note cert_data must be freed when there is no more need for it (with
+ * ax_free(), which uses the allocator given to ssl_set_allocator()).
  */
 EXP_FUNC int STDCALL ssl_x509_create(SSL_CTX *ssl_ctx, uint32_t options, const char * dn[], uint8_t **cert_data);
 #endif
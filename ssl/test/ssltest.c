@@ -715,6 +715,38 @@ static int RSA_test(void)
         goto end;
     }
 
+    RSA_free(rsa_ctx);
+    rsa_ctx = NULL;
+
+    /* the same key, but prepared ahead of time */
+    len = get_file("../ssl/test/axTLS.key_1024.prepared", &buf);
+    if (RSA_priv_key_new_prepared(&rsa_ctx, buf, len) < 0)
+    {
+        printf("Error: PREPARED KEY failed\n");
+        goto end;
+    }
+
+    /* a key size that isn't the modulus' size is refused */
+    buf[6] = 0x00; buf[7] = 0x02;      /* 512 bytes */
+    {
+        RSA_CTX *bad_ctx = NULL;
+
+        if (RSA_priv_key_new_prepared(&bad_ctx, buf, len) == 0)
+        {
+            printf("Error: PREPARED KEY SIZE failed\n");
+            goto end;
+        }
+    }
+
+    free(buf);
+    memset(dec_data2, 0, sizeof(dec_data2));
+    RSA_decrypt(rsa_ctx, enc_data2, dec_data2, sizeof(dec_data2), 1);
+    if (memcmp("abc", dec_data2, 3))
+    {
+        printf("Error: DECRYPT #3 failed\n");
+        goto end;
+    }
+
     RSA_free(rsa_ctx);
     res = 0;
     printf("All RSA tests passed\n");
@@ -1207,6 +1239,30 @@ int SSL_server_tests(void)
                     DEFAULT_SVR_OPTION)))
         goto cleanup;
 
+    /*
+     * Session Ticket Reuse
+     */
+    if ((ret = SSL_server_test("Session Ticket Reuse", 
+                    "-cipher AES128-SHA -reconnect -tls1_2", 
+                    DEFAULT_CERT, NULL, DEFAULT_KEY, NULL, NULL,
+                    DEFAULT_SVR_OPTION|SSL_SESSION_TICKETS)))
+        goto cleanup;
+
+    /*
+     * Max Fragment Length
+     */
+    if ((ret = SSL_server_test("Max Fragment Length", 
+                    "-cipher AES128-SHA -maxfraglen 512 -tls1_2", 
+                    DEFAULT_CERT, NULL, DEFAULT_KEY, NULL, NULL,
+                    DEFAULT_SVR_OPTION)))
+        goto cleanup;
+
+    if ((ret = SSL_server_test("Release buffers", 
+                    "-cipher AES128-SHA -reconnect -tls1_2", 
+                    DEFAULT_CERT, NULL, DEFAULT_KEY, NULL, NULL,
+                    DEFAULT_SVR_OPTION|SSL_RELEASE_BUFFERS)))
+        goto cleanup;
+
     /* 
      * 1024 bit RSA key (check certificate chaining)
      */
@@ -1784,6 +1840,56 @@ int SSL_client_tests(void)
                     DEFAULT_CLNT_OPTION, NULL, NULL, NULL)))
         goto cleanup;
 
+    /* the server has no session cache, so only a ticket can resume */
+    sess_resume.start_server = 1;
+    sess_resume.stop_server = 0;
+    if ((ret = SSL_client_test("Session ticket", 
+                    &ssl_ctx,
+                    "-no_cache -cert ../ssl/test/axTLS.x509_1024.pem "
+                    "-key ../ssl/test/axTLS.key_1024.pem", 
+                    &sess_resume, 
+                    DEFAULT_CLNT_OPTION|SSL_SESSION_TICKETS, 
+                    NULL, NULL, NULL)))
+        goto cleanup;
+
+    sess_resume.start_server = 0;
+    sess_resume.stop_server = 1;
+    if ((ret = SSL_client_test("Client session ticket resumption", 
+                    &ssl_ctx, NULL, &sess_resume, 
+                    DEFAULT_CLNT_OPTION|SSL_SESSION_TICKETS, 
+                    NULL, NULL, NULL)))
+        goto cleanup;
+
+    /* the buffers have to come back for a renegotiation and a reconnect */
+    sess_resume.start_server = 1;
+    sess_resume.stop_server = 0;
+    if ((ret = SSL_client_test("Release buffers", 
+                    &ssl_ctx,
+                    "-cert ../ssl/test/axTLS.x509_1024.pem "
+                    "-key ../ssl/test/axTLS.key_1024.pem", 
+                    &sess_resume, 
+                    DEFAULT_CLNT_OPTION|SSL_RELEASE_BUFFERS, 
+                    NULL, NULL, NULL)))
+        goto cleanup;
+
+    sess_resume.start_server = 0;
+    sess_resume.do_reneg = 1;
+    if ((ret = SSL_client_test("Release buffers renegotiation", 
+                    &ssl_ctx, NULL, &sess_resume, 
+                    DEFAULT_CLNT_OPTION|SSL_RELEASE_BUFFERS, 
+                    NULL, NULL, NULL)))
+        goto cleanup;
+    sess_resume.do_reneg = 0;
+
+    sess_resume.stop_server = 1;
+    if ((ret = SSL_client_test("Release buffers after renegotiation", 
+                    &ssl_ctx, NULL, &sess_resume, 
+                    DEFAULT_CLNT_OPTION|SSL_RELEASE_BUFFERS, 
+                    NULL, NULL, NULL)))
+        goto cleanup;
+
+    sess_resume.stop_server = 0;
+
     if ((ret = SSL_client_test("1024 bit key", 
                     &ssl_ctx,
                     "-cert ../ssl/test/axTLS.x509_1024.pem "
@@ -1791,6 +1897,13 @@ int SSL_client_tests(void)
                     DEFAULT_CLNT_OPTION, NULL, NULL, NULL)))
         goto cleanup;
 
+    if ((ret = SSL_client_test("False start", 
+                    &ssl_ctx,
+                    "-cert ../ssl/test/axTLS.x509_1024.pem "
+                    "-key ../ssl/test/axTLS.key_1024.pem", NULL,
+                    DEFAULT_CLNT_OPTION|SSL_FALSE_START, NULL, NULL, NULL)))
+        goto cleanup;
+
     if ((ret = SSL_client_test("2048 bit key", 
                     &ssl_ctx,
                     "-cert ../ssl/test/axTLS.x509_2048.pem "
@@ -1854,6 +1967,16 @@ int SSL_client_tests(void)
                     DEFAULT_CLNT_OPTION, NULL, NULL, NULL)))
         goto cleanup;
 
+    /* the chain comes in records smaller than the certificates */
+    if ((ret = SSL_client_test("Server cert chaining - small records", 
+                    &ssl_ctx,
+                    "-cert ../ssl/test/axTLS.x509_device.pem "
+                    "-key ../ssl/test/axTLS.key_device.pem "
+                    "-cert_chain ../ssl/test/axTLS.x509_1024.pem "
+                    "-max_send_frag 512", NULL,
+                    DEFAULT_CLNT_OPTION, NULL, NULL, NULL)))
+        goto cleanup;
+
     /* Check the server can verify the client */
     if ((ret = SSL_client_test("Client peer authentication",
                     &ssl_ctx,
@@ -2219,176 +2342,1204 @@ error:
     return ret;
 }
 
-#if !defined(WIN32) && defined(CONFIG_SSL_CTX_MUTEXING)
+#ifndef WIN32
 /**************************************************************************
- * Multi-Threading Tests
+ * Loopback Testing (an axTLS client talking to an axTLS server)
  *
  **************************************************************************/
-#define NUM_THREADS         100
-
 typedef struct
 {
-    SSL_CTX *ssl_clnt_ctx;
-    int port;
-    int thread_id;
-} multi_t;
-
-void do_multi_clnt(multi_t *multi_data)
-{
-    int res = 1, client_fd, i;
-    SSL *ssl = NULL;
-    char tmp[5];
-
-    if ((client_fd = client_socket_init(multi_data->port)) < 0)
-        goto client_test_exit;
-
-    usleep(200000);
-    ssl = ssl_client_new(multi_data->ssl_clnt_ctx, client_fd, NULL, 0, NULL);
-
-    if ((res = ssl_handshake_status(ssl)))
-    {
-        printf("Client ");
-        ssl_display_error(res);
-        goto client_test_exit;
-    }
-
-    sprintf(tmp, "%d\n", multi_data->thread_id);
-    for (i = 0; i < 10; i++)
-        ssl_write(ssl, (uint8_t *)tmp, strlen(tmp)+1);
+    SSL_CTX *ssl_ctx;
+    int server_fd;
+    int renegotiate;
+    int resumed;
+} LOOPBACK_SVR;
 
-client_test_exit:
-    ssl_free(ssl);
-    SOCKET_CLOSE(client_fd);
-    free(multi_data);
-}
+/* who the last loopback server certificate was for and from ("" if none) */
+static char g_svr_org[64];
+static char g_svr_ca_org[64];
 
-void do_multi_svr(SSL *ssl)
+static void do_loopback_svr(LOOPBACK_SVR *svr)
 {
+    struct sockaddr_in client_addr;
+    socklen_t clnt_len = sizeof(client_addr);
     uint8_t *read_buf;
-    int *res_ptr = malloc(sizeof(int));
-    int res;
+    int client_fd, size;
+    SSL *ssl;
 
-    for (;;)
-    {
-        res = ssl_read(ssl, &read_buf);
+    if ((client_fd = accept(svr->server_fd, 
+                    (struct sockaddr *)&client_addr, &clnt_len)) < 0)
+        return;
 
-        /* kill the client */
-        if (res != SSL_OK)
+    if ((ssl = ssl_server_new(svr->ssl_ctx, client_fd)) != NULL)
+    {
+        /* echo back whatever comes in until the client goes */
+        while ((size = ssl_read(ssl, &read_buf)) >= SSL_OK)
         {
-            if (res == SSL_ERROR_CONN_LOST)
-            {
-                SOCKET_CLOSE(ssl->client_fd);
-                ssl_free(ssl);
-                break;
-            }
-            else if (res > 0)
-            {
-                /* do nothing */
-            }
-            else /* some problem */
+            if (size > 0)
             {
-                printf("Server ");
-                ssl_display_error(res);
-                goto error;
+                ssl_write(ssl, read_buf, size);
+
+                /* ask for a new handshake after the first lot */
+                if (svr->renegotiate && ssl_renegotiate(ssl) != SSL_OK)
+                    break;
+
+                svr->renegotiate = 0;
             }
         }
+
+        svr->resumed = IS_SET_SSL_FLAG(SSL_SESSION_RESUME) != 0;
+        ssl_free(ssl);
     }
 
-    res = SSL_OK;
-error:
-    *res_ptr = res;
-    pthread_exit(res_ptr);
+    SOCKET_CLOSE(client_fd);
 }
 
-int multi_thread_test(void)
+/*
+ * Make one connection and check that data gets through it. Returns 1 if the
+ * session was resumed (by both sides), 0 if it wasn't and < 0 on failure.
+ * resume_id is the session to resume (if any), and the session id that was
+ * used goes into session_id (if it isn't NULL). If renegotiate is set, the
+ * server asks for a new handshake after the echo, which the client turns down.
+ */
+static int loopback_connect(SSL_CTX *svr_ctx, SSL_CTX *clnt_ctx, 
+        const char *host_name, const uint8_t *resume_id, uint8_t *session_id,
+        int renegotiate)
 {
-    int server_fd = -1;
-    SSL_CTX *ssl_server_ctx;
-    SSL_CTX *ssl_clnt_ctx;
-    pthread_t clnt_threads[NUM_THREADS];
-    pthread_t svr_threads[NUM_THREADS];
-    int i, res = 0;
-    struct sockaddr_in client_addr;
-    socklen_t clnt_len = sizeof(client_addr);
+    LOOPBACK_SVR svr;
+    SSL_EXTENSIONS *ssl_ext = NULL;
+    SSL *ssl = NULL;
+    const char *org;
+    uint8_t *read_buf;
+    int client_fd, size, ret = -1;
+    pthread_t thread;
 
-    printf("Do multi-threading test (takes a minute)\n");
+    g_svr_org[0] = g_svr_ca_org[0] = 0;
+    svr.ssl_ctx = svr_ctx;
+    svr.renegotiate = renegotiate;
+    svr.resumed = -1;
 
-    ssl_svr_ctx = ssl_ctx_new(DEFAULT_SVR_OPTION, SSL_DEFAULT_SVR_SESS);
-    if ((ret = ssl_obj_load(ssl_svr_ctx, SSL_OBJ_X509_CERT, 
-                    "../ssl/test/axTLS.x509_1024.pem", NULL)) != SSL_OK)
-        goto error;
+    if ((svr.server_fd = server_socket_init(&g_port)) < 0)
+        return -1;
 
-    if ((ret = ssl_obj_load(ssl_svr_ctx, SSL_OBJ_RSA_KEY, 
-                    "../ssl/test/axTLS.key_1024.pem", NULL)) != SSL_OK)
+    pthread_create(&thread, NULL, 
+                (void *(*)(void *))do_loopback_svr, (void *)&svr);
+
+    if ((client_fd = client_socket_init(g_port)) < 0)
+    {
+        shutdown(svr.server_fd, SHUT_RDWR);     /* stop the accept() */
         goto error;
-    ssl_clnt_ctx = ssl_ctx_new(DEFAULT_CLNT_OPTION, SSL_DEFAULT_CLNT_SESS);
+    }
 
-    if (ssl_obj_load(ssl_clnt_ctx, SSL_OBJ_X509_CACERT, 
-                                        "../ssl/test/axTLS.ca_x509.cer", NULL))
+    if (host_name)
+    {
+        ssl_ext = ssl_ext_new();
+        ssl_ext_set_host_name(ssl_ext, host_name);
+    }
+
+    ssl = ssl_client_new(clnt_ctx, client_fd, resume_id, 
+                            resume_id ? SSL_SESSION_ID_SIZE : 0, ssl_ext);
+
+    if (ssl == NULL || ssl_handshake_status(ssl) != SSL_OK ||
+                ssl_write(ssl, (uint8_t *)"hello", 5) != 5)
         goto error;
 
-    if ((server_fd = server_socket_init(&g_port)) < 0)
+    org = ssl_get_cert_dn(ssl, SSL_X509_CERT_ORGANIZATION);
+    strncpy(g_svr_org, org ? org : "", sizeof(g_svr_org)-1);
+    org = ssl_get_cert_dn(ssl, SSL_X509_CA_CERT_ORGANIZATION);
+    strncpy(g_svr_ca_org, org ? org : "", sizeof(g_svr_ca_org)-1);
+
+    while ((size = ssl_read(ssl, &read_buf)) == SSL_OK);
+
+    if (size != 5 || memcmp(read_buf, "hello", 5))
         goto error;
 
-    for (i = 0; i < NUM_THREADS; i++)
+    /* there's no renegotiation once connected, so the client says no */
+    if (renegotiate)
     {
-        multi_t *multi_data = (multi_t *)malloc(sizeof(multi_t));
-        multi_data->ssl_clnt_ctx = ssl_clnt_ctx;
-        multi_data->port = g_port;
-        multi_data->thread_id = i+1;
-        pthread_create(&clnt_threads[i], NULL, 
-                (void *(*)(void *))do_multi_clnt, (void *)multi_data);
-        pthread_detach(clnt_threads[i]);
+        while ((size = ssl_read(ssl, &read_buf)) == SSL_OK);
+
+        if (size != SSL_ERROR_NO_CLIENT_RENOG)
+            goto error;
     }
 
-    for (i = 0; i < NUM_THREADS; i++)
-    { 
-        SSL *ssl_svr;
-        int client_fd = accept(server_fd, 
-                      (struct sockaddr *)&client_addr, &clnt_len);
+    if (session_id)
+        memcpy(session_id, ssl_get_session_id(ssl), SSL_SESSION_ID_SIZE);
 
-        if (client_fd < 0)
-            goto error;
+    ret = IS_SET_SSL_FLAG(SSL_SESSION_RESUME) != 0;
 
-        ssl_svr = ssl_server_new(ssl_server_ctx, client_fd);
+error:
+    ssl_free(ssl);
+    SOCKET_CLOSE(client_fd);
+    pthread_join(thread, NULL);
+    SOCKET_CLOSE(svr.server_fd);
 
-        pthread_create(&svr_threads[i], NULL, 
-                        (void *(*)(void *))do_multi_svr, (void *)ssl_svr);
+    if (ret >= 0 && svr.resumed != ret)
+        ret = -1;
+
+    return ret;
+}
+
+static SSL_CTX *loopback_svr_ctx(uint32_t options, int num_sessions)
+{
+    SSL_CTX *ssl_ctx = ssl_ctx_new(options, num_sessions);
+
+    if (ssl_obj_load(ssl_ctx, SSL_OBJ_X509_CERT, 
+                    "../ssl/test/axTLS.x509_1024.pem", NULL) != SSL_OK ||
+            ssl_obj_load(ssl_ctx, SSL_OBJ_RSA_KEY, 
+                    "../ssl/test/axTLS.key_1024.pem", NULL) != SSL_OK)
+    {
+        ssl_ctx_free(ssl_ctx);
+        ssl_ctx = NULL;
     }
 
-    /* make sure we've run all of the threads */
-    for (i = 0; i < NUM_THREADS; i++)
+    return ssl_ctx;
+}
+
+/**************************************************************************
+ * Session cache test (the least recently used session goes, and expired 
+ * sessions aren't resumed)
+ *
+ **************************************************************************/
+static int session_cache_test(void)
+{
+    SSL_CTX *svr_ctx = loopback_svr_ctx(DEFAULT_SVR_OPTION, 2);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(
+                    DEFAULT_CLNT_OPTION|SSL_SERVER_VERIFY_LATER, 10);
+    uint8_t id[3][SSL_SESSION_ID_SIZE];
+    SSL_SESSION *sess;
+    int i, res = 1;
+
+    if (svr_ctx == NULL)
+        goto error;
+
+    /* three sessions for a cache of two, so the first one goes */
+    for (i = 0; i < 3; i++)
     {
-        void *thread_res;
-        pthread_join(svr_threads[i], &thread_res);
+        if (loopback_connect(svr_ctx, clnt_ctx, NULL, NULL, id[i], 0) != 0)
+            goto error;
+    }
 
-        if (*((int *)thread_res) != 0)
-            res = 1;
+    if (loopback_connect(svr_ctx, clnt_ctx, NULL, id[1], NULL, 0) != 1 ||
+            loopback_connect(svr_ctx, clnt_ctx, NULL, id[0], NULL, 0) != 0)
+        goto error;
 
-        free(thread_res);
-    } 
+    /* the new session took the place of the third, as the second was used */
+    if (loopback_connect(svr_ctx, clnt_ctx, NULL, id[1], NULL, 0) != 1 ||
+            loopback_connect(svr_ctx, clnt_ctx, NULL, id[2], NULL, 0) != 0)
+        goto error;
 
-    if (res) 
+    /* make the second one old enough to have expired */
+    for (sess = svr_ctx->sess_head; sess; sess = sess->next)
+    {
+        if (memcmp(sess->session_id, id[1], SSL_SESSION_ID_SIZE) == 0)
+            sess->conn_time -= SSL_EXPIRY_TIME+1;
+    }
+
+    if (loopback_connect(svr_ctx, clnt_ctx, NULL, id[1], NULL, 0) != 0)
         goto error;
 
-    printf("Multi-thread test passed (%d)\n", NUM_THREADS);
+    res = 0;
+
 error:
-    ssl_ctx_free(ssl_svr_ctx);
-    ssl_ctx_free(ssl_clnt_ctx);
-    SOCKET_CLOSE(server_fd);
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(clnt_ctx);
+    printf(res == 0 ? "SSL session cache test passed\n" : 
+                        "SSL session cache test failed\n");
+    TTY_FLUSH();
     return res;
 }
-#endif /* !defined(WIN32) && defined(CONFIG_SSL_CTX_MUTEXING) */ 
-
 /**************************************************************************
- * Header issue
+ * Session store test (a context without a cache of its own resumes a 
+ * session that another context made)
  *
  **************************************************************************/
-//static void do_header_issue(void)
-//{
-//    char axtls_buf[2048];
-//#ifndef WIN32
-//    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+#define STORE_SIZE          8
+
+typedef struct
+{
+    uint8_t session_id[STORE_SIZE][SSL_SESSION_ID_SIZE];
+    uint8_t master_secret[STORE_SIZE][SSL_SECRET_SIZE];
+    time_t conn_time[STORE_SIZE];
+    int num_sessions;
+} SESSION_STORE;
+
+static int store_find(SESSION_STORE *store, const uint8_t *session_id)
+{
+    int i;
+
+    for (i = 0; i < store->num_sessions; i++)
+    {
+        if (memcmp(store->session_id[i], session_id, SSL_SESSION_ID_SIZE) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static void store_new(void *arg, const uint8_t *session_id, 
+        const uint8_t *master_secret, time_t conn_time)
+{
+    SESSION_STORE *store = (SESSION_STORE *)arg;
+    int i = store->num_sessions;
+
+    if (i < STORE_SIZE)
+    {
+        memcpy(store->session_id[i], session_id, SSL_SESSION_ID_SIZE);
+        memcpy(store->master_secret[i], master_secret, SSL_SECRET_SIZE);
+        store->conn_time[i] = conn_time;
+        store->num_sessions++;
+    }
+}
+
+static int store_get(void *arg, const uint8_t *session_id, 
+        uint8_t *master_secret, time_t *conn_time)
+{
+    SESSION_STORE *store = (SESSION_STORE *)arg;
+    int i = store_find(store, session_id);
+
+    if (i < 0)
+        return SSL_NOT_OK;
+
+    memcpy(master_secret, store->master_secret[i], SSL_SECRET_SIZE);
+    *conn_time = store->conn_time[i];
+    return SSL_OK;
+}
+
+static void store_remove(void *arg, const uint8_t *session_id)
+{
+    SESSION_STORE *store = (SESSION_STORE *)arg;
+    int i = store_find(store, session_id);
+
+    if (i >= 0)
+        memset(store->session_id[i], 0, SSL_SESSION_ID_SIZE);
+}
+
+static int session_store_test(void)
+{
+    SESSION_STORE store;
+    SSL_CTX *svr_ctx = loopback_svr_ctx(DEFAULT_SVR_OPTION, 
+                                            SSL_DEFAULT_SVR_SESS);
+    SSL_CTX *svr2_ctx = loopback_svr_ctx(DEFAULT_SVR_OPTION, 0);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(
+                    DEFAULT_CLNT_OPTION|SSL_SERVER_VERIFY_LATER, 5);
+    uint8_t id[SSL_SESSION_ID_SIZE];
+    int res = 1;
+
+    memset(&store, 0, sizeof(store));
+
+    if (svr_ctx == NULL || svr2_ctx == NULL ||
+            ssl_ctx_set_session_store(svr_ctx, store_new, store_get, 
+                                        store_remove, &store) != SSL_OK ||
+            ssl_ctx_set_session_store(svr2_ctx, store_new, store_get, 
+                                        store_remove, &store) != SSL_OK)
+        goto error;
+
+    if (loopback_connect(svr_ctx, clnt_ctx, NULL, NULL, id, 0) != 0 ||
+            store_find(&store, id) < 0)
+        goto error;
+
+    /* the other context only has the store to go on */
+    if (loopback_connect(svr2_ctx, clnt_ctx, NULL, id, NULL, 0) != 1)
+        goto error;
+
+    /* but not once the session has gone from it */
+    store_remove(&store, id);
+
+    if (loopback_connect(svr2_ctx, clnt_ctx, NULL, id, NULL, 0) != 0)
+        goto error;
+
+    res = 0;
+
+error:
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(svr2_ctx);
+    ssl_ctx_free(clnt_ctx);
+    printf(res == 0 ? "SSL session store test passed\n" : 
+                        "SSL session store test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+/**************************************************************************
+ * Session export test (a client resumes by host name, also with sessions 
+ * that another context saved)
+ *
+ **************************************************************************/
+static int session_export_test(void)
+{
+    SSL_CTX *svr_ctx = loopback_svr_ctx(DEFAULT_SVR_OPTION, 
+                                            SSL_DEFAULT_SVR_SESS);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(
+                    DEFAULT_CLNT_OPTION|SSL_SERVER_VERIFY_LATER, 5);
+    SSL_CTX *clnt2_ctx = ssl_ctx_new(
+                    DEFAULT_CLNT_OPTION|SSL_SERVER_VERIFY_LATER, 5);
+    uint8_t *data = NULL;
+    int len, res = 1;
+
+    if (svr_ctx == NULL)
+        goto error;
+
+    /* the second connection to a host resumes the session of the first */
+    if (loopback_connect(svr_ctx, clnt_ctx, "localhost", NULL, NULL, 0) != 0 ||
+            loopback_connect(svr_ctx, clnt_ctx, 
+                                    "localhost", NULL, NULL, 0) != 1 ||
+            loopback_connect(svr_ctx, clnt_ctx, 
+                                "localhost.localdomain", NULL, NULL, 0) != 0)
+        goto error;
+
+    if ((len = ssl_ctx_export_sessions(clnt_ctx, NULL, 0)) <= 0 ||
+            (data = (uint8_t *)malloc(len)) == NULL ||
+            ssl_ctx_export_sessions(clnt_ctx, data, len) != len ||
+            ssl_ctx_export_sessions(clnt_ctx, data, len-1) != SSL_NOT_OK)
+        goto error;
+
+    if (ssl_ctx_import_sessions(clnt2_ctx, data, len-1) != SSL_NOT_OK ||
+            ssl_ctx_import_sessions(clnt2_ctx, data, len) != 2)
+        goto error;
+
+    if (loopback_connect(svr_ctx, clnt2_ctx, "localhost", NULL, NULL, 0) != 1 ||
+            loopback_connect(svr_ctx, clnt2_ctx, 
+                                "localhost.localdomain", NULL, NULL, 0) != 1)
+        goto error;
+
+    res = 0;
+
+error:
+    free(data);
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(clnt_ctx);
+    ssl_ctx_free(clnt2_ctx);
+    printf(res == 0 ? "SSL session export test passed\n" : 
+                        "SSL session export test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+
+/**************************************************************************
+ * State export test (a connection carries on from its exported state in a
+ * fresh context)
+ *
+ **************************************************************************/
+static int state_echo(SSL *ssl, const char *msg)
+{
+    uint8_t *read_buf;
+    int len = strlen(msg), got = 0, size;
+
+    if (ssl_write(ssl, (uint8_t *)msg, len) != len)
+        return -1;
+
+    while (got < len)
+    {
+        while ((size = ssl_read(ssl, &read_buf)) == SSL_OK);
+
+        if (size < 0 || got + size > len || memcmp(read_buf, &msg[got], size))
+            return -1;
+
+        got += size;
+    }
+
+    return 0;
+}
+
+static int state_export_test(void)
+{
+    SSL_CTX *svr_ctx = loopback_svr_ctx(DEFAULT_SVR_OPTION, 
+                                            SSL_DEFAULT_SVR_SESS);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(
+                    DEFAULT_CLNT_OPTION|SSL_SERVER_VERIFY_LATER, 0);
+    SSL_CTX *clnt2_ctx = ssl_ctx_new(DEFAULT_CLNT_OPTION, 0);
+    LOOPBACK_SVR svr;
+    SSL *ssl = NULL;
+    uint8_t *data = NULL, *read_buf;
+    int client_fd = -1, len, res = 1;
+    pthread_t thread;
+
+    if (svr_ctx == NULL)
+        goto end;
+
+    svr.ssl_ctx = svr_ctx;
+    svr.renegotiate = 0;
+
+    if ((svr.server_fd = server_socket_init(&g_port)) < 0)
+        goto end;
+
+    pthread_create(&thread, NULL, 
+                (void *(*)(void *))do_loopback_svr, (void *)&svr);
+
+    if ((client_fd = client_socket_init(g_port)) < 0)
+    {
+        shutdown(svr.server_fd, SHUT_RDWR);     /* stop the accept() */
+        goto error;
+    }
+
+    ssl = ssl_client_new(clnt_ctx, client_fd, NULL, 0, NULL);
+
+    if (ssl == NULL || ssl_handshake_status(ssl) != SSL_OK ||
+            state_echo(ssl, "before") < 0)
+        goto error;
+
+    /* once it has been written out, the old connection stops */
+    if ((len = ssl_export_state(ssl, NULL, 0)) <= 0 ||
+            (data = (uint8_t *)malloc(len)) == NULL ||
+            ssl_export_state(ssl, data, len-1) != SSL_NOT_OK ||
+            ssl_export_state(ssl, data, len) != len ||
+            ssl_read(ssl, &read_buf) != SSL_CLOSE_NOTIFY ||
+            ssl_write(ssl, (uint8_t *)"x", 1) >= 0)
+        goto error;
+
+    ssl_free(ssl);
+
+    /* a short or a damaged state is turned down */
+    if ((ssl = ssl_import_state(clnt2_ctx, client_fd, data, len-1)) != NULL)
+        goto error;
+
+    data[0] ^= 1;
+    ssl = ssl_import_state(clnt2_ctx, client_fd, data, len);
+    data[0] ^= 1;
+
+    if (ssl != NULL)
+        goto error;
+
+    /* and the new one carries on, both ways */
+    if ((ssl = ssl_import_state(clnt2_ctx, client_fd, data, len)) == NULL ||
+            ssl_find(clnt2_ctx, client_fd) != ssl ||
+            state_echo(ssl, "after") < 0 || 
+            state_echo(ssl, "and again") < 0)
+        goto error;
+
+    res = 0;
+
+error:
+    ssl_free(ssl);
+    SOCKET_CLOSE(client_fd);
+    pthread_join(thread, NULL);
+    SOCKET_CLOSE(svr.server_fd);
+
+end:
+    free(data);
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(clnt_ctx);
+    ssl_ctx_free(clnt2_ctx);
+    printf(res == 0 ? "SSL state export test passed\n" : 
+                        "SSL state export test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+
+/**************************************************************************
+ * Renegotiation tests (a certificate bigger than the record buffer goes out 
+ * in records that keep to a 512 byte max fragment, in the clear and when 
+ * renegotiated, and a renegotiation can resume with a ticket)
+ *
+ **************************************************************************/
+
+/*
+ * Make one connection that the server asks to renegotiate after the first 
+ * lot of data, and that the client then does. Returns 1 if the second 
+ * handshake resumed the session (on both sides), 0 if it didn't and < 0 on 
+ * failure. The connection has the extensions (if any).
+ */
+static int renegotiate_connect(SSL_CTX *svr_ctx, SSL_CTX *clnt_ctx, 
+        SSL_EXTENSIONS *ssl_ext)
+{
+    LOOPBACK_SVR svr;
+    SSL *ssl = NULL;
+    int client_fd, ret = -1;
+    pthread_t thread;
+
+    svr.ssl_ctx = svr_ctx;
+    svr.renegotiate = 1;
+    svr.resumed = -1;
+
+    if ((svr.server_fd = server_socket_init(&g_port)) < 0)
+    {
+        ssl_ext_free(ssl_ext);
+        return -1;
+    }
+
+    pthread_create(&thread, NULL, 
+                (void *(*)(void *))do_loopback_svr, (void *)&svr);
+
+    if ((client_fd = client_socket_init(g_port)) < 0)
+    {
+        ssl_ext_free(ssl_ext);
+        shutdown(svr.server_fd, SHUT_RDWR);     /* stop the accept() */
+        goto error;
+    }
+
+    ssl = ssl_client_new(clnt_ctx, client_fd, NULL, 0, ssl_ext);
+
+    if (ssl == NULL || ssl_handshake_status(ssl) != SSL_OK ||
+            state_echo(ssl, "before") < 0)
+        goto error;
+
+    /* the server's hello request is ignored, as we've started already */
+    if (ssl_renegotiate(ssl) != SSL_OK || 
+            ssl_handshake_status(ssl) != SSL_OK ||
+            state_echo(ssl, "after") < 0)
+        goto error;
+
+    ret = IS_SET_SSL_FLAG(SSL_SESSION_RESUME) != 0;
+
+error:
+    ssl_free(ssl);
+    SOCKET_CLOSE(client_fd);
+    pthread_join(thread, NULL);
+    SOCKET_CLOSE(svr.server_fd);
+
+    if (ret >= 0 && svr.resumed != ret)
+        ret = -1;
+
+    return ret;
+}
+
+static int record_limit_test(void)
+{
+    SSL_CTX *svr_ctx = ssl_ctx_new(DEFAULT_SVR_OPTION, 0);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(
+                    DEFAULT_CLNT_OPTION|SSL_SERVER_VERIFY_LATER, 0);
+    SSL_EXTENSIONS *ssl_ext;
+    int res = 1;
+
+    if (ssl_obj_load(svr_ctx, SSL_OBJ_X509_CERT, 
+                    "../ssl/test/axTLS.x509_big.pem", NULL) != SSL_OK ||
+            ssl_obj_load(svr_ctx, SSL_OBJ_RSA_KEY, 
+                    "../ssl/test/axTLS.key_1024.pem", NULL) != SSL_OK)
+        goto error;
+
+    /* the client turns down any record bigger than it asked for, and this
+       time the certificate is encrypted */
+    ssl_ext = ssl_ext_new();
+    ssl_ext_set_max_fragment_size(ssl_ext, 1);
+
+    if (renegotiate_connect(svr_ctx, clnt_ctx, ssl_ext) != 0)
+        goto error;
+
+    res = 0;
+
+error:
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(clnt_ctx);
+    printf(res == 0 ? "SSL record limit test passed\n" : 
+                        "SSL record limit test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+
+
+/*
+ * An allocator that has no memory for the ticket keys.
+ */
+static void *no_ticket_key_alloc(void *arg, size_t size, int hint)
+{
+    return size == 2*sizeof(SSL_TICKET_KEY) ? NULL : malloc(size);
+}
+
+static void *no_ticket_key_realloc(void *arg, void *ptr, 
+                                            size_t size, int hint)
+{
+    return realloc(ptr, size);
+}
+
+static void no_ticket_key_free(void *arg, void *ptr)
+{
+    free(ptr);
+}
+
+static int renegotiate_ticket_test(void)
+{
+    SSL_CTX *svr_ctx = loopback_svr_ctx(
+                    DEFAULT_SVR_OPTION|SSL_SESSION_TICKETS, 5);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(DEFAULT_CLNT_OPTION|
+                    SSL_SERVER_VERIFY_LATER|SSL_SESSION_TICKETS, 5);
+    SSL_CTX *svr2_ctx = NULL;
+    SSL_EXTENSIONS *ssl_ext;
+    uint8_t key[64];
+    int res = 1;
+
+    if (svr_ctx == NULL)
+        goto error;
+
+    /* the client offers its session again (with the ticket from the first
+       handshake) when it has one for the host. That resumes the second 
+       handshake, which doesn't promise (or send) another ticket */
+    ssl_ext = ssl_ext_new();
+    ssl_ext_set_host_name(ssl_ext, "localhost");
+
+    if (renegotiate_connect(svr_ctx, clnt_ctx, ssl_ext) != 1)
+        goto error;
+
+    /* a server with no memory for its ticket keys sends an empty ticket, 
+       which is still a handshake that completes */
+    ssl_set_allocator(no_ticket_key_alloc, no_ticket_key_realloc, 
+                                            no_ticket_key_free, NULL);
+    memset(key, 0x5a, sizeof(key));
+
+    if ((svr2_ctx = loopback_svr_ctx(
+                    DEFAULT_SVR_OPTION|SSL_SESSION_TICKETS, 0)) == NULL ||
+            ssl_ctx_set_ticket_key(svr2_ctx, key) != SSL_NOT_OK ||
+            loopback_connect(svr2_ctx, clnt_ctx, NULL, NULL, NULL, 0) != 0)
+        goto error;
+
+    res = 0;
+
+error:
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(svr2_ctx);
+    ssl_ctx_free(clnt_ctx);
+    ssl_set_allocator(NULL, NULL, NULL, NULL);
+    printf(res == 0 ? "SSL renegotiate ticket test passed\n" : 
+                        "SSL renegotiate ticket test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+
+/**************************************************************************
+ * Release buffers test (the buffers come back for a resumed session and 
+ * for a renegotiation request)
+ *
+ **************************************************************************/
+static int release_buffers_test(void)
+{
+    SSL_CTX *svr_ctx = loopback_svr_ctx(
+                    DEFAULT_SVR_OPTION|SSL_RELEASE_BUFFERS, 5);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(DEFAULT_CLNT_OPTION|
+                    SSL_SERVER_VERIFY_LATER|SSL_RELEASE_BUFFERS, 5);
+    uint8_t id[SSL_SESSION_ID_SIZE];
+    int res = 1;
+
+    if (svr_ctx == NULL || clnt_ctx == NULL)
+        goto error;
+
+    if (loopback_connect(svr_ctx, clnt_ctx, NULL, NULL, id, 0) != 0 ||
+            loopback_connect(svr_ctx, clnt_ctx, NULL, id, NULL, 0) != 1 ||
+            loopback_connect(svr_ctx, clnt_ctx, NULL, id, NULL, 1) != 1)
+        goto error;
+
+    /* the alert that turned the handshake down took the session with it */
+    if (loopback_connect(svr_ctx, clnt_ctx, NULL, id, NULL, 1) != 0)
+        goto error;
+
+    res = 0;
+
+error:
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(clnt_ctx);
+    printf(res == 0 ? "SSL release buffers test passed\n" : 
+                        "SSL release buffers test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+
+/**************************************************************************
+ * Buffer pool test (connections at the same time share the released 
+ * buffers, and only take one of their own record size)
+ *
+ **************************************************************************/
+#define NUM_POOL_CONNS      4
+#define SMALL_BUF_SIZE      (512+RT_EXTRA)
+
+/*
+ * Have NUM_POOL_CONNS connections open at once and get data through each 
+ * of them. The first num_small ask for 512 byte records.
+ */
+static int pool_connect(SSL_CTX *svr_ctx, SSL_CTX *clnt_ctx, int num_small)
+{
+    LOOPBACK_SVR svr[NUM_POOL_CONNS];
+    pthread_t thread[NUM_POOL_CONNS];
+    SSL *ssl[NUM_POOL_CONNS];
+    int client_fd[NUM_POOL_CONNS];
+    uint8_t *read_buf;
+    int server_fd, i, size, ret = -1;
+
+    if ((server_fd = server_socket_init(&g_port)) < 0)
+        return -1;
+
+    for (i = 0; i < NUM_POOL_CONNS; i++)
+    {
+        svr[i].ssl_ctx = svr_ctx;
+        svr[i].server_fd = server_fd;
+        svr[i].renegotiate = 0;
+        svr[i].resumed = -1;
+        pthread_create(&thread[i], NULL, 
+                (void *(*)(void *))do_loopback_svr, (void *)&svr[i]);
+        ssl[i] = NULL;
+        client_fd[i] = -1;
+    }
+
+    for (i = 0; i < NUM_POOL_CONNS; i++)
+    {
+        SSL_EXTENSIONS *ssl_ext = NULL;
+
+        if ((client_fd[i] = client_socket_init(g_port)) < 0)
+            goto error;
+
+        if (i < num_small)
+        {
+            ssl_ext = ssl_ext_new();
+            ssl_ext_set_max_fragment_size(ssl_ext, 1);
+        }
+
+        ssl[i] = ssl_client_new(clnt_ctx, client_fd[i], NULL, 0, ssl_ext);
+
+        if (ssl_handshake_status(ssl[i]) != SSL_OK)
+            goto error;
+    }
+
+    /* the servers are all idle now, so all the buffers go at once */
+    for (i = 0; i < NUM_POOL_CONNS; i++)
+    {
+        if (ssl_write(ssl[i], (uint8_t *)"hello", 5) != 5)
+            goto error;
+    }
+
+    for (i = 0; i < NUM_POOL_CONNS; i++)
+    {
+        while ((size = ssl_read(ssl[i], &read_buf)) == SSL_OK);
+
+        if (size != 5 || memcmp(read_buf, "hello", 5))
+            goto error;
+    }
+
+    ret = 0;
+
+error:
+    for (i = 0; i < NUM_POOL_CONNS; i++)
+    {
+        ssl_free(ssl[i]);
+        SOCKET_CLOSE(client_fd[i]);
+    }
+
+    shutdown(server_fd, SHUT_RDWR);     /* stop any accept() left */
+
+    for (i = 0; i < NUM_POOL_CONNS; i++)
+        pthread_join(thread[i], NULL);
+
+    SOCKET_CLOSE(server_fd);
+    return ret;
+}
+
+static int pool_count(SSL_CTX *ssl_ctx, size_t size)
+{
+    SSL_POOL_BUF *b;
+    int num = 0;
+
+    for (b = ssl_ctx->buf_pool; b; b = b->next)
+    {
+        if (b->size == size)
+            num++;
+    }
+
+    return num;
+}
+
+static int buffer_pool_test(void)
+{
+    SSL_CTX *svr_ctx = loopback_svr_ctx(
+                    DEFAULT_SVR_OPTION|SSL_RELEASE_BUFFERS, 0);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(
+                    DEFAULT_CLNT_OPTION|SSL_SERVER_VERIFY_LATER, 0);
+    int res = 1;
+
+    if (svr_ctx == NULL || clnt_ctx == NULL)
+        goto error;
+
+    /* room for every buffer there could be, so none are lost to a full pool */
+    ssl_ctx_set_buffer_pool(svr_ctx, 2*NUM_POOL_CONNS);
+
+    /* the connection with small records has had just the one small buffer */
+    if (pool_connect(svr_ctx, clnt_ctx, 1) < 0 ||
+            pool_count(svr_ctx, SMALL_BUF_SIZE) != 1 ||
+            pool_count(svr_ctx, RT_DEFAULT_PLAIN_LENGTH+RT_EXTRA) + 1 != 
+                                                    svr_ctx->num_pool_bufs)
+        goto error;
+
+    /* none of these can use the small one, so it's still there */
+    if (pool_connect(svr_ctx, clnt_ctx, 0) < 0 ||
+            pool_count(svr_ctx, SMALL_BUF_SIZE) != 1 ||
+            svr_ctx->num_pool_bufs > NUM_POOL_CONNS+1)
+        goto error;
+
+    ssl_ctx_set_buffer_pool(svr_ctx, 0);
+
+    if (svr_ctx->num_pool_bufs != 0 || svr_ctx->buf_pool != NULL)
+        goto error;
+
+    res = 0;
+
+error:
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(clnt_ctx);
+    printf(res == 0 ? "SSL buffer pool test passed\n" : 
+                        "SSL buffer pool test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+
+/**************************************************************************
+ * SNI test (hosts are found by name or wildcard, can be replaced and 
+ * removed, and their sessions and tickets only resume for them)
+ *
+ **************************************************************************/
+#define PROJECT_ORG         "axTLS Project"
+#define INTER_CA_ORG        "axTLS Project Intermediate CA"
+#define DODGY_CA_ORG        "axTLS Project Dodgy Certificate Authority"
+
+/*
+ * Give a server the axTLS.x509_<name>.pem certificate (and its key) for a 
+ * host.
+ */
+static int sni_add_host(SSL_CTX *svr_ctx, const char *host_name, 
+        const char *name)
+{
+    SSL_CTX *host_ctx = ssl_ctx_new(DEFAULT_SVR_OPTION, 0);
+    char cert[64], key[64];
+    int ret = SSL_NOT_OK;
+
+    sprintf(cert, "../ssl/test/axTLS.x509_%s.pem", name);
+    sprintf(key, "../ssl/test/axTLS.key_%s.pem", name);
+
+    if (ssl_obj_load(host_ctx, SSL_OBJ_X509_CERT, cert, NULL) == SSL_OK &&
+            ssl_obj_load(host_ctx, SSL_OBJ_RSA_KEY, key, NULL) == SSL_OK)
+        ret = ssl_ctx_add_host(svr_ctx, host_name, host_ctx);
+
+    ssl_ctx_free(host_ctx);
+    return ret;
+}
+
+/*
+ * Make a full handshake with a host and check whose certificate it sent. 
+ * The default one is axTLS.x509_1024.pem.
+ */
+static int sni_connect(SSL_CTX *svr_ctx, SSL_CTX *clnt_ctx, 
+        const char *host_name, const char *org, const char *ca_org, 
+        uint8_t *session_id)
+{
+    if (loopback_connect(svr_ctx, clnt_ctx, host_name, NULL, 
+                                                session_id, 0) != 0 || 
+            strcmp(g_svr_org, org) || strcmp(g_svr_ca_org, ca_org))
+        return -1;
+
+    return 0;
+}
+
+static int sni_test(void)
+{
+    SSL_CTX *svr_ctx = loopback_svr_ctx(DEFAULT_SVR_OPTION, 10);
+    SSL_CTX *tkt_ctx = loopback_svr_ctx(
+                            DEFAULT_SVR_OPTION|SSL_SESSION_TICKETS, 0);
+    SSL_CTX *clnt_ctx = ssl_ctx_new(DEFAULT_CLNT_OPTION|
+                            SSL_SERVER_VERIFY_LATER|SSL_SESSION_TICKETS, 10);
+    uint8_t id[SSL_SESSION_ID_SIZE];
+    int res = 1;
+
+    if (svr_ctx == NULL || tkt_ctx == NULL || clnt_ctx == NULL)
+        goto error;
+
+    if (sni_add_host(svr_ctx, "ca.example", "intermediate_ca") != SSL_OK ||
+            sni_add_host(svr_ctx, "*.wild.example", 
+                                        "intermediate_ca") != SSL_OK ||
+            ssl_ctx_add_host(svr_ctx, "nothere.example", NULL) != SSL_NOT_OK)
+        goto error;
+
+    /* the name (in any case) or a wildcard picks the host */
+    if (sni_connect(svr_ctx, clnt_ctx, "CA.Example", 
+                                INTER_CA_ORG, DODGY_CA_ORG, id) ||
+            sni_connect(svr_ctx, clnt_ctx, "a.wild.example", 
+                                INTER_CA_ORG, DODGY_CA_ORG, NULL) ||
+            sni_connect(svr_ctx, clnt_ctx, "wild.example", 
+                                PROJECT_ORG, DODGY_CA_ORG, NULL) ||
+            sni_connect(svr_ctx, clnt_ctx, "a.b.wild.example", 
+                                PROJECT_ORG, DODGY_CA_ORG, NULL) ||
+            sni_connect(svr_ctx, clnt_ctx, NULL, 
+                                PROJECT_ORG, DODGY_CA_ORG, NULL))
+        goto error;
+
+    /* the session is only for the name it was made with */
+    if (loopback_connect(svr_ctx, clnt_ctx, NULL, id, NULL, 0) != 0 ||
+            loopback_connect(svr_ctx, clnt_ctx, 
+                                "a.wild.example", id, NULL, 0) != 0 ||
+            loopback_connect(svr_ctx, clnt_ctx, 
+                                "ca.example", id, NULL, 0) != 1)
+        goto error;
+
+    /* a replaced host has the new certificate, and a removed one goes */
+    if (sni_add_host(svr_ctx, "ca.example", "end_chain") != SSL_OK ||
+            sni_connect(svr_ctx, clnt_ctx, "ca.example", 
+                                PROJECT_ORG, INTER_CA_ORG, NULL) ||
+            ssl_ctx_add_host(svr_ctx, "CA.example", NULL) != SSL_OK ||
+            ssl_ctx_add_host(svr_ctx, "ca.example", NULL) != SSL_NOT_OK ||
+            sni_connect(svr_ctx, clnt_ctx, "ca.example", 
+                                PROJECT_ORG, DODGY_CA_ORG, NULL) ||
+            sni_connect(svr_ctx, clnt_ctx, "b.wild.example", 
+                                INTER_CA_ORG, DODGY_CA_ORG, NULL))
+        goto error;
+
+    /* and a ticket is only for the name that it was issued with */
+    if (sni_add_host(tkt_ctx, "ca.example", "intermediate_ca") != SSL_OK ||
+            sni_connect(tkt_ctx, clnt_ctx, "ca.example", 
+                                INTER_CA_ORG, DODGY_CA_ORG, id) ||
+            loopback_connect(tkt_ctx, clnt_ctx, NULL, id, NULL, 0) != 0 ||
+            loopback_connect(tkt_ctx, clnt_ctx, 
+                                "other.example", id, NULL, 0) != 0 ||
+            loopback_connect(tkt_ctx, clnt_ctx, 
+                                "ca.example", id, NULL, 0) != 1)
+        goto error;
+
+    res = 0;
+
+error:
+    ssl_ctx_free(svr_ctx);
+    ssl_ctx_free(tkt_ctx);
+    ssl_ctx_free(clnt_ctx);
+    printf(res == 0 ? "SSL SNI test passed\n" : "SSL SNI test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+#endif /* WIN32 */
+
+/**************************************************************************
+ * Connection table test (find connections as the table grows and shrinks)
+ *
+ **************************************************************************/
+#define NUM_CONNS           512
+#define CONN_FD(A)          (10000+(A))     /* never opened */
+
+static int conn_table_test(void)
+{
+    SSL_CTX *ssl_ctx = ssl_ctx_new(DEFAULT_SVR_OPTION, 0);
+    SSL *ssl[NUM_CONNS];
+    int i, res = 1;
+
+    for (i = 0; i < NUM_CONNS; i++)
+        ssl[i] = ssl_server_new(ssl_ctx, CONN_FD(i));
+
+    /* this many will have made the shards grow */
+    if (ssl_ctx->conns[0].num_buckets <= SSL_CONN_MIN_BUCKETS)
+        goto error;
+
+    for (i = 0; i < NUM_CONNS; i++)
+    {
+        if (ssl_find(ssl_ctx, CONN_FD(i)) != ssl[i])
+            goto error;
+    }
+
+    /* take every other one out again */
+    for (i = 0; i < NUM_CONNS; i += 2)
+    {
+        ssl_free(ssl[i]);
+        ssl[i] = NULL;
+    }
+
+    for (i = 0; i < NUM_CONNS; i++)
+    {
+        if (ssl_find(ssl_ctx, CONN_FD(i)) != ssl[i])
+            goto error;
+    }
+
+    if (ssl_find(ssl_ctx, CONN_FD(NUM_CONNS)) != NULL)
+        goto error;
+
+    /* a connection made before it has a descriptor (as SSL_new() and
+       SSL_set_fd() do it) is found under the one it gets */
+    if ((ssl[0] = ssl_new(ssl_ctx, -1)) == NULL)
+        goto error;
+
+    ssl_set_client_fd(ssl[0], CONN_FD(NUM_CONNS));
+
+    if (ssl_find(ssl_ctx, -1) != NULL ||
+            ssl_find(ssl_ctx, CONN_FD(NUM_CONNS)) != ssl[0])
+        goto error;
+
+    ssl_free(ssl[0]);
+    ssl[0] = NULL;
+
+    for (i = 0; i <= NUM_CONNS; i++)
+    {
+        if (ssl_find(ssl_ctx, CONN_FD(i)) != (i < NUM_CONNS ? ssl[i] : NULL))
+            goto error;
+    }
+
+    res = 0;
+
+error:
+    ssl_ctx_free(ssl_ctx);      /* and the rest of the connections */
+    printf(res == 0 ? "SSL connection table test passed\n" : 
+                        "SSL connection table test failed\n");
+    TTY_FLUSH();
+    return res;
+}
+
+#if !defined(WIN32) && defined(CONFIG_SSL_CTX_MUTEXING)
+/**************************************************************************
+ * Multi-Threading Tests
+ *
+ **************************************************************************/
+#define NUM_THREADS         100
+
+typedef struct
+{
+    SSL_CTX *ssl_clnt_ctx;
+    int port;
+    int thread_id;
+} multi_t;
+
+void do_multi_clnt(multi_t *multi_data)
+{
+    int res = 1, client_fd, i;
+    SSL *ssl = NULL;
+    char tmp[5];
+
+    if ((client_fd = client_socket_init(multi_data->port)) < 0)
+        goto client_test_exit;
+
+    usleep(200000);
+    ssl = ssl_client_new(multi_data->ssl_clnt_ctx, client_fd, NULL, 0, NULL);
+
+    if ((res = ssl_handshake_status(ssl)))
+    {
+        printf("Client ");
+        ssl_display_error(res);
+        goto client_test_exit;
+    }
+
+    sprintf(tmp, "%d\n", multi_data->thread_id);
+    for (i = 0; i < 10; i++)
+        ssl_write(ssl, (uint8_t *)tmp, strlen(tmp)+1);
+
+client_test_exit:
+    ssl_free(ssl);
+    SOCKET_CLOSE(client_fd);
+    free(multi_data);
+}
+
+void do_multi_svr(SSL *ssl)
+{
+    uint8_t *read_buf;
+    int *res_ptr = malloc(sizeof(int));
+    int res;
+
+    for (;;)
+    {
+        res = ssl_read(ssl, &read_buf);
+
+        /* kill the client */
+        if (res != SSL_OK)
+        {
+            if (res == SSL_ERROR_CONN_LOST)
+            {
+                SOCKET_CLOSE(ssl->client_fd);
+                ssl_free(ssl);
+                break;
+            }
+            else if (res > 0)
+            {
+                /* do nothing */
+            }
+            else /* some problem */
+            {
+                printf("Server ");
+                ssl_display_error(res);
+                goto error;
+            }
+        }
+    }
+
+    res = SSL_OK;
+error:
+    *res_ptr = res;
+    pthread_exit(res_ptr);
+}
+
+int multi_thread_test(void)
+{
+    int server_fd = -1;
+    SSL_CTX *ssl_server_ctx;
+    SSL_CTX *ssl_clnt_ctx;
+    pthread_t clnt_threads[NUM_THREADS];
+    pthread_t svr_threads[NUM_THREADS];
+    int i, res = 0;
+    struct sockaddr_in client_addr;
+    socklen_t clnt_len = sizeof(client_addr);
+
+    printf("Do multi-threading test (takes a minute)\n");
+
+    ssl_svr_ctx = ssl_ctx_new(DEFAULT_SVR_OPTION, SSL_DEFAULT_SVR_SESS);
+    if ((ret = ssl_obj_load(ssl_svr_ctx, SSL_OBJ_X509_CERT, 
+                    "../ssl/test/axTLS.x509_1024.pem", NULL)) != SSL_OK)
+        goto error;
+
+    if ((ret = ssl_obj_load(ssl_svr_ctx, SSL_OBJ_RSA_KEY, 
+                    "../ssl/test/axTLS.key_1024.pem", NULL)) != SSL_OK)
+        goto error;
+    ssl_clnt_ctx = ssl_ctx_new(DEFAULT_CLNT_OPTION, SSL_DEFAULT_CLNT_SESS);
+
+    if (ssl_obj_load(ssl_clnt_ctx, SSL_OBJ_X509_CACERT, 
+                                        "../ssl/test/axTLS.ca_x509.cer", NULL))
+        goto error;
+
+    if ((server_fd = server_socket_init(&g_port)) < 0)
+        goto error;
+
+    for (i = 0; i < NUM_THREADS; i++)
+    {
+        multi_t *multi_data = (multi_t *)malloc(sizeof(multi_t));
+        multi_data->ssl_clnt_ctx = ssl_clnt_ctx;
+        multi_data->port = g_port;
+        multi_data->thread_id = i+1;
+        pthread_create(&clnt_threads[i], NULL, 
+                (void *(*)(void *))do_multi_clnt, (void *)multi_data);
+        pthread_detach(clnt_threads[i]);
+    }
+
+    for (i = 0; i < NUM_THREADS; i++)
+    { 
+        SSL *ssl_svr;
+        int client_fd = accept(server_fd, 
+                      (struct sockaddr *)&client_addr, &clnt_len);
+
+        if (client_fd < 0)
+            goto error;
+
+        ssl_svr = ssl_server_new(ssl_server_ctx, client_fd);
+
+        pthread_create(&svr_threads[i], NULL, 
+                        (void *(*)(void *))do_multi_svr, (void *)ssl_svr);
+    }
+
+    /* make sure we've run all of the threads */
+    for (i = 0; i < NUM_THREADS; i++)
+    {
+        void *thread_res;
+        pthread_join(svr_threads[i], &thread_res);
+
+        if (*((int *)thread_res) != 0)
+            res = 1;
+
+        free(thread_res);
+    } 
+
+    if (res) 
+        goto error;
+
+    printf("Multi-thread test passed (%d)\n", NUM_THREADS);
+error:
+    ssl_ctx_free(ssl_svr_ctx);
+    ssl_ctx_free(ssl_clnt_ctx);
+    SOCKET_CLOSE(server_fd);
+    return res;
+}
+#endif /* !defined(WIN32) && defined(CONFIG_SSL_CTX_MUTEXING) */ 
+
+/**************************************************************************
+ * Header issue
+ *
+ **************************************************************************/
+//static void do_header_issue(void)
+//{
+//    char axtls_buf[2048];
+//#ifndef WIN32
+//    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 //#endif
 //    sprintf(axtls_buf, "./axssl s_client -connect localhost:%d", g_port);
 //    SYSTEM(axtls_buf);
@@ -2545,6 +3696,9 @@ int main(int argc, char *argv[])
     }
     TTY_FLUSH();
 
+    if (conn_table_test())
+        goto cleanup;
+
 #if !defined(WIN32) && defined(CONFIG_SSL_CTX_MUTEXING)
     if (multi_thread_test())
         goto cleanup;
@@ -2560,6 +3714,35 @@ int main(int argc, char *argv[])
 
     SYSTEM("sh ../ssl/test/killopenssl.sh");
 
+#ifndef WIN32
+    if (session_cache_test())
+        goto cleanup;
+
+    if (session_store_test())
+        goto cleanup;
+
+    if (session_export_test())
+        goto cleanup;
+
+    if (state_export_test())
+        goto cleanup;
+
+    if (record_limit_test())
+        goto cleanup;
+
+    if (renegotiate_ticket_test())
+        goto cleanup;
+
+    if (release_buffers_test())
+        goto cleanup;
+
+    if (buffer_pool_test())
+        goto cleanup;
+
+    if (sni_test())
+        goto cleanup;
+#endif
+
     if (SSL_client_tests())
         goto cleanup;
 
@@ -38,30 +38,47 @@
 #include <stdarg.h>
 #include "os_port.h"
 #include "ssl.h"
-
-/* The session expiry time */
-#define SSL_EXPIRY_TIME     (CONFIG_SSL_EXPIRY_TIME*3600)
+#include "os_alloc.h"
 
 static const uint8_t g_hello_request[] = { HS_HELLO_REQUEST, 0, 0, 0 };
 static const uint8_t g_chg_cipher_spec_pkt[] = { 1 };
+static const uint8_t g_empty_cert_msg[] = { HS_CERTIFICATE, 0, 0, 3, 0, 0, 0 };
 static const char * server_finished = "server finished";
 static const char * client_finished = "client finished";
 
 static int do_handshake(SSL *ssl, uint8_t *buf, int read_len);
+static int handshake_type_dispatch(SSL *ssl, uint8_t handshake_type, 
+        uint8_t *buf, int hs_len);
+static int process_stream(SSL *ssl, int read_len);
 static int set_key_block(SSL *ssl, int is_write);
 static int verify_digest(SSL *ssl, int mode, const uint8_t *buf, int read_len);
 static void *crypt_new(SSL *ssl, uint8_t *key, uint8_t *iv, int is_decrypt, void* cached);
-static int send_raw_packet(SSL *ssl, uint8_t protocol);
+static int send_raw_packet(SSL *ssl, uint8_t protocol, 
+        const uint8_t *data, int len);
+static int write_all(SSL *ssl, const uint8_t *buf, int len);
 static void certificate_free(SSL* ssl);
 static int increase_bm_data_size(SSL *ssl, size_t size);
+static void *slab_alloc(SSL_CTX *ssl_ctx, int slab, size_t size);
+static void slab_free(SSL_CTX *ssl_ctx, int slab, void *obj);
+static int bm_data_alloc(SSL *ssl);
+static void bm_data_free(SSL *ssl);
+static void bm_data_release(SSL *ssl);
+static int max_record_length(SSL *ssl);
 static int check_certificate_chain(SSL *ssl);
+static int conn_table_init(SSL_CTX *ssl_ctx);
+static void conn_add(SSL *ssl);
+static void conn_remove(SSL *ssl);
+static int count_connections(SSL_CTX *ssl_ctx);
+static SSL_CONFIG *config_get(SSL_CTX *ssl_ctx);
+static void config_release(SSL_CTX *ssl_ctx, SSL_CONFIG *config);
 
 /**
  * The server will pick the cipher based on the order that the order that the
  * ciphers are listed. This order is defined at compile time.
  */
 #ifndef CONFIG_SSL_SKELETON_MODE
-static void session_free(SSL_SESSION *ssl_sessions[], int sess_index);
+static void session_free_all(SSL_CTX *ssl_ctx);
+static void host_free_all(SSL_CTX *ssl_ctx);
 #endif
 
 const uint8_t ssl_prot_prefs[NUM_PROTOCOLS] = 
@@ -187,30 +204,43 @@ EXP_FUNC void STDCALL ssl_ext_set_max_fragment_size(SSL_EXTENSIONS * ext, uint8_
 EXP_FUNC SSL_CTX *STDCALL ssl_ctx_new(uint32_t options, int num_sessions)
 {
     SSL_CTX *ssl_ctx = (SSL_CTX *)calloc(1, sizeof (SSL_CTX));
-    ssl_ctx->options = options;
-    RNG_initialize();
 
-    if (load_key_certs(ssl_ctx) < 0)
-    {
-        free(ssl_ctx);  /* can't load our key/certificate pair, so die */
+    if (ssl_ctx == NULL)
         return NULL;
-    }
 
+    ssl_ctx->options = options;
 #ifndef CONFIG_SSL_SKELETON_MODE
     ssl_ctx->num_sessions = num_sessions;
 #endif
 
+    /* ssl_ctx_free() can tidy up from here on */
     SSL_CTX_MUTEX_INIT(ssl_ctx->mutex);
+    RNG_initialize();
+
+    if (conn_table_init(ssl_ctx) != SSL_OK)
+        goto error;
+
+    if ((ssl_ctx->config = 
+                (SSL_CONFIG *)calloc(1, sizeof(SSL_CONFIG))) == NULL)
+        goto error;
+
+    ssl_ctx->config->ref_count = 1;
+
+    /* can't load our key/certificate pair, so die */
+    if (load_key_certs(ssl_ctx) < 0)
+        goto error;
 
 #ifndef CONFIG_SSL_SKELETON_MODE
-    if (num_sessions)
-    {
-        ssl_ctx->ssl_sessions = (SSL_SESSION **)
-                        calloc(1, num_sessions*sizeof(SSL_SESSION *));
-    }
+    if (num_sessions && (ssl_ctx->ssl_sessions = (SSL_SESSION **)
+                    calloc(1, num_sessions*sizeof(SSL_SESSION *))) == NULL)
+        goto error;
 #endif
 
     return ssl_ctx;
+
+error:
+    ssl_ctx_free(ssl_ctx);
+    return NULL;
 }
 
 /*
@@ -218,45 +248,342 @@ EXP_FUNC SSL_CTX *STDCALL ssl_ctx_new(uint32_t options, int num_sessions)
  */
 EXP_FUNC void STDCALL ssl_ctx_free(SSL_CTX *ssl_ctx)
 {
-    SSL *ssl;
-    int i;
+    int i, j;
 
     if (ssl_ctx == NULL)
         return;
 
-    ssl = ssl_ctx->head;
-
     /* clear out all the ssl entries */
-    while (ssl)
+    for (i = 0; i < SSL_CONN_SHARDS; i++)
     {
-        SSL *next = ssl->next;
-        ssl_free(ssl);
-        ssl = next;
+        SSL_CONN_SHARD *shard = &ssl_ctx->conns[i];
+
+        for (j = 0; j < shard->num_buckets; j++)
+        {
+            while (shard->buckets[j])
+                ssl_free(shard->buckets[j]);
+        }
+
+        free(shard->buckets);
+        SSL_CTX_MUTEX_DESTROY(shard->mutex);
     }
 
 #ifndef CONFIG_SSL_SKELETON_MODE
     /* clear out all the sessions */
-    for (i = 0; i < ssl_ctx->num_sessions; i++)
-        session_free(ssl_ctx->ssl_sessions, i);
+    session_free_all(ssl_ctx);
+    host_free_all(ssl_ctx);
+#endif
 
-    free(ssl_ctx->ssl_sessions);
+    config_release(ssl_ctx, ssl_ctx->config);
+    ssl_ctx_set_buffer_pool(ssl_ctx, 0);
+
+    for (i = 0; i < SSL_NUM_SLABS; i++)
+        free(ssl_ctx->slabs[i].block);
+
+    SSL_CTX_MUTEX_DESTROY(ssl_ctx->mutex);
+    RNG_terminate();
+    free(ssl_ctx);
+}
+
+/*
+ * Take a reference to the key and certificates in use.
+ */
+static SSL_CONFIG *config_get(SSL_CTX *ssl_ctx)
+{
+    SSL_CONFIG *config;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    config = ssl_ctx->config;
+    config->ref_count++;
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return config;
+}
+
+/*
+ * Drop a reference, and free the key and certificates with the last one.
+ */
+static void config_release(SSL_CTX *ssl_ctx, SSL_CONFIG *config)
+{
+    int ref_count;
+
+    if (config == NULL)
+        return;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    ref_count = --config->ref_count;
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+
+    if (ref_count > 0)
+        return;
+
+    free(config->cert_msg);     /* the certificates live in the message */
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+    remove_ca_certs(config->ca_cert_ctx);
 #endif
+    RSA_free(config->rsa_ctx);
+    free(config);
+}
+
+/*
+ * Move the key and certificates loaded into new_ctx over to ssl_ctx.
+ */
+EXP_FUNC int STDCALL ssl_ctx_swap_config(SSL_CTX *ssl_ctx, SSL_CTX *new_ctx)
+{
+    SSL_CONFIG *empty, *old_config;
+
+    /* its config must only have the one reference, from itself */
+    if (count_connections(new_ctx) || 
+            (empty = (SSL_CONFIG *)calloc(1, sizeof(SSL_CONFIG))) == NULL)
+        return SSL_NOT_OK;
+
+    empty->ref_count = 1;
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    old_config = ssl_ctx->config;
+    ssl_ctx->config = new_ctx->config;
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    new_ctx->config = empty;
+
+    /* the running connections still have the old one */
+    config_release(ssl_ctx, old_config);
+    return SSL_OK;
+}
 
-    i = 0;
-    while (i < CONFIG_SSL_MAX_CERTS && ssl_ctx->certs[i].buf)
+#ifndef CONFIG_SSL_SKELETON_MODE
+/*
+ * A server can have a key and certificates for each of its host names,
+ * picked by the name the client sends (SNI). They are kept in a hash table
+ * by the name in lower case, which doubles as hosts are added. A name like 
+ * "*.example.com" matches any one label in its place.
+ */
+static uint32_t host_hash(const uint8_t *name, int name_len)
+{
+    uint32_t hash = 2166136261U;    /* FNV-1a */
+    int i;
+
+    for (i = 0; i < name_len; i++)
     {
-        free(ssl_ctx->certs[i].buf);
-        ssl_ctx->certs[i++].buf = NULL;
+        hash ^= name[i];
+        hash *= 16777619U;
     }
 
-#ifdef CONFIG_SSL_CERT_VERIFICATION
-    remove_ca_certs(ssl_ctx->ca_cert_ctx);
+    return hash;
+}
+
+static int host_name_lower(uint8_t *out, const uint8_t *name, int name_len)
+{
+    int i;
+
+    if (name_len <= 0 || name_len > SSL_MAX_HOST_NAME)
+        return SSL_NOT_OK;
+
+    for (i = 0; i < name_len; i++)
+    {
+        out[i] = (name[i] >= 'A' && name[i] <= 'Z') ? 
+                                                name[i] + 'a'-'A' : name[i];
+    }
+
+    return SSL_OK;
+}
+
+/*
+ * Get where a host is (or would go) in the table (the context is locked).
+ */
+static SSL_HOST **host_find(SSL_CTX *ssl_ctx, const uint8_t *name, 
+                                int name_len)
+{
+    uint32_t hash = host_hash(name, name_len);
+    SSL_HOST **p;
+
+    if (ssl_ctx->num_host_buckets == 0)
+        return NULL;
+
+    p = &ssl_ctx->hosts[hash & (ssl_ctx->num_host_buckets-1)];
+
+    while (*p && ((*p)->hash != hash || (*p)->name_len != name_len ||
+                        memcmp((*p)->name, name, name_len)))
+        p = &(*p)->next;
+
+    return p;
+}
+
+static void host_grow(SSL_CTX *ssl_ctx)
+{
+    int i, num_buckets = ssl_ctx->num_host_buckets ? 
+                        ssl_ctx->num_host_buckets*2 : SSL_HOST_MIN_BUCKETS;
+    SSL_HOST **hosts = (SSL_HOST **)calloc(num_buckets, sizeof(SSL_HOST *));
+
+    if (hosts == NULL)      /* the chains just get longer */
+        return;
+
+    for (i = 0; i < ssl_ctx->num_host_buckets; i++)
+    {
+        SSL_HOST *host = ssl_ctx->hosts[i];
+
+        while (host)
+        {
+            SSL_HOST *next = host->next;
+            host->next = hosts[host->hash & (num_buckets-1)];
+            hosts[host->hash & (num_buckets-1)] = host;
+            host = next;
+        }
+    }
+
+    free(ssl_ctx->hosts);
+    ssl_ctx->hosts = hosts;
+    ssl_ctx->num_host_buckets = num_buckets;
+}
+
+static void host_free_all(SSL_CTX *ssl_ctx)
+{
+    int i;
+
+    for (i = 0; i < ssl_ctx->num_host_buckets; i++)
+    {
+        while (ssl_ctx->hosts[i])
+        {
+            SSL_HOST *host = ssl_ctx->hosts[i];
+            ssl_ctx->hosts[i] = host->next;
+            config_release(ssl_ctx, host->config);
+            free(host);
+        }
+    }
+
+    free(ssl_ctx->hosts);
+    ssl_ctx->hosts = NULL;
+    ssl_ctx->num_host_buckets = ssl_ctx->num_hosts = 0;
+}
+
+/*
+ * Switch a connection to the key and certificates of the host it asked for,
+ * and keep the name for its session. Nothing changes if the host isn't known.
+ */
+int select_host(SSL *ssl, const uint8_t *name, int name_len)
+{
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
+    uint8_t lower[SSL_MAX_HOST_NAME];
+    SSL_CONFIG *config = NULL;
+    SSL_HOST **p;
+
+    if (host_name_lower(lower, name, name_len) != SSL_OK)
+        return SSL_NOT_OK;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+
+    if ((p = host_find(ssl_ctx, lower, name_len)) && *p)
+        config = (*p)->config;
+    else if (p)     /* try a wildcard in place of the first label */
+    {
+        uint8_t *dot = (uint8_t *)memchr(lower, '.', name_len);
+
+        if (dot && dot > lower)
+        {
+            dot[-1] = '*';
+
+            if ((p = host_find(ssl_ctx, &dot[-1], 
+                            name_len-(int)(dot-lower)+1)) && *p)
+                config = (*p)->config;
+        }
+    }
+
+    if (config)
+        config->ref_count++;
+
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+
+    if (config == NULL)
+        return SSL_NOT_OK;
+
+    if ((ssl->dc->host_name = (char *)malloc(name_len+1)) == NULL)
+    {
+        config_release(ssl_ctx, config);
+        return SSL_NOT_OK;
+    }
+
+    host_name_lower((uint8_t *)ssl->dc->host_name, name, name_len);
+    ssl->dc->host_name[name_len] = 0;
+    config_release(ssl_ctx, ssl->config);
+    ssl->config = config;
+    return SSL_OK;
+}
+#endif
+
+/*
+ * Give a server the key and certificates loaded into host_ctx for a host.
+ */
+EXP_FUNC int STDCALL ssl_ctx_add_host(SSL_CTX *ssl_ctx, 
+        const char *host_name, SSL_CTX *host_ctx)
+{
+#ifndef CONFIG_SSL_SKELETON_MODE
+    uint8_t name[SSL_MAX_HOST_NAME];
+    int name_len = strlen(host_name);
+    SSL_CONFIG *config = NULL, *empty = NULL, *old_config = NULL;
+    SSL_HOST **p, *host;
+    int ret = SSL_OK;
+
+    if (host_name_lower(name, (const uint8_t *)host_name, name_len) != SSL_OK)
+        return SSL_NOT_OK;
+
+    if (host_ctx)
+    {
+        /* its config must only have the one reference, from itself */
+        if (count_connections(host_ctx) || 
+            (empty = (SSL_CONFIG *)calloc(1, sizeof(SSL_CONFIG))) == NULL)
+            return SSL_NOT_OK;
+
+        empty->ref_count = 1;
+        config = host_ctx->config;
+    }
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+
+    if (config && ssl_ctx->num_hosts >= ssl_ctx->num_host_buckets)
+        host_grow(ssl_ctx);
+
+    p = host_find(ssl_ctx, name, name_len);
+
+    if (p && *p)            /* replace or remove the host */
+    {
+        old_config = (*p)->config;
+
+        if (config)
+            (*p)->config = config;
+        else
+        {
+            host = *p;
+            *p = host->next;
+            free(host);
+            ssl_ctx->num_hosts--;
+        }
+    }
+    else if (p && config && 
+            (host = (SSL_HOST *)malloc(sizeof(SSL_HOST)+name_len)) != NULL)
+    {
+        host->config = config;
+        host->hash = host_hash(name, name_len);
+        host->name_len = name_len;
+        memcpy(host->name, name, name_len);
+        host->next = *p;
+        *p = host;
+        ssl_ctx->num_hosts++;
+    }
+    else
+        ret = SSL_NOT_OK;
+
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+
+    if (ret == SSL_OK && host_ctx)
+        host_ctx->config = empty;
+    else
+        free(empty);
+
+    /* the connections still using it keep it until they are done */
+    if (old_config)
+        config_release(ssl_ctx, old_config);
+
+    return ret;
+#else
+    return SSL_NOT_OK;
 #endif
-    ssl_ctx->chain_length = 0;
-    SSL_CTX_MUTEX_DESTROY(ssl_ctx->mutex);
-    RSA_free(ssl_ctx->rsa_ctx);
-    RNG_terminate();
-    free(ssl_ctx);
 }
 
 /*
@@ -275,33 +602,20 @@ EXP_FUNC void STDCALL ssl_free(SSL *ssl)
         send_alert(ssl, SSL_ALERT_CLOSE_NOTIFY);
 
     ssl_ctx = ssl->ssl_ctx;
-
-    SSL_CTX_LOCK(ssl_ctx->mutex);
-
-    /* adjust the server SSL list */
-    if (ssl->prev)
-        ssl->prev->next = ssl->next;
-    else
-        ssl_ctx->head = ssl->next;
-
-    if (ssl->next)
-        ssl->next->prev = ssl->prev;
-    else
-        ssl_ctx->tail = ssl->prev;
-
-    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    conn_remove(ssl);
 
     /* may already be free - but be sure */
-    free(ssl->encrypt_ctx);
+    slab_free(ssl_ctx, SSL_SLAB_CIPHER, ssl->encrypt_ctx);
     ssl->encrypt_ctx = NULL;
-    free(ssl->decrypt_ctx);
+    slab_free(ssl_ctx, SSL_SLAB_CIPHER, ssl->decrypt_ctx);
     ssl->decrypt_ctx = NULL;
     disposable_free(ssl);
     certificate_free(ssl);
-    free(ssl->bm_all_data);
+    bm_data_free(ssl);
     ssl_ext_free(ssl->extensions);
     ssl->extensions = NULL;
-    free(ssl);
+    config_release(ssl_ctx, ssl->config);
+    slab_free(ssl_ctx, SSL_SLAB_SSL, ssl);
 }
 
 /*
@@ -321,7 +635,7 @@ EXP_FUNC int STDCALL ssl_read(SSL *ssl, uint8_t **in_data)
                 send_alert(ssl, ret);
     #ifndef CONFIG_SSL_SKELETON_MODE
                 /* something nasty happened, so get rid of this session */
-                kill_ssl_session(ssl->ssl_ctx->ssl_sessions, ssl);
+                kill_ssl_session(ssl);
     #endif
             }
         }
@@ -341,8 +655,8 @@ EXP_FUNC int STDCALL ssl_write(SSL *ssl, const uint8_t *out_data, int out_len)
     {
         nw = n;
 
-        if (nw > ssl->max_plain_length)    /* fragment if necessary */
-            nw = ssl->max_plain_length;
+        if (nw > max_record_length(ssl))    /* fragment if necessary */
+            nw = max_record_length(ssl);
 
         if ((i = send_packet(ssl, PT_APP_PROTOCOL_DATA, 
                                             &out_data[tot], nw)) <= 0)
@@ -355,6 +669,13 @@ EXP_FUNC int STDCALL ssl_write(SSL *ssl, const uint8_t *out_data, int out_len)
         n -= i;
     } while (n > 0);
 
+    /* nothing is needed until the next record arrives */
+    if (IS_SET_SSL_FLAG(SSL_RELEASE_BUFFERS) && ssl->dc == NULL &&
+            IS_SET_SSL_FLAG(SSL_NEED_RECORD) && ssl->got_bytes == 0)
+    {
+        bm_data_release(ssl);
+    }
+
     return out_len;
 }
 
@@ -393,11 +714,13 @@ EXP_FUNC int STDCALL ssl_calculate_write_length(SSL *ssl, int length)
 int add_cert(SSL_CTX *ssl_ctx, const uint8_t *buf, int len)
 {
     int ret = SSL_ERROR_NO_CERT_DEFINED, i = 0;
+    SSL_CONFIG *config = ssl_ctx->config;
     SSL_CERT *ssl_cert;
     X509_CTX *cert = NULL;
-    int offset;
+    uint8_t *cert_msg;
+    int offset, msg_len, chain_len;
 
-    while (i < CONFIG_SSL_MAX_CERTS && ssl_ctx->certs[i].buf) 
+    while (i < CONFIG_SSL_MAX_CERTS && config->certs[i].buf) 
         i++;
 
     if (i == CONFIG_SSL_MAX_CERTS) /* too many certs */
@@ -418,9 +741,37 @@ int add_cert(SSL_CTX *ssl_ctx, const uint8_t *buf, int len)
         x509_print(cert, NULL);
 #endif
 
-    ssl_cert = &ssl_ctx->certs[i];
+    /* 
+     * The certificates are kept in a ready made certificate message, so a
+     * handshake can send it as is.
+     */
+    msg_len = config->cert_msg ? config->cert_msg_len : 7;
+    cert_msg = (uint8_t *)realloc(config->cert_msg, msg_len+3+len);
+
+    if (cert_msg == NULL)
+    {
+        ret = SSL_NOT_OK;
+        goto error;
+    }
+
+    config->cert_msg = cert_msg;
+    cert_msg[msg_len] = 0;
+    cert_msg[msg_len+1] = len >> 8;         /* cert length */
+    cert_msg[msg_len+2] = len & 0xff;
+    memcpy(&cert_msg[msg_len+3], buf, len);
+    msg_len += 3+len;
+    config->cert_msg_len = msg_len;
+
+    cert_msg[0] = HS_CERTIFICATE;
+    cert_msg[1] = (msg_len-4) >> 16;        /* handshake length */
+    cert_msg[2] = (msg_len-4) >> 8;
+    cert_msg[3] = (msg_len-4) & 0xff;
+    cert_msg[4] = (msg_len-7) >> 16;        /* cert chain length */
+    cert_msg[5] = (msg_len-7) >> 8;
+    cert_msg[6] = (msg_len-7) & 0xff;
+
+    ssl_cert = &config->certs[i];
     ssl_cert->size = len;
-    ssl_cert->buf = (uint8_t *)malloc(len);
 
     switch (cert->sig_type)
     {
@@ -441,8 +792,17 @@ int add_cert(SSL_CTX *ssl_ctx, const uint8_t *buf, int len)
             break;
     }
 
-    memcpy(ssl_cert->buf, buf, len);
-    ssl_ctx->chain_length++;
+    config->cert_hash_algs |= 1 << ssl_cert->hash_alg;
+    config->chain_length++;
+
+    /* the message may have moved */
+    chain_len = 7;
+    for (i = 0; i < config->chain_length; i++)
+    {
+        config->certs[i].buf = &cert_msg[chain_len+3];
+        chain_len += 3+config->certs[i].size;
+    }
+
     len -= offset;
     ret = SSL_OK;           /* ok so far */
 
@@ -467,10 +827,11 @@ int add_cert_auth(SSL_CTX *ssl_ctx, const uint8_t *buf, int len)
     int i = 0;
     CA_CERT_CTX *ca_cert_ctx;
 
-    if (ssl_ctx->ca_cert_ctx == NULL)
-        ssl_ctx->ca_cert_ctx = (CA_CERT_CTX *)calloc(1, sizeof(CA_CERT_CTX));
+    if (ssl_ctx->config->ca_cert_ctx == NULL)
+        ssl_ctx->config->ca_cert_ctx = 
+                        (CA_CERT_CTX *)calloc(1, sizeof(CA_CERT_CTX));
 
-    ca_cert_ctx = ssl_ctx->ca_cert_ctx;
+    ca_cert_ctx = ssl_ctx->config->ca_cert_ctx;
 
     while (i < CONFIG_X509_MAX_CA_CERTS && ca_cert_ctx->cert[i]) 
         i++;
@@ -579,69 +940,201 @@ EXP_FUNC const char * STDCALL ssl_get_cert_subject_alt_dnsname(const SSL *ssl,
 #endif /* CONFIG_SSL_CERT_VERIFICATION */
 
 /*
- * Find an ssl object based on the client's file descriptor.
+ * The connections are kept in a hash table by file descriptor. The table is
+ * split into shards, each with its own lock, so connections on different
+ * threads don't wait on each other. A shard doubles its buckets once it has 
+ * more connections than buckets.
  */
-EXP_FUNC SSL * STDCALL ssl_find(SSL_CTX *ssl_ctx, int client_fd)
+static uint32_t conn_hash(int client_fd)
 {
-    SSL *ssl;
+    /* an fd may really be a pointer, so mix in the high bits */
+    uint32_t hash = (uint32_t)client_fd*2654435761U;
+    return hash ^ (hash >> 16);
+}
 
-    SSL_CTX_LOCK(ssl_ctx->mutex);
-    ssl = ssl_ctx->head;
+static SSL_CONN_SHARD *conn_shard(SSL_CTX *ssl_ctx, uint32_t hash)
+{
+    return &ssl_ctx->conns[hash % SSL_CONN_SHARDS];
+}
 
-    /* search through all the ssl entries */
-    while (ssl)
-    {
-        if (ssl->client_fd == client_fd)
-        {
-            SSL_CTX_UNLOCK(ssl_ctx->mutex);
-            return ssl;
-        }
+static SSL **conn_bucket(SSL **buckets, int num_buckets, uint32_t hash)
+{
+    return &buckets[(hash/SSL_CONN_SHARDS) & (num_buckets-1)];
+}
 
-        ssl = ssl->next;
-    }
+static void conn_link(SSL **bucket, SSL *ssl)
+{
+    ssl->prev = NULL;
+    ssl->next = *bucket;
 
-    SSL_CTX_UNLOCK(ssl_ctx->mutex);
-    return NULL;
+    if (*bucket)
+        (*bucket)->prev = ssl;
+
+    *bucket = ssl;
 }
 
-/*
- * Force the client to perform its handshake again.
- */
-EXP_FUNC int STDCALL ssl_renegotiate(SSL *ssl)
+static int conn_table_init(SSL_CTX *ssl_ctx)
 {
-    int ret = SSL_OK;
+    int i, ret = SSL_OK;
 
-    disposable_new(ssl);
-#ifdef CONFIG_SSL_ENABLE_CLIENT
-    if (IS_SET_SSL_FLAG(SSL_IS_CLIENT))
-    {
-        ret = do_client_connect(ssl);
-    }
-    else
-#endif
+    for (i = 0; i < SSL_CONN_SHARDS; i++)
     {
-        send_packet(ssl, PT_HANDSHAKE_PROTOCOL, 
-                g_hello_request, sizeof(g_hello_request));
-        SET_SSL_FLAG(SSL_NEED_RECORD);
+        SSL_CONN_SHARD *shard = &ssl_ctx->conns[i];
+        SSL_CTX_MUTEX_INIT(shard->mutex);
+
+        if ((shard->buckets = (SSL **)calloc(SSL_CONN_MIN_BUCKETS, 
+                                            sizeof(SSL *))) == NULL)
+            ret = SSL_NOT_OK;
+        else
+            shard->num_buckets = SSL_CONN_MIN_BUCKETS;
     }
 
     return ret;
 }
 
-/**
- * @brief Get what we need for key info.
- * @param cipher    [in]    The cipher information we are after
- * @param key_size  [out]   The key size for the cipher
- * @param iv_size   [out]   The iv size for the cipher
- * @return  The amount of key information we need.
+/*
+ * Rehash a shard into twice the buckets (the shard is locked).
  */
-static const cipher_info_t *get_cipher_info(uint8_t cipher)
+static void conn_grow(SSL_CONN_SHARD *shard)
 {
-    int i;
+    int i, num_buckets = shard->num_buckets*2;
+    SSL **buckets = (SSL **)calloc(num_buckets, sizeof(SSL *));
 
-    for (i = 0; i < NUM_PROTOCOLS; i++)
+    if (buckets == NULL)    /* the chains just get longer */
+        return;
+
+    for (i = 0; i < shard->num_buckets; i++)
     {
-        if (cipher_info[i].cipher == cipher)
+        SSL *ssl = shard->buckets[i];
+
+        while (ssl)
+        {
+            SSL *next = ssl->next;
+            conn_link(conn_bucket(buckets, num_buckets, 
+                                    conn_hash(ssl->client_fd)), ssl);
+            ssl = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+}
+
+static void conn_add(SSL *ssl)
+{
+    uint32_t hash = conn_hash(ssl->client_fd);
+    SSL_CONN_SHARD *shard = conn_shard(ssl->ssl_ctx, hash);
+
+    SSL_CTX_LOCK(shard->mutex);
+
+    if (shard->num_conns >= shard->num_buckets)
+        conn_grow(shard);
+
+    conn_link(conn_bucket(shard->buckets, shard->num_buckets, hash), ssl);
+    shard->num_conns++;
+    SSL_CTX_UNLOCK(shard->mutex);
+}
+
+static void conn_remove(SSL *ssl)
+{
+    uint32_t hash = conn_hash(ssl->client_fd);
+    SSL_CONN_SHARD *shard = conn_shard(ssl->ssl_ctx, hash);
+
+    SSL_CTX_LOCK(shard->mutex);
+
+    if (ssl->prev)
+        ssl->prev->next = ssl->next;
+    else
+        *conn_bucket(shard->buckets, shard->num_buckets, hash) = ssl->next;
+
+    if (ssl->next)
+        ssl->next->prev = ssl->prev;
+
+    ssl->next = ssl->prev = NULL;
+    shard->num_conns--;
+    SSL_CTX_UNLOCK(shard->mutex);
+}
+
+static int count_connections(SSL_CTX *ssl_ctx)
+{
+    int i, num_conns = 0;
+
+    for (i = 0; i < SSL_CONN_SHARDS; i++)
+        num_conns += ssl_ctx->conns[i].num_conns;
+
+    return num_conns;
+}
+
+/*
+ * Find an ssl object based on the client's file descriptor.
+ */
+EXP_FUNC SSL * STDCALL ssl_find(SSL_CTX *ssl_ctx, int client_fd)
+{
+    uint32_t hash = conn_hash(client_fd);
+    SSL_CONN_SHARD *shard = conn_shard(ssl_ctx, hash);
+    SSL *ssl;
+
+    SSL_CTX_LOCK(shard->mutex);
+    ssl = *conn_bucket(shard->buckets, shard->num_buckets, hash);
+
+    while (ssl && ssl->client_fd != client_fd)
+        ssl = ssl->next;
+
+    SSL_CTX_UNLOCK(shard->mutex);
+    return ssl;
+}
+
+/*
+ * Force the client to perform its handshake again.
+ */
+EXP_FUNC int STDCALL ssl_renegotiate(SSL *ssl)
+{
+    int ret = SSL_OK;
+
+    /* the handshake works in the buffer, even on any header read so far */
+    if (IS_SET_SSL_FLAG(SSL_RELEASE_BUFFERS) && ssl->dc == NULL &&
+                                        IS_SET_SSL_FLAG(SSL_NEED_RECORD))
+    {
+        if (bm_data_alloc(ssl) != SSL_OK)
+            return SSL_NOT_OK;
+
+        memcpy(ssl->bm_data, ssl->rec_hdr, SSL_RECORD_SIZE);
+    }
+
+    if (disposable_new(ssl) != SSL_OK)
+        return SSL_NOT_OK;
+
+#ifdef CONFIG_SSL_ENABLE_CLIENT
+    if (IS_SET_SSL_FLAG(SSL_IS_CLIENT))
+    {
+        ret = do_client_connect(ssl);
+    }
+    else
+#endif
+    {
+        send_packet(ssl, PT_HANDSHAKE_PROTOCOL, 
+                g_hello_request, sizeof(g_hello_request));
+        SET_SSL_FLAG(SSL_NEED_RECORD);
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Get what we need for key info.
+ * @param cipher    [in]    The cipher information we are after
+ * @param key_size  [out]   The key size for the cipher
+ * @param iv_size   [out]   The iv size for the cipher
+ * @return  The amount of key information we need.
+ */
+static const cipher_info_t *get_cipher_info(uint8_t cipher)
+{
+    int i;
+
+    for (i = 0; i < NUM_PROTOCOLS; i++)
+    {
+        if (cipher_info[i].cipher == cipher)
         {
             return &cipher_info[i];
         }
@@ -650,50 +1143,168 @@ static const cipher_info_t *get_cipher_info(uint8_t cipher)
     return NULL;  /* error */
 }
 
+/*
+ * Set aside the objects for this many connections.
+ */
+EXP_FUNC int STDCALL ssl_ctx_set_object_pool(SSL_CTX *ssl_ctx, 
+        int num_connections)
+{
+    static const size_t obj_sizes[SSL_NUM_SLABS] = 
+    {
+        sizeof(SSL), sizeof(DISPOSABLE_CTX), sizeof(AES_CTX)
+    };
+    int ret = SSL_OK;
+    int i, j;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+
+    /* the objects of a connection must go back to where they came from */
+    if (count_connections(ssl_ctx) || ssl_ctx->slabs[0].block || 
+                                                    num_connections <= 0)
+    {
+        ret = SSL_NOT_OK;
+        goto error;
+    }
+
+    for (i = 0; i < SSL_NUM_SLABS; i++)
+    {
+        SSL_SLAB *slab = &ssl_ctx->slabs[i];
+        int num_objs = num_connections*(i == SSL_SLAB_CIPHER ? 2 : 1);
+
+        slab->obj_size = (obj_sizes[i]+SSL_SLAB_ALIGN-1) & ~(SSL_SLAB_ALIGN-1);
+        slab->block = (uint8_t *)ax_malloc_hint(num_objs*slab->obj_size, 
+                                                    SSL_ALLOC_CONNECTION);
+
+        if (slab->block == NULL)
+        {
+            while (i >= 0)
+            {
+                free(ssl_ctx->slabs[i].block);
+                memset(&ssl_ctx->slabs[i--], 0, sizeof(SSL_SLAB));
+            }
+
+            ret = SSL_NOT_OK;
+            goto error;
+        }
+
+        slab->end = slab->block + num_objs*slab->obj_size;
+
+        for (j = num_objs-1; j >= 0; j--)
+        {
+            void **obj = (void **)(slab->block + j*slab->obj_size);
+            *obj = slab->free_list;
+            slab->free_list = obj;
+        }
+    }
+
+error:
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return ret;
+}
+
+/**
+ * Get a cleared object from a slab, or from the heap when it has run out.
+ */
+static void *slab_alloc(SSL_CTX *ssl_ctx, int slab, size_t size)
+{
+    SSL_SLAB *s = &ssl_ctx->slabs[slab];
+    void **obj = NULL;
+
+    if (s->block)
+    {
+        SSL_CTX_LOCK(ssl_ctx->mutex);
+
+        if ((obj = (void **)s->free_list) != NULL)
+            s->free_list = *obj;
+
+        SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    }
+
+    if (obj == NULL && (obj = (void **)ax_malloc_hint(size, 
+                                    SSL_ALLOC_CONNECTION)) == NULL)
+        return NULL;
+
+    memset(obj, 0, size);
+    return obj;
+}
+
+/**
+ * Give an object back to its slab (or the heap).
+ */
+static void slab_free(SSL_CTX *ssl_ctx, int slab, void *obj)
+{
+    SSL_SLAB *s = &ssl_ctx->slabs[slab];
+
+    if ((uint8_t *)obj >= s->block && (uint8_t *)obj < s->end)
+    {
+        SSL_CTX_LOCK(ssl_ctx->mutex);
+        *(void **)obj = s->free_list;
+        s->free_list = obj;
+        SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    }
+    else
+        free(obj);
+}
+
 /*
  * Get a new ssl context for a new connection.
  */
 SSL *ssl_new(SSL_CTX *ssl_ctx, int client_fd)
 {
-    SSL *ssl = (SSL *)calloc(1, sizeof(SSL));
+    SSL *ssl = (SSL *)slab_alloc(ssl_ctx, SSL_SLAB_SSL, sizeof(SSL));
+
+    if (ssl == NULL)
+        return NULL;
+
     ssl->ssl_ctx = ssl_ctx;
-    ssl->max_plain_length = 1460*4;
-    ssl->bm_all_data = (uint8_t*) calloc(1, ssl->max_plain_length + RT_EXTRA);
+    ssl->config = config_get(ssl_ctx);
+    ssl->max_plain_length = RT_DEFAULT_PLAIN_LENGTH;
     ssl->need_bytes = SSL_RECORD_SIZE;      /* need a record */
     ssl->client_fd = client_fd;
     ssl->flag = SSL_NEED_RECORD;
-    ssl->bm_data = ssl->bm_all_data + BM_RECORD_OFFSET; /* space at the start */
     ssl->hs_status = SSL_NOT_OK;            /* not connected */
 #ifdef CONFIG_ENABLE_VERIFICATION
     ssl->ca_cert_ctx = ssl_ctx->ca_cert_ctx;
     ssl->can_free_certificates = false;
 #endif
-    disposable_new(ssl);
+
+    if (bm_data_alloc(ssl) != SSL_OK || disposable_new(ssl) != SSL_OK)
+        goto error;
 
     /* a bit hacky but saves a few bytes of memory */
     ssl->flag |= ssl_ctx->options;
     if (IS_SET_SSL_FLAG(SSL_CONNECT_IN_PARTS) && IS_SET_SSL_FLAG(SSL_READ_BLOCKING)) {
         CLR_SSL_FLAG(SSL_READ_BLOCKING);
     }
-    SSL_CTX_LOCK(ssl_ctx->mutex);
 
-    if (ssl_ctx->head == NULL)
-    {
-        ssl_ctx->head = ssl;
-        ssl_ctx->tail = ssl;
-    }
-    else
-    {
-        ssl->prev = ssl_ctx->tail;
-        ssl_ctx->tail->next = ssl;
-        ssl_ctx->tail = ssl;
-    }
+    ssl->encrypt_ctx = slab_alloc(ssl_ctx, SSL_SLAB_CIPHER, sizeof(AES_CTX));
+    ssl->decrypt_ctx = slab_alloc(ssl_ctx, SSL_SLAB_CIPHER, sizeof(AES_CTX));
 
-    ssl->encrypt_ctx = malloc(sizeof(AES_CTX));
-    ssl->decrypt_ctx = malloc(sizeof(AES_CTX));
+    if (ssl->encrypt_ctx == NULL || ssl->decrypt_ctx == NULL)
+        goto error;
 
-    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    conn_add(ssl);
     return ssl;
+
+error:
+    slab_free(ssl_ctx, SSL_SLAB_CIPHER, ssl->encrypt_ctx);
+    slab_free(ssl_ctx, SSL_SLAB_CIPHER, ssl->decrypt_ctx);
+    disposable_free(ssl);
+    bm_data_free(ssl);
+    config_release(ssl_ctx, ssl->config);
+    slab_free(ssl_ctx, SSL_SLAB_SSL, ssl);
+    return NULL;
+}
+
+/*
+ * Give a connection a new file descriptor. It is kept in the context under 
+ * its descriptor, so it has to move as well.
+ */
+void ssl_set_client_fd(SSL *ssl, int client_fd)
+{
+    conn_remove(ssl);
+    ssl->client_fd = client_fd;
+    conn_add(ssl);
 }
 
 /*
@@ -704,7 +1315,8 @@ int add_private_key(SSL_CTX *ssl_ctx, SSLObjLoader *ssl_obj)
     int ret = SSL_OK;
 
     /* get the private key details */
-    if (asn1_get_private_key(ssl_obj->buf, ssl_obj->len, &ssl_ctx->rsa_ctx))
+    if (asn1_get_private_key(ssl_obj->buf, ssl_obj->len, 
+                                                &ssl_ctx->config->rsa_ctx))
     {
         ret = SSL_ERROR_INVALID_KEY;
         goto error;
@@ -840,18 +1452,61 @@ static int verify_digest(SSL *ssl, int mode, const uint8_t *buf, int read_len)
  */
 void add_packet(SSL *ssl, const uint8_t *pkt, int len)
 {
-    // TLS1.2+
-    if (ssl->version >= SSL_PROTOCOL_VERSION_TLS1_2 || ssl->version == 0) 
+    DISPOSABLE_CTX *dc = ssl->dc;
+
+    if (!dc->hs_hash_started)   /* keep it until the version is known */
+    {
+        uint8_t *hs_msgs = (uint8_t *)realloc(dc->hs_msgs, 
+                                                dc->hs_msgs_len+len);
+
+        /* if this fails then so will the finished check */
+        if (hs_msgs != NULL)
+        {
+            memcpy(&hs_msgs[dc->hs_msgs_len], pkt, len);
+            dc->hs_msgs = hs_msgs;
+            dc->hs_msgs_len += len;
+        }
+    }
+    else if (ssl->version >= SSL_PROTOCOL_VERSION_TLS1_2) // TLS1.2+
+    {
+        SHA256_Update(&dc->hs_hash.sha256_ctx, pkt, len);
+    }
+    else // TLS1.0/1.1
+    {
+        MD5_Update(&dc->hs_hash.md5_sha1.md5_ctx, pkt, len);
+        SHA1_Update(&dc->hs_hash.md5_sha1.sha1_ctx, pkt, len);
+    }
+}
+
+/**
+ * The version has been agreed, so start the one handshake hash it uses
+ * with the messages held back so far.
+ */
+void start_handshake_hash(SSL *ssl)
+{
+    DISPOSABLE_CTX *dc = ssl->dc;
+
+    if (dc->hs_hash_started)
+        return;
+
+    if (ssl->version >= SSL_PROTOCOL_VERSION_TLS1_2) // TLS1.2+
+    {
+        SHA256_Init(&dc->hs_hash.sha256_ctx);
+    }
+    else // TLS1.0/1.1
     {
-        SHA256_Update(&ssl->dc->sha256_ctx, pkt, len);
+        MD5_Init(&dc->hs_hash.md5_sha1.md5_ctx);
+        SHA1_Init(&dc->hs_hash.md5_sha1.sha1_ctx);
     }
 
-    if (ssl->version < SSL_PROTOCOL_VERSION_TLS1_2 || 
-                ssl->next_state == HS_SERVER_HELLO ||
-                ssl->next_state == 0) 
+    dc->hs_hash_started = 1;
+
+    if (dc->hs_msgs)
     {
-        MD5_Update(&ssl->dc->md5_ctx, pkt, len);
-        SHA1_Update(&ssl->dc->sha1_ctx, pkt, len);
+        add_packet(ssl, dc->hs_msgs, dc->hs_msgs_len);
+        free(dc->hs_msgs);
+        dc->hs_msgs = NULL;
+        dc->hs_msgs_len = 0;
     }
 }
 
@@ -954,8 +1609,8 @@ static void prf(SSL *ssl, const uint8_t *sec, int sec_len,
     {
         int len, i;
         const uint8_t *S1, *S2;
-        uint8_t xbuf[2*(SHA256_SIZE+32+16) + MD5_SIZE]; /* max keyblock */
-        uint8_t ybuf[2*(SHA256_SIZE+32+16) + SHA1_SIZE]; /* max keyblock */
+        uint8_t xbuf[SSL_MAX_KEY_BLOCK_SIZE + MD5_SIZE];
+        uint8_t ybuf[SSL_MAX_KEY_BLOCK_SIZE + SHA1_SIZE];
 
         len = sec_len/2;
         S1 = sec;
@@ -1023,15 +1678,15 @@ int finished_digest(SSL *ssl, const char *label, uint8_t *digest)
 
     if (ssl->version >= SSL_PROTOCOL_VERSION_TLS1_2) // TLS1.2+
     {
-        SHA256_CTX sha256_ctx = ssl->dc->sha256_ctx; // interim copy
+        SHA256_CTX sha256_ctx = ssl->dc->hs_hash.sha256_ctx; // interim copy
         SHA256_Final(q, &sha256_ctx);
         q += SHA256_SIZE;
         dgst_len = (int)(q-mac_buf);
     }
     else // TLS1.0/1.1
     {
-        MD5_CTX md5_ctx = ssl->dc->md5_ctx; // interim copy
-        SHA1_CTX sha1_ctx = ssl->dc->sha1_ctx;
+        MD5_CTX md5_ctx = ssl->dc->hs_hash.md5_sha1.md5_ctx; // interim copy
+        SHA1_CTX sha1_ctx = ssl->dc->hs_hash.md5_sha1.sha1_ctx;
 
         MD5_Final(q, &md5_ctx);
         q += MD5_SIZE;
@@ -1073,8 +1728,9 @@ static void *crypt_new(SSL *ssl, uint8_t *key, uint8_t *iv, int is_decrypt, void
                 AES_CTX *aes_ctx;
                 if (cached)
                     aes_ctx = (AES_CTX*) cached;
-                else
-                    aes_ctx = (AES_CTX*) malloc(sizeof(AES_CTX));
+                else if ((aes_ctx = (AES_CTX*) slab_alloc(ssl->ssl_ctx, 
+                                SSL_SLAB_CIPHER, sizeof(AES_CTX))) == NULL)
+                    return NULL;
                 AES_set_key(aes_ctx, key, iv, AES_MODE_128);
 
                 if (is_decrypt)
@@ -1091,8 +1747,9 @@ static void *crypt_new(SSL *ssl, uint8_t *key, uint8_t *iv, int is_decrypt, void
                 AES_CTX *aes_ctx;
                 if (cached)
                     aes_ctx = (AES_CTX*) cached;
-                else
-                    aes_ctx = (AES_CTX*) malloc(sizeof(AES_CTX));
+                else if ((aes_ctx = (AES_CTX*) slab_alloc(ssl->ssl_ctx, 
+                                SSL_SLAB_CIPHER, sizeof(AES_CTX))) == NULL)
+                    return NULL;
 
                 AES_set_key(aes_ctx, key, iv, AES_MODE_256);
 
@@ -1110,28 +1767,16 @@ static void *crypt_new(SSL *ssl, uint8_t *key, uint8_t *iv, int is_decrypt, void
 }
 
 /**
- * Send a packet over the socket.
+ * Write a buffer to the socket, waiting for space if we have to.
  */
-static int send_raw_packet(SSL *ssl, uint8_t protocol)
+static int write_all(SSL *ssl, const uint8_t *buf, int len)
 {
-    uint8_t *rec_buf = ssl->bm_all_data;
-    int pkt_size = SSL_RECORD_SIZE+ssl->bm_index;
     int sent = 0;
     int ret = SSL_OK;
 
-    rec_buf[0] = protocol;
-    rec_buf[1] = 0x03;      /* version = 3.1 or higher */
-    rec_buf[2] = ssl->version & 0x0f;
-    rec_buf[3] = ssl->bm_index >> 8;
-    rec_buf[4] = ssl->bm_index & 0xff;
-
-    DISPLAY_BYTES(ssl, PSTR("sending %d bytes"), ssl->bm_all_data, 
-                             pkt_size, pkt_size);
-
-    while (sent < pkt_size)
+    while (sent < len)
     {
-        ret = SOCKET_WRITE(ssl->client_fd, 
-                        &ssl->bm_all_data[sent], pkt_size-sent);
+        ret = SOCKET_WRITE(ssl->client_fd, (uint8_t *)&buf[sent], len-sent);
 
         if (ret >= 0)
             sent += ret;
@@ -1147,7 +1792,7 @@ static int send_raw_packet(SSL *ssl, uint8_t protocol)
         }
 #ifndef ESP8266
         /* keep going until the write buffer has some space */
-        if (sent != pkt_size)
+        if (sent != len)
         {
             fd_set wfds;
             FD_ZERO(&wfds);
@@ -1160,61 +1805,161 @@ static int send_raw_packet(SSL *ssl, uint8_t protocol)
 #endif
     }
 
-    SET_SSL_FLAG(SSL_NEED_RECORD);  /* reset for next time */
-    ssl->bm_index = 0;
+    return ret;
+}
 
-    if (protocol != PT_APP_PROTOCOL_DATA)  
+/**
+ * Add a record to the current flight. The record header is already at the 
+ * start of the buffer. Plaintext handshake messages are packed into the 
+ * previous record where they fit.
+ */
+static int add_to_flight(SSL *ssl, uint8_t protocol, 
+        const uint8_t *data, int len)
+{
+    DISPOSABLE_CTX *dc = ssl->dc;
+    int hdr_size = SSL_RECORD_SIZE;
+    int can_merge = protocol == PT_HANDSHAKE_PROTOCOL &&
+                                !IS_SET_SSL_FLAG(SSL_TX_ENCRYPTED);
+    uint8_t *flight_buf;
+
+    if (can_merge && dc->flight_can_merge && 
+            dc->flight_len-dc->flight_rec+len <= 
+                                max_record_length(ssl)+SSL_RECORD_SIZE)
     {
-        /* always return SSL_OK during handshake */   
-        ret = SSL_OK;
+        hdr_size = 0;
     }
 
-    return ret;
+    flight_buf = (uint8_t *)realloc(dc->flight_buf, 
+                                dc->flight_len+hdr_size+len);
+
+    if (flight_buf == NULL)
+        return SSL_NOT_OK;
+
+    dc->flight_buf = flight_buf;
+
+    if (hdr_size)   /* a new record */
+    {
+        dc->flight_rec = dc->flight_len;
+        memcpy(&flight_buf[dc->flight_len], ssl->bm_all_data, hdr_size);
+        dc->flight_len += hdr_size;
+    }
+    else            /* grow the last one */
+    {
+        int rec_len = dc->flight_len-dc->flight_rec-SSL_RECORD_SIZE+len;
+        flight_buf[dc->flight_rec+3] = rec_len >> 8;
+        flight_buf[dc->flight_rec+4] = rec_len & 0xff;
+    }
+
+    memcpy(&flight_buf[dc->flight_len], data, len);
+    dc->flight_len += len;
+
+    dc->flight_can_merge = can_merge;
+    return SSL_OK;
 }
 
 /**
- * Send an encrypted packet with padding bytes if necessary.
+ * Hold back the records that follow so that the whole flight of handshake
+ * messages goes out with one write.
  */
-int send_packet(SSL *ssl, uint8_t protocol, const uint8_t *in, int length)
+void start_flight(SSL *ssl)
 {
-    int ret, msg_length = 0;
+    if (ssl->dc)
+        SET_SSL_FLAG(SSL_BUFFER_FLIGHT);
+}
 
-    /* if our state is bad, don't bother */
-    if (ssl->hs_status == SSL_ERROR_DEAD)
-        return SSL_ERROR_CONN_LOST;
+/**
+ * Send everything held back since start_flight().
+ */
+int flush_flight(SSL *ssl)
+{
+    DISPOSABLE_CTX *dc = ssl->dc;
+    int ret = SSL_OK;
 
-    if (IS_SET_SSL_FLAG(SSL_SENT_CLOSE_NOTIFY))
-        return SSL_CLOSE_NOTIFY;
+    CLR_SSL_FLAG(SSL_BUFFER_FLIGHT);
 
-    if (in) /* has the buffer already been initialised? */
+    if (dc && dc->flight_buf)
     {
-        memcpy(ssl->bm_data, in, length);
+        if (write_all(ssl, dc->flight_buf, dc->flight_len) < 0)
+            ret = SSL_ERROR_CONN_LOST;
+
+        free(dc->flight_buf);
+        dc->flight_buf = NULL;
+        dc->flight_len = 0;
+        dc->flight_can_merge = 0;
     }
 
-    msg_length += length;
+    return ret;
+}
 
-    if (IS_SET_SSL_FLAG(SSL_TX_ENCRYPTED))
+/**
+ * Send a packet over the socket. The data is either in the buffer already
+ * or is plaintext that is sent from where it is.
+ */
+static int send_raw_packet(SSL *ssl, uint8_t protocol, 
+        const uint8_t *data, int len)
+{
+    uint8_t *rec_buf = ssl->bm_all_data;
+    int pkt_size = SSL_RECORD_SIZE+len;
+    int ret = SSL_OK;
+
+    rec_buf[0] = protocol;
+    rec_buf[1] = 0x03;      /* version = 3.1 or higher */
+    rec_buf[2] = ssl->version & 0x0f;
+    rec_buf[3] = len >> 8;
+    rec_buf[4] = len & 0xff;
+
+    /* send it with the rest of the flight if we can, otherwise now */
+    if (!IS_SET_SSL_FLAG(SSL_BUFFER_FLIGHT) || ssl->dc == NULL ||
+                        add_to_flight(ssl, protocol, data, len) != SSL_OK)
     {
-        int mode = IS_SET_SSL_FLAG(SSL_IS_CLIENT) ? 
-                            SSL_CLIENT_WRITE : SSL_SERVER_WRITE;
-        uint8_t hmac_header[SSL_RECORD_SIZE] = 
-        {
-            protocol, 
-            0x03, /* version = 3.1 or higher */
-            ssl->version & 0x0f,
-            msg_length >> 8,
-            msg_length & 0xff 
-        };
+        if (data != ssl->bm_data)
+            memmove(ssl->bm_data, data, len);
 
-        if (protocol == PT_HANDSHAKE_PROTOCOL)
-        {
-            DISPLAY_STATE(ssl, 1, ssl->bm_data[0], 0);
+        DISPLAY_BYTES(ssl, PSTR("sending %d bytes"), ssl->bm_all_data, 
+                                 pkt_size, pkt_size);
 
-            if (ssl->bm_data[0] != HS_HELLO_REQUEST)
-            {
-                add_packet(ssl, ssl->bm_data, msg_length);
-            }
-        }
+        if (flush_flight(ssl) < 0 ||
+                (ret = write_all(ssl, ssl->bm_all_data, pkt_size)) < 0)
+            return SSL_ERROR_CONN_LOST;
+    }
+
+    SET_SSL_FLAG(SSL_NEED_RECORD);  /* reset for next time */
+    ssl->bm_index = 0;
+
+    if (protocol != PT_APP_PROTOCOL_DATA)  
+    {
+        /* always return SSL_OK during handshake */   
+        ret = SSL_OK;
+    }
+
+    return ret;
+}
+
+/**
+ * Send one record, encrypted with padding bytes if necessary.
+ */
+static int send_record(SSL *ssl, uint8_t protocol, 
+        const uint8_t *data, int length)
+{
+    int msg_length = length;
+
+    if (IS_SET_SSL_FLAG(SSL_TX_ENCRYPTED))
+    {
+        int mode = IS_SET_SSL_FLAG(SSL_IS_CLIENT) ? 
+                            SSL_CLIENT_WRITE : SSL_SERVER_WRITE;
+        uint8_t hmac_header[SSL_RECORD_SIZE] = 
+        {
+            protocol, 
+            0x03, /* version = 3.1 or higher */
+            ssl->version & 0x0f,
+            msg_length >> 8,
+            msg_length & 0xff 
+        };
+
+        if (data != ssl->bm_data)   /* it may be read data */
+            memmove(ssl->bm_data, data, length);
+
+        data = ssl->bm_data;
 
         /* add the packet digest */
         add_hmac_digest(ssl, mode, hmac_header, ssl->bm_data, msg_length, 
@@ -1255,21 +2000,96 @@ int send_packet(SSL *ssl, uint8_t protocol, const uint8_t *in, int length)
         ssl->cipher_info->encrypt(ssl->encrypt_ctx, ssl->bm_data, 
                                             ssl->bm_data, msg_length);
     }
-    else if (protocol == PT_HANDSHAKE_PROTOCOL)
+
+    return send_raw_packet(ssl, protocol, data, msg_length);
+}
+
+/**
+ * Send a message, split over as many records as it needs.
+ */
+int send_packet(SSL *ssl, uint8_t protocol, const uint8_t *in, int length)
+{
+    int ret, msg_length = length;
+    const uint8_t *data;
+    uint8_t *copy = NULL;
+
+    /* if our state is bad, don't bother */
+    if (ssl->hs_status == SSL_ERROR_DEAD)
+        return SSL_ERROR_CONN_LOST;
+
+    if (IS_SET_SSL_FLAG(SSL_SENT_CLOSE_NOTIFY))
+        return SSL_CLOSE_NOTIFY;
+
+    if (bm_data_alloc(ssl) != SSL_OK)
+        return SSL_NOT_OK;
+
+    /* has the buffer already been initialised? */
+    data = in ? in : ssl->bm_data;
+
+    if (protocol == PT_HANDSHAKE_PROTOCOL)
     {
-        DISPLAY_STATE(ssl, 1, ssl->bm_data[0], 0);
+        DISPLAY_STATE(ssl, 1, data[0], 0);
 
-        if (ssl->bm_data[0] != HS_HELLO_REQUEST)
+        if (data[0] != HS_HELLO_REQUEST)
         {
-            add_packet(ssl, ssl->bm_data, length);
+            add_packet(ssl, data, length);
         }
     }
 
-    ssl->bm_index = msg_length;
-    if ((ret = send_raw_packet(ssl, protocol)) <= 0)
-        return ret;
+    /* each encrypted piece is built in the buffer, where the rest is */
+    if (in == NULL && IS_SET_SSL_FLAG(SSL_TX_ENCRYPTED) && 
+                                    msg_length > max_record_length(ssl))
+    {
+        if ((copy = (uint8_t *)malloc(msg_length)) == NULL)
+            return SSL_NOT_OK;
+
+        memcpy(copy, ssl->bm_data, msg_length);
+        data = copy;
+    }
+
+    /* a message may have to be split over records */
+    while (msg_length > max_record_length(ssl))
+    {
+        if ((ret = send_record(ssl, protocol, data, 
+                                    max_record_length(ssl))) < 0)
+            goto error;
+
+        data += max_record_length(ssl);
+        msg_length -= max_record_length(ssl);
+    }
+
+    if ((ret = send_record(ssl, protocol, data, msg_length)) > 0)
+        ret = length;   /* just return what we wanted to send */
+
+error:
+    free(copy);
+    return ret;
+}
+
+/**
+ * The most plaintext that can go in a record we send.
+ */
+static int max_record_length(SSL *ssl)
+{
+    if (ssl->record_limit && ssl->record_limit < ssl->max_plain_length)
+        return ssl->record_limit;
+
+    return ssl->max_plain_length;
+}
+
+/**
+ * Use the record size that was agreed with the peer in both directions. The
+ * buffer is cut down to suit at the next record that starts clean.
+ */
+void set_record_limit(SSL *ssl, int limit)
+{
+    ssl->record_limit = limit;
 
-    return length;  /* just return what we wanted to send */
+    if (limit < ssl->max_plain_length)
+    {
+        ssl->max_plain_length = limit;
+        SET_SSL_FLAG(SSL_SHRINK_BUFFER);
+    }
 }
 
 /**
@@ -1355,10 +2175,182 @@ static int set_key_block(SSL *ssl, int is_write)
             ssl->decrypt_ctx = crypt_new(ssl, client_key, client_iv, 1, ssl->decrypt_ctx);
     }
 
+    if ((is_write ? ssl->encrypt_ctx : ssl->decrypt_ctx) == NULL)
+        return -1;
+
     ssl->cipher_info = ciph_info;
     return 0;
 }
 
+/**
+ * How much of a streamed record to read next. It has to fit in the buffer
+ * after any partial message.
+ */
+static int stream_chunk_size(SSL *ssl)
+{
+    int space = ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET-
+                                                    ssl->dc->hs_carry;
+    return ssl->dc->rec_left < space ? ssl->dc->rec_left : space;
+}
+
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+/**
+ * Add a certificate to the chain that is arriving.
+ */
+static int add_stream_cert(SSL *ssl, const uint8_t *buf)
+{
+    DISPOSABLE_CTX *dc = ssl->dc;
+    X509_CTX **certs = (X509_CTX **)realloc(dc->certs, 
+                                (dc->num_certs+1)*sizeof(X509_CTX *));
+
+    if (certs == NULL)
+        return SSL_NOT_OK;
+
+    dc->certs = certs;
+    ax_wdt_feed();
+
+    if (x509_new(buf, NULL, &certs[dc->num_certs]))
+        return SSL_ERROR_BAD_CERTIFICATE;
+
+#if defined (CONFIG_SSL_FULL_MODE)
+    if (ssl->ssl_ctx->options & SSL_DISPLAY_CERTS)
+        x509_print(certs[dc->num_certs], NULL);
+#endif
+    dc->num_certs++;
+    return SSL_OK;
+}
+#endif
+
+/**
+ * Work through the handshake messages of a streamed (or decrypted) record as 
+ * they arrive. Whatever is left of an incomplete message is kept at the 
+ * start of the buffer for next time. A certificate chain is taken a 
+ * certificate at a time, so it never has to be in the buffer all at once.
+ */
+static int process_stream(SSL *ssl, int read_len)
+{
+    DISPOSABLE_CTX *dc = ssl->dc;
+    uint8_t *buf = ssl->bm_data;
+    int len = dc->hs_carry+read_len;
+    int offset = 0, ret = SSL_OK;
+
+    dc->rec_left -= read_len;
+
+    while (ret == SSL_OK && dc && offset < len)
+    {
+        uint8_t *msg = &buf[offset];
+        int avail = len-offset;
+        int hs_len;
+
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+        if (dc->cert_left)      /* part way through a certificate chain */
+        {
+            int cert_size;
+
+            if (avail < 3)
+                break;
+
+            cert_size = (msg[1]<<8) + msg[2];
+
+            if (msg[0] || cert_size+3 > dc->cert_left)
+            {
+                ret = SSL_ERROR_BAD_CERTIFICATE;
+                break;
+            }
+
+            if (avail < cert_size+3)
+                break;
+
+            add_packet(ssl, msg, cert_size+3);
+            ret = add_stream_cert(ssl, &msg[3]);
+            offset += cert_size+3;
+            dc->cert_left -= cert_size+3;
+
+            if (ret == SSL_OK && dc->cert_left == 0)   /* got them all */
+                ret = handshake_type_dispatch(ssl, HS_CERTIFICATE, NULL, 0);
+
+            dc = ssl->dc;
+            continue;
+        }
+#endif
+
+        if (avail < SSL_HS_HDR_SIZE)
+            break;
+
+        hs_len = (msg[1]<<16) + (msg[2]<<8) + msg[3];
+
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+        /* a chain that hasn't all arrived is done a certificate at a time */
+        if (msg[0] == HS_CERTIFICATE && ssl->next_state == HS_CERTIFICATE &&
+                avail < hs_len+SSL_HS_HDR_SIZE)
+        {
+            if (avail < 7)
+                break;
+
+            dc->cert_left = (msg[4]<<16) + (msg[5]<<8) + msg[6];
+
+            if (dc->cert_left == 0 || dc->cert_left+3 != hs_len)
+            {
+                ret = SSL_ERROR_INVALID_HANDSHAKE;
+                break;
+            }
+
+            DISPLAY_STATE(ssl, 0, HS_CERTIFICATE, 0);
+            add_packet(ssl, msg, 7);
+            offset += 7;
+            continue;
+        }
+#endif
+
+        if (avail < hs_len+SSL_HS_HDR_SIZE)
+            break;
+
+        dc->bm_proc_index = offset;
+        ret = do_handshake(ssl, msg, hs_len+SSL_HS_HDR_SIZE);
+        offset += hs_len+SSL_HS_HDR_SIZE;
+        dc = ssl->dc;
+    }
+
+    if (ret != SSL_OK)
+        return ret;
+
+    if (dc == NULL)     /* the handshake is over */
+    {
+        if (offset < len)
+            return SSL_ERROR_INVALID_HANDSHAKE;
+    }
+    else
+    {
+        /* keep what is left for next time */
+        dc->hs_carry = len-offset;
+        memmove(buf, &buf[offset], dc->hs_carry);
+
+        /* make room if a single message or certificate won't fit */
+        if (ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET-dc->hs_carry < 
+                SSL_RECORD_SIZE && (increase_bm_data_size(ssl, 
+                    RT_MAX_PLAIN_LENGTH) != SSL_OK || 
+            ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET-dc->hs_carry <
+                SSL_RECORD_SIZE))
+        {
+            return SSL_ERROR_RECORD_OVERFLOW;
+        }
+    }
+
+    if (dc && dc->rec_left)     /* more of this record to come */
+    {
+        CLR_SSL_FLAG(SSL_NEED_RECORD);
+        ssl->need_bytes = stream_chunk_size(ssl);
+    }
+    else
+    {
+        CLR_SSL_FLAG(SSL_STREAM_RECORD);
+        SET_SSL_FLAG(SSL_NEED_RECORD);
+        ssl->need_bytes = SSL_RECORD_SIZE;
+    }
+
+    return SSL_OK;
+}
+
 /**
  * Read the SSL connection.
  */
@@ -1366,11 +2358,49 @@ int basic_read(SSL *ssl, uint8_t **in_data)
 {
     int ret = SSL_OK;
     int read_len, is_client = IS_SET_SSL_FLAG(SSL_IS_CLIENT);
-    uint8_t *buf = ssl->bm_data;
+    int carry = ssl->dc ? ssl->dc->hs_carry : 0;
+    int hdr_only = IS_SET_SSL_FLAG(SSL_RELEASE_BUFFERS) && ssl->dc == NULL &&
+                                        IS_SET_SSL_FLAG(SSL_NEED_RECORD);
+    uint8_t *buf;
 
     if (IS_SET_SSL_FLAG(SSL_SENT_CLOSE_NOTIFY))
         return SSL_CLOSE_NOTIFY;
 
+    /* 
+     * In release mode the buffer goes when there is nothing part read (any
+     * data we returned last time is finished with now). A record header is
+     * read without it.
+     */
+    if (hdr_only)
+    {
+        if (ssl->got_bytes == 0)
+            bm_data_release(ssl);
+
+        buf = ssl->rec_hdr;
+    }
+    else
+    {
+        /* a smaller record size was agreed, so give back what we can */
+        if (IS_SET_SSL_FLAG(SSL_SHRINK_BUFFER) && 
+                IS_SET_SSL_FLAG(SSL_NEED_RECORD) && 
+                ssl->got_bytes == 0 && carry == 0)
+        {
+            uint8_t *new_bm_all_data = (uint8_t *)ax_realloc_hint(
+                                ssl->bm_all_data, 
+                                ssl->max_plain_length+RT_EXTRA, SSL_ALLOC_RECORD);
+
+            if (new_bm_all_data)
+            {
+                ssl->bm_all_data = new_bm_all_data;
+                ssl->bm_data = ssl->bm_all_data + BM_RECORD_OFFSET;
+            }
+
+            CLR_SSL_FLAG(SSL_SHRINK_BUFFER);
+        }
+
+        buf = &ssl->bm_data[carry];         /* after any partial message */
+    }
+
     read_len = SOCKET_READ(ssl->client_fd, &buf[ssl->bm_read_index], 
                             ssl->need_bytes-ssl->got_bytes);
 
@@ -1393,7 +2423,7 @@ int basic_read(SSL *ssl, uint8_t **in_data)
     }
 
     DISPLAY_BYTES(ssl, PSTR("received %d bytes"), 
-            &ssl->bm_data[ssl->bm_read_index], read_len, read_len);
+            &buf[ssl->bm_read_index], read_len, read_len);
 
     ssl->got_bytes += read_len;
     ssl->bm_read_index += read_len;
@@ -1407,6 +2437,18 @@ int basic_read(SSL *ssl, uint8_t **in_data)
 
     if (IS_SET_SSL_FLAG(SSL_NEED_RECORD))
     {
+        if (hdr_only)   /* a record is on its way, so get the buffer back */
+        {
+            if (bm_data_alloc(ssl) != SSL_OK)
+            {
+                ret = SSL_NOT_OK;
+                goto error;
+            }
+
+            memcpy(ssl->bm_data, ssl->rec_hdr, SSL_RECORD_SIZE);
+            buf = ssl->bm_data;
+        }
+
         /* check for sslv2 "client hello" */
         if ((buf[0] & 0x80) && buf[2] == 1)
         {
@@ -1429,12 +2471,42 @@ int basic_read(SSL *ssl, uint8_t **in_data)
         memcpy(ssl->hmac_header, buf, 3);       /* store for hmac */
         ssl->record_type = buf[0];
 
-        /* is the allocated buffer large enough to handle all the data? if not, increase its size*/
-        if (ssl->need_bytes > ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET)
+        /* 
+         * Plaintext handshake records are worked through a piece at a time,
+         * so messages can span records and a large one doesn't need the 
+         * buffer to grow.
+         */
+        if (ssl->record_type == PT_HANDSHAKE_PROTOCOL && ssl->dc && 
+                                    !IS_SET_SSL_FLAG(SSL_RX_ENCRYPTED))
         {
+            ssl->dc->rec_left = ssl->need_bytes;
+            ssl->need_bytes = stream_chunk_size(ssl);
+            SET_SSL_FLAG(SSL_STREAM_RECORD);
+        }
+        else if (carry && ssl->record_type != PT_HANDSHAKE_PROTOCOL)
+        {
+            /* the rest of the message must come next */
+            ret = SSL_ERROR_INVALID_HANDSHAKE;
+            goto error;
+        }
+        /* is the allocated buffer large enough to handle all the data (after
+           any partial message)? if not, increase its size*/
+        else if (carry+ssl->need_bytes > 
+                            ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET)
+        {
+            /* the peer agreed not to send records this big */
+            if (ssl->record_limit && ssl->need_bytes > 
+                        ssl->record_limit+RT_EXTRA-BM_RECORD_OFFSET)
+            {
+                ret = SSL_ERROR_RECORD_OVERFLOW;
+                goto error;
+            }
+
             printf("ssl->need_bytes=%d > %d\r\n", ssl->need_bytes, ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET);
-            ret = increase_bm_data_size(ssl, ssl->need_bytes + BM_RECORD_OFFSET - RT_EXTRA);
-            if (ret != SSL_OK)
+            ret = increase_bm_data_size(ssl, 
+                        carry + ssl->need_bytes + BM_RECORD_OFFSET - RT_EXTRA);
+            if (ret != SSL_OK || carry+ssl->need_bytes > 
+                            ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET)
             {
                 ret = SSL_ERROR_INVALID_PROT_MSG;
                 goto error;
@@ -1445,6 +2517,12 @@ int basic_read(SSL *ssl, uint8_t **in_data)
         goto error;                         /* no error, we're done */
     }
 
+    if (IS_SET_SSL_FLAG(SSL_STREAM_RECORD))
+    {
+        ret = process_stream(ssl, read_len);
+        goto error;
+    }
+
     /* for next time - just do it now in case of an error */
     SET_SSL_FLAG(SSL_NEED_RECORD);
     ssl->need_bytes = SSL_RECORD_SIZE;
@@ -1480,8 +2558,11 @@ int basic_read(SSL *ssl, uint8_t **in_data)
         case PT_HANDSHAKE_PROTOCOL:
             if (ssl->dc != NULL)
             {
-                ssl->dc->bm_proc_index = 0;
-                ret = do_handshake(ssl, buf, read_len);
+                /* the messages go on from any partial one, as they do in the
+                   clear, so they can span records */
+                memmove(&ssl->bm_data[carry], buf, read_len);
+                ssl->dc->rec_left = read_len;
+                ret = process_stream(ssl, read_len);
             }
             else /* no client renegotiation allowed */
             {
@@ -1509,7 +2590,10 @@ int basic_read(SSL *ssl, uint8_t **in_data)
             break;
 
         case PT_APP_PROTOCOL_DATA:
-            if (in_data && ssl->hs_status == SSL_OK)
+            /* nothing is read until the handshake is verified, even if
+               we have started writing */
+            if (in_data && ssl->hs_status == SSL_OK && 
+                                !IS_SET_SSL_FLAG(SSL_FALSE_STARTED))
             {
                 *in_data = buf;   /* point to the work buffer */
                 (*in_data)[read_len] = 0;  /* null terminate just in case */
@@ -1550,66 +2634,199 @@ error:
     return ret;
 }
 
-int increase_bm_data_size(SSL *ssl, size_t size)
+/**
+ * Take a buffer of this size from the pool, or from the heap if there isn't
+ * one.
+ */
+static uint8_t *buf_pool_get(SSL_CTX *ssl_ctx, size_t size)
 {
-    if (ssl->max_plain_length == RT_MAX_PLAIN_LENGTH) {
-        return SSL_OK;
-    }
-    if (ssl->can_free_certificates) {
-        certificate_free(ssl);
-    }
-    size_t required = (size + 1023) & ~(1023); // round up to 1k
-    required = (required < RT_MAX_PLAIN_LENGTH) ? required : RT_MAX_PLAIN_LENGTH;
-    uint8_t* new_bm_all_data = (uint8_t*) realloc(ssl->bm_all_data, required + RT_EXTRA);
-    if (!new_bm_all_data) {
-        printf("failed to grow plain buffer\r\n");
-        ssl->hs_status = SSL_ERROR_DEAD;
-        return SSL_ERROR_CONN_LOST;
+    SSL_POOL_BUF **pb, *b = NULL;
+
+    if (ssl_ctx->max_pool_bufs)
+    {
+        SSL_CTX_LOCK(ssl_ctx->mutex);
+
+        for (pb = &ssl_ctx->buf_pool; *pb; pb = &(*pb)->next)
+        {
+            if ((*pb)->size == size)
+            {
+                b = *pb;
+                *pb = b->next;
+                ssl_ctx->num_pool_bufs--;
+                break;
+            }
+        }
+
+        SSL_CTX_UNLOCK(ssl_ctx->mutex);
     }
-    ssl->bm_all_data = new_bm_all_data;
-    ssl->bm_data = ssl->bm_all_data + BM_RECORD_OFFSET;
-    ssl->max_plain_length = required;
-    return SSL_OK;
+
+    return b ? (uint8_t *)b : (uint8_t *)ax_malloc_hint(size, SSL_ALLOC_RECORD);
 }
 
 /**
- * Do some basic checking of data and then perform the appropriate handshaking.
+ * Give a buffer back to the pool, or to the heap if the pool is full.
  */
-static int do_handshake(SSL *ssl, uint8_t *buf, int read_len)
+static void buf_pool_put(SSL_CTX *ssl_ctx, uint8_t *buf, size_t size)
 {
-    int hs_len = (buf[2]<<8) + buf[3];
-    uint8_t handshake_type = buf[0];
-    int ret = SSL_OK;
-    int is_client = IS_SET_SSL_FLAG(SSL_IS_CLIENT);
+    SSL_POOL_BUF *b = (SSL_POOL_BUF *)buf;
 
-    /* some integrity checking on the handshake */
-    PARANOIA_CHECK(read_len-SSL_HS_HDR_SIZE, hs_len);
+    SSL_CTX_LOCK(ssl_ctx->mutex);
 
-    if (handshake_type != ssl->next_state)
+    if (ssl_ctx->num_pool_bufs < ssl_ctx->max_pool_bufs)
     {
-        /* handle a special case on the client */
-        if (!is_client || handshake_type != HS_CERT_REQ ||
-                        ssl->next_state != HS_SERVER_HELLO_DONE)
-        {
-            ret = SSL_ERROR_INVALID_HANDSHAKE;
-            goto error;
-        }
+        b->next = ssl_ctx->buf_pool;
+        b->size = size;
+        ssl_ctx->buf_pool = b;
+        ssl_ctx->num_pool_bufs++;
+        b = NULL;
     }
 
-    hs_len += SSL_HS_HDR_SIZE;  /* adjust for when adding packets */
-    ssl->bm_index = hs_len;     /* store the size and check later */
-    DISPLAY_STATE(ssl, 0, handshake_type, 0);
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    free(b);
+}
 
-    if (handshake_type != HS_CERT_VERIFY && handshake_type != HS_HELLO_REQUEST)
-        add_packet(ssl, buf, hs_len); 
+/*
+ * Keep idle record buffers for the connections of this context.
+ */
+EXP_FUNC void STDCALL ssl_ctx_set_buffer_pool(SSL_CTX *ssl_ctx, 
+        int num_buffers)
+{
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    ssl_ctx->max_pool_bufs = num_buffers;
 
-#if defined(CONFIG_SSL_ENABLE_CLIENT)
-    ret = is_client ? 
-        do_clnt_handshake(ssl, handshake_type, buf, hs_len) :
-        do_svr_handshake(ssl, handshake_type, buf, hs_len);
-#else
-    ret = do_svr_handshake(ssl, handshake_type, buf, hs_len);
-#endif
+    while (ssl_ctx->num_pool_bufs > num_buffers)
+    {
+        SSL_POOL_BUF *b = ssl_ctx->buf_pool;
+        ssl_ctx->buf_pool = b->next;
+        ssl_ctx->num_pool_bufs--;
+        free(b);
+    }
+
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+}
+
+/**
+ * Get the record buffer back if it was released.
+ */
+static int bm_data_alloc(SSL *ssl)
+{
+    if (ssl->bm_all_data == NULL)
+    {
+        ssl->bm_all_data = buf_pool_get(ssl->ssl_ctx, 
+                                    ssl->max_plain_length+RT_EXTRA);
+
+        if (ssl->bm_all_data == NULL)
+            return SSL_NOT_OK;
+
+        ssl->bm_data = ssl->bm_all_data + BM_RECORD_OFFSET;
+    }
+
+    return SSL_OK;
+}
+
+/**
+ * Hand the record buffer back. One that grew (or is still to shrink) isn't
+ * a size that others will want, so it isn't pooled.
+ */
+static void bm_data_free(SSL *ssl)
+{
+    if (ssl->bm_all_data == NULL)
+        return;
+
+    if (IS_SET_SSL_FLAG(SSL_SHRINK_BUFFER) || 
+                        ssl->max_plain_length > RT_DEFAULT_PLAIN_LENGTH)
+        free(ssl->bm_all_data);
+    else
+        buf_pool_put(ssl->ssl_ctx, ssl->bm_all_data, 
+                                    ssl->max_plain_length+RT_EXTRA);
+
+    ssl->bm_all_data = ssl->bm_data = NULL;
+    CLR_SSL_FLAG(SSL_SHRINK_BUFFER);
+}
+
+/**
+ * Let the record buffer go while the connection has nothing to read. It 
+ * comes back at its normal size if it grew for a large record.
+ */
+static void bm_data_release(SSL *ssl)
+{
+    size_t size = RT_DEFAULT_PLAIN_LENGTH;
+
+    bm_data_free(ssl);
+
+    if (ssl->record_limit && ssl->record_limit < size)
+        size = ssl->record_limit;
+
+    if (ssl->max_plain_length > size)
+        ssl->max_plain_length = size;
+}
+
+int increase_bm_data_size(SSL *ssl, size_t size)
+{
+    if (ssl->max_plain_length == RT_MAX_PLAIN_LENGTH) {
+        return SSL_OK;
+    }
+    if (ssl->can_free_certificates) {
+        certificate_free(ssl);
+    }
+    size_t required = (size + 1023) & ~(1023); // round up to 1k
+    required = (required < RT_MAX_PLAIN_LENGTH) ? required : RT_MAX_PLAIN_LENGTH;
+    uint8_t* new_bm_all_data = (uint8_t*) ax_realloc_hint(ssl->bm_all_data, required + RT_EXTRA, SSL_ALLOC_RECORD);
+    if (!new_bm_all_data) {
+        printf("failed to grow plain buffer\r\n");
+        ssl->hs_status = SSL_ERROR_DEAD;
+        return SSL_ERROR_CONN_LOST;
+    }
+    ssl->bm_all_data = new_bm_all_data;
+    ssl->bm_data = ssl->bm_all_data + BM_RECORD_OFFSET;
+    ssl->max_plain_length = required;
+    return SSL_OK;
+}
+
+/**
+ * Do some basic checking of data and then perform the appropriate handshaking.
+ */
+static int do_handshake(SSL *ssl, uint8_t *buf, int read_len)
+{
+    int hs_len = (buf[2]<<8) + buf[3];
+    uint8_t handshake_type = buf[0];
+    int ret = SSL_OK;
+    int is_client = IS_SET_SSL_FLAG(SSL_IS_CLIENT);
+
+    /* some integrity checking on the handshake */
+    PARANOIA_CHECK(read_len-SSL_HS_HDR_SIZE, hs_len);
+
+    /* a client ignores a hello request while it is already negotiating */
+    if (is_client && handshake_type == HS_HELLO_REQUEST &&
+                                    ssl->next_state != HS_HELLO_REQUEST)
+    {
+        hs_len += SSL_HS_HDR_SIZE;
+
+        if (hs_len < read_len)
+            ret = do_handshake(ssl, &buf[hs_len], read_len-hs_len);
+
+        goto error;
+    }
+
+    if (handshake_type != ssl->next_state)
+    {
+        /* handle a special case on the client */
+        if (!is_client || handshake_type != HS_CERT_REQ ||
+                        ssl->next_state != HS_SERVER_HELLO_DONE)
+        {
+            ret = SSL_ERROR_INVALID_HANDSHAKE;
+            goto error;
+        }
+    }
+
+    hs_len += SSL_HS_HDR_SIZE;  /* adjust for when adding packets */
+    ssl->bm_index = hs_len;     /* store the size and check later */
+    DISPLAY_STATE(ssl, 0, handshake_type, 0);
+
+    if (handshake_type != HS_CERT_VERIFY && handshake_type != HS_HELLO_REQUEST)
+        add_packet(ssl, buf, hs_len); 
+
+    ret = handshake_type_dispatch(ssl, handshake_type, buf, hs_len);
 
     /* just use recursion to get the rest */
     if (hs_len < read_len && ret == SSL_OK)
@@ -1619,6 +2836,21 @@ error:
     return ret;
 }
 
+/**
+ * Hand a handshake message to the client or server side.
+ */
+static int handshake_type_dispatch(SSL *ssl, uint8_t handshake_type, 
+        uint8_t *buf, int hs_len)
+{
+#if defined(CONFIG_SSL_ENABLE_CLIENT)
+    return IS_SET_SSL_FLAG(SSL_IS_CLIENT) ? 
+        do_clnt_handshake(ssl, handshake_type, buf, hs_len) :
+        do_svr_handshake(ssl, handshake_type, buf, hs_len);
+#else
+    return do_svr_handshake(ssl, handshake_type, buf, hs_len);
+#endif
+}
+
 /**
  * Sends the change cipher spec message. We have just read a finished message
  * from the client.
@@ -1653,11 +2885,21 @@ int send_finished(SSL *ssl)
 
 #ifndef CONFIG_SSL_SKELETON_MODE
     /* store in the session cache */
-    if (!IS_SET_SSL_FLAG(SSL_SESSION_RESUME) && ssl->ssl_ctx->num_sessions)
+    if (!IS_SET_SSL_FLAG(SSL_SESSION_RESUME) && ssl->session)
     {
         memcpy(ssl->session->master_secret,
                 ssl->dc->master_secret, SSL_SECRET_SIZE);
     }
+
+    /* and in the session store (if it isn't for one of our hosts) */
+    if (!IS_SET_SSL_FLAG(SSL_SESSION_RESUME) && ssl->dc->host_name == NULL &&
+            ssl->ssl_ctx->sess_new_cb && ssl->sess_id_size)
+    {
+        SSL_CTX_LOCK(ssl->ssl_ctx->mutex);
+        ssl->ssl_ctx->sess_new_cb(ssl->ssl_ctx->sess_cb_arg, 
+                ssl->session_id, ssl->dc->master_secret, time(NULL));
+        SSL_CTX_UNLOCK(ssl->ssl_ctx->mutex);
+    }
 #endif
 
     return send_packet(ssl, PT_HANDSHAKE_PROTOCOL,
@@ -1761,226 +3003,852 @@ int send_alert(SSL *ssl, int error_code)
 }
 
 /**
- * Process a client finished message.
+ * Process a client finished message.
+ */
+int process_finished(SSL *ssl, uint8_t *buf, int hs_len)
+{
+    int ret = SSL_OK;
+    int is_client = IS_SET_SSL_FLAG(SSL_IS_CLIENT);
+    int resume = IS_SET_SSL_FLAG(SSL_SESSION_RESUME);
+
+    PARANOIA_CHECK(ssl->bm_index, SSL_FINISHED_HASH_SIZE+4);
+
+    /* check that we all work before we continue */
+    if (memcmp(ssl->dc->final_finish_mac, &buf[4], SSL_FINISHED_HASH_SIZE))
+        return SSL_ERROR_FINISHED_INVALID;
+
+    if ((!is_client && !resume) || (is_client && resume))
+    {
+        start_flight(ssl);
+#ifndef CONFIG_SSL_SKELETON_MODE
+        /* the ticket goes out before the change cipher spec */
+        if (!is_client && IS_SET_SSL_FLAG(SSL_NEW_TICKET))
+            ret = send_new_session_ticket(ssl);
+
+        if (ret == SSL_OK && (ret = send_change_cipher_spec(ssl)) == SSL_OK)
+#else
+        if ((ret = send_change_cipher_spec(ssl)) == SSL_OK)
+#endif
+            ret = send_finished(ssl);
+
+        if (flush_flight(ssl) < 0)
+            ret = SSL_ERROR_CONN_LOST;
+    }
+
+    /* if we ever renegotiate */
+    ssl->next_state = is_client ? HS_HELLO_REQUEST : HS_CLIENT_HELLO;  
+    ssl->hs_status = ret;  /* set the final handshake status */
+
+error:
+    return ret;
+}
+
+/**
+ * Send a certificate.
+ */
+int send_certificate(SSL *ssl)
+{
+    int ret = SSL_OK;
+    SSL_CONFIG *config = ssl->config;
+
+    /* spec says we must check if the hash/sig algorithm is OK */
+    if (ssl->version >= SSL_PROTOCOL_VERSION_TLS1_2 &&
+             ((ret = check_certificate_chain(ssl)) != SSL_OK))
+    {
+        ret = SSL_ERROR_INVALID_CERT_HASH_ALG;
+        goto error;
+    }
+
+    /* the message was put together as the certificates were loaded */
+    if (config->cert_msg)
+    {
+        ret = send_packet(ssl, PT_HANDSHAKE_PROTOCOL, 
+                config->cert_msg, config->cert_msg_len);
+    }
+    else
+    {
+        ret = send_packet(ssl, PT_HANDSHAKE_PROTOCOL, 
+                g_empty_cert_msg, sizeof(g_empty_cert_msg));
+    }
+
+error:
+    return ret;
+}
+
+/**
+ * Create a blob of memory that we'll get rid of once the handshake is
+ * complete.
+ */
+int disposable_new(SSL *ssl)
+{
+    if (ssl->dc == NULL)
+    {
+        ssl->dc = (DISPOSABLE_CTX *)slab_alloc(ssl->ssl_ctx, 
+                                SSL_SLAB_DISPOSABLE, sizeof(DISPOSABLE_CTX));
+    }
+
+    return ssl->dc ? SSL_OK : SSL_NOT_OK;
+}
+
+/**
+ * Remove the temporary blob of memory.
+ */
+void disposable_free(SSL *ssl)
+{
+    if (ssl->dc)
+    {
+        free(ssl->dc->flight_buf);
+        free(ssl->dc->hs_msgs);
+        free(ssl->dc->host_name);
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+        while (ssl->dc->num_certs)
+            x509_free(ssl->dc->certs[--ssl->dc->num_certs]);
+
+        free(ssl->dc->certs);
+#endif
+        memset(ssl->dc, 0, sizeof(DISPOSABLE_CTX));
+        slab_free(ssl->ssl_ctx, SSL_SLAB_DISPOSABLE, ssl->dc);
+        ssl->dc = NULL;
+    }
+    ssl->can_free_certificates = true;
+}
+
+static void certificate_free(SSL* ssl)
+{
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+    if (ssl->x509_ctx) {
+        x509_free(ssl->x509_ctx);
+        ssl->x509_ctx = 0;
+    }
+    ssl->can_free_certificates = false;
+#endif
+}
+
+#ifndef CONFIG_SSL_SKELETON_MODE     /* no session resumption in this mode */
+/*
+ * The session cache is a hash table of num_sessions buckets indexed by the
+ * session id. Every session is also on a list in order of use, so the least
+ * recently used one can be recycled straight away when the cache is full.
+ * Sessions are never freed before the context is, since a connection may
+ * still be using one. Unlike the connection table it isn't sharded: every
+ * lookup moves a session on the one list of use, so it all takes the 
+ * context's lock.
+ */
+static int session_hash(const SSL_CTX *ssl_ctx, const uint8_t *session_id)
+{
+    uint32_t hash = 2166136261U;    /* FNV-1a */
+    int i;
+
+    for (i = 0; i < SSL_SESSION_ID_SIZE; i++)
+    {
+        hash ^= session_id[i];
+        hash *= 16777619U;
+    }
+
+    return hash % ssl_ctx->num_sessions;
+}
+
+/*
+ * Take a session out of its hash bucket (if it is in one).
+ */
+static void session_unhash(SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    SSL_SESSION **p = 
+        &ssl_ctx->ssl_sessions[session_hash(ssl_ctx, sess->session_id)];
+
+    while (*p)
+    {
+        if (*p == sess)
+        {
+            *p = sess->hash_next;
+            break;
+        }
+
+        p = &(*p)->hash_next;
+    }
+
+    sess->hash_next = NULL;
+}
+
+static void session_lru_remove(SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    if (sess->prev)
+        sess->prev->next = sess->next;
+    else
+        ssl_ctx->sess_head = sess->next;
+
+    if (sess->next)
+        sess->next->prev = sess->prev;
+    else
+        ssl_ctx->sess_tail = sess->prev;
+
+    sess->prev = sess->next = NULL;
+}
+
+/*
+ * Put a session at the front (most recently used) or the back (next to be 
+ * recycled) of the list.
+ */
+static void session_lru_add(SSL_CTX *ssl_ctx, SSL_SESSION *sess, int at_back)
+{
+    if (at_back)
+    {
+        sess->prev = ssl_ctx->sess_tail;
+
+        if (ssl_ctx->sess_tail)
+            ssl_ctx->sess_tail->next = sess;
+        else
+            ssl_ctx->sess_head = sess;
+
+        ssl_ctx->sess_tail = sess;
+    }
+    else
+    {
+        sess->next = ssl_ctx->sess_head;
+
+        if (ssl_ctx->sess_head)
+            ssl_ctx->sess_head->prev = sess;
+        else
+            ssl_ctx->sess_tail = sess;
+
+        ssl_ctx->sess_head = sess;
+    }
+}
+
+/*
+ * A client's sessions are also hashed by the host name that they were made
+ * with (in a table that is only made once there is one), so that the next
+ * connection to the host finds its latest session straight away.
+ */
+static SSL_SESSION **session_host_bucket(SSL_CTX *ssl_ctx, 
+        const char *host_name)
+{
+    uint32_t hash = host_hash((const uint8_t *)host_name, strlen(host_name));
+    return &ssl_ctx->sess_hosts[hash % ssl_ctx->num_sessions];
+}
+
+static void session_host_add(SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    SSL_SESSION **p;
+
+    if (ssl_ctx->sess_hosts == NULL && (ssl_ctx->sess_hosts = (SSL_SESSION **)
+                calloc(ssl_ctx->num_sessions, sizeof(SSL_SESSION *))) == NULL)
+        return;     /* it just can't be found by its host */
+
+    p = session_host_bucket(ssl_ctx, sess->host_name);
+    sess->host_next = *p;
+    *p = sess;
+}
+
+static void session_host_remove(SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    SSL_SESSION **p;
+
+    if (sess->host_name == NULL || ssl_ctx->sess_hosts == NULL)
+        return;
+
+    p = session_host_bucket(ssl_ctx, sess->host_name);
+
+    while (*p)
+    {
+        if (*p == sess)
+        {
+            *p = sess->host_next;
+            break;
+        }
+
+        p = &(*p)->host_next;
+    }
+
+    sess->host_next = NULL;
+}
+
+/*
+ * Forget everything a session knows.
+ */
+static void session_clear(SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    session_host_remove(ssl_ctx, sess);
+    memset(sess->session_id, 0, SSL_SESSION_ID_SIZE);
+    sess->id_size = 0;
+    memset(sess->master_secret, 0, SSL_SECRET_SIZE);
+    free(sess->ticket);
+    sess->ticket = NULL;
+    sess->ticket_len = 0;
+    free(sess->host_name);
+    sess->host_name = NULL;
+}
+
+/*
+ * Make a session unfindable and first in line to be reused.
+ */
+static void session_recycle(SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    session_unhash(ssl_ctx, sess);
+    session_clear(ssl_ctx, sess);
+    session_lru_remove(ssl_ctx, sess);
+    session_lru_add(ssl_ctx, sess, 1);
+}
+
+/*
+ * Look up a session by its id. The cache must be locked.
+ */
+static SSL_SESSION *session_find(SSL_CTX *ssl_ctx, const uint8_t *session_id)
+{
+    SSL_SESSION *sess = 
+        ssl_ctx->ssl_sessions[session_hash(ssl_ctx, session_id)];
+
+    while (sess && memcmp(sess->session_id, session_id, SSL_SESSION_ID_SIZE))
+        sess = sess->hash_next;
+
+    return sess;
+}
+
+/*
+ * Put a session into the hash bucket for its id.
+ */
+static void session_hash_add(SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    int hash = session_hash(ssl_ctx, sess->session_id);
+    sess->hash_next = ssl_ctx->ssl_sessions[hash];
+    ssl_ctx->ssl_sessions[hash] = sess;
+}
+
+/*
+ * Get an empty session as the most recently used one. The context must be 
+ * locked.
+ */
+static SSL_SESSION *session_new(SSL_CTX *ssl_ctx, time_t conn_time)
+{
+    SSL_SESSION *sess;
+
+    if (ssl_ctx->sess_count < ssl_ctx->num_sessions)
+    {
+        sess = (SSL_SESSION *)calloc(1, sizeof(SSL_SESSION));
+        ssl_ctx->sess_count++;
+    }
+    else    /* we've used up all of our sessions, so reuse the oldest one */
+    {
+        sess = ssl_ctx->sess_tail;
+        session_unhash(ssl_ctx, sess);
+        session_lru_remove(ssl_ctx, sess);
+        session_clear(ssl_ctx, sess);
+    }
+
+    sess->conn_time = conn_time;
+    session_lru_add(ssl_ctx, sess, 0);
+    return sess;
+}
+
+/*
+ * Ask the session store (if there is one) for a session that we don't have.
+ * Return 1 if it was there and it hasn't expired. The context must be locked.
+ */
+static int session_store_get(SSL_CTX *ssl_ctx, const uint8_t *session_id,
+        uint8_t *master_secret, time_t *conn_time)
+{
+    time_t tm = time(NULL);
+
+    if (ssl_ctx->sess_get_cb == NULL || 
+            ssl_ctx->sess_get_cb(ssl_ctx->sess_cb_arg, session_id, 
+                                    master_secret, conn_time) != SSL_OK)
+        return 0;
+
+    if (tm > *conn_time + SSL_EXPIRY_TIME || tm < *conn_time)
+    {
+        memset(master_secret, 0, SSL_SECRET_SIZE);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * A server only resumes a session for the host that it was made for, as 
+ * the certificates go with the host (RFC 6066). A client's sessions are for
+ * the server that it connects to, and dc->host_name is never set.
+ */
+static int session_host_match(SSL *ssl, const SSL_SESSION *sess)
+{
+    const char *host_name = ssl->dc->host_name;
+
+    if (IS_SET_SSL_FLAG(SSL_IS_CLIENT))
+        return 1;
+
+    if (sess->host_name == NULL || host_name == NULL)
+        return sess->host_name == host_name;
+
+    return strcmp(sess->host_name, host_name) == 0;
+}
+
+/**
+ * Find if an existing session has the same session id. If so, use the
+ * master secret from this session for session resumption. The session 
+ * store doesn't know about hosts, so it is only used without one.
+ */
+SSL_SESSION *ssl_session_update(SSL *ssl, const uint8_t *session_id)
+{
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
+    time_t tm = time(NULL);
+    SSL_SESSION *sess = NULL;
+    int use_store = session_id && ssl->dc->host_name == NULL;
+
+    /* no sessions? Then only the session store can help */
+    if (ssl_ctx->num_sessions == 0)
+    {
+        SSL_CTX_LOCK(ssl_ctx->mutex);
+        if (use_store && session_store_get(ssl_ctx, session_id, 
+                                        ssl->dc->master_secret, &tm))
+        {
+            memcpy(ssl->session_id, session_id, SSL_SESSION_ID_SIZE);
+            ssl->sess_id_size = SSL_SESSION_ID_SIZE;
+            SET_SSL_FLAG(SSL_SESSION_RESUME);
+        }
+        SSL_CTX_UNLOCK(ssl_ctx->mutex);
+        return NULL;
+    }
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    if (session_id)
+    {
+        sess = session_find(ssl_ctx, session_id);
+
+        /* expired sessions (including those in the future) are only 
+           noticed when they are looked up */
+        if (sess && ((tm > sess->conn_time + SSL_EXPIRY_TIME) ||
+                            (tm < sess->conn_time)))
+        {
+            session_recycle(ssl_ctx, sess);
+            sess = NULL;
+        }
+
+        /* one for another host stays for that host */
+        if (sess && !session_host_match(ssl, sess))
+            sess = NULL;
+
+        if (sess)
+        {
+            memcpy(ssl->dc->master_secret, 
+                    sess->master_secret, SSL_SECRET_SIZE);
+            SET_SSL_FLAG(SSL_SESSION_RESUME);
+            session_lru_remove(ssl_ctx, sess);
+            session_lru_add(ssl_ctx, sess, 0);
+            SSL_CTX_UNLOCK(ssl_ctx->mutex);
+            return sess;    /* a session was found */
+        }
+    }
+
+    /* If we've got here, no matching session was found - so create one */
+    sess = session_new(ssl_ctx, tm);
+
+    /* it can't be resumed if we can't say which host it is for */
+    if (ssl->dc->host_name && !IS_SET_SSL_FLAG(SSL_IS_CLIENT) &&
+            (sess->host_name = strdup(ssl->dc->host_name)) == NULL)
+    {
+        SSL_CTX_UNLOCK(ssl_ctx->mutex);
+        return NULL;
+    }
+
+    /* it may have been seen by someone else that shares the session store, 
+       in which case we keep a copy */
+    if (use_store && session_store_get(ssl_ctx, session_id, 
+                                    sess->master_secret, &sess->conn_time))
+    {
+        memcpy(sess->session_id, session_id, SSL_SESSION_ID_SIZE);
+        sess->id_size = SSL_SESSION_ID_SIZE;
+        session_hash_add(ssl_ctx, sess);
+        memcpy(ssl->dc->master_secret, sess->master_secret, SSL_SECRET_SIZE);
+        SET_SSL_FLAG(SSL_SESSION_RESUME);
+    }
+
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return sess;
+}
+
+/**
+ * Give the session of this connection its id, so that it can be found again.
+ */
+void ssl_session_set_id(SSL *ssl, const uint8_t *session_id, int id_size)
+{
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
+    SSL_SESSION *sess = ssl->session;
+
+    if (sess == NULL)
+        return;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    session_unhash(ssl_ctx, sess);
+    memcpy(sess->session_id, session_id, id_size);
+
+    /* pad the rest with 0's */
+    memset(&sess->session_id[id_size], 0, SSL_SESSION_ID_SIZE-id_size);
+    sess->id_size = id_size;
+
+    if (id_size)    /* no id means the peer doesn't want resumption */
+        session_hash_add(ssl_ctx, sess);
+
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+}
+
+/**
+ * Free all the sessions in the cache.
  */
-int process_finished(SSL *ssl, uint8_t *buf, int hs_len)
+static void session_free_all(SSL_CTX *ssl_ctx)
 {
-    int ret = SSL_OK;
-    int is_client = IS_SET_SSL_FLAG(SSL_IS_CLIENT);
-    int resume = IS_SET_SSL_FLAG(SSL_SESSION_RESUME);
-
-    PARANOIA_CHECK(ssl->bm_index, SSL_FINISHED_HASH_SIZE+4);
+    SSL_SESSION *sess = ssl_ctx->sess_head;
 
-    /* check that we all work before we continue */
-    if (memcmp(ssl->dc->final_finish_mac, &buf[4], SSL_FINISHED_HASH_SIZE))
-        return SSL_ERROR_FINISHED_INVALID;
-
-    if ((!is_client && !resume) || (is_client && resume))
+    while (sess)
     {
-        if ((ret = send_change_cipher_spec(ssl)) == SSL_OK)
-            ret = send_finished(ssl);
+        SSL_SESSION *next = sess->next;
+        free(sess->ticket);
+        free(sess->host_name);
+        free(sess);
+        sess = next;
     }
 
-    /* if we ever renegotiate */
-    ssl->next_state = is_client ? HS_HELLO_REQUEST : HS_CLIENT_HELLO;  
-    ssl->hs_status = ret;  /* set the final handshake status */
+    free(ssl_ctx->ssl_sessions);
+    free(ssl_ctx->sess_hosts);
 
-error:
-    return ret;
+    if (ssl_ctx->ticket_keys)
+    {
+        memset(ssl_ctx->ticket_keys, 0, 2*sizeof(SSL_TICKET_KEY));
+        free(ssl_ctx->ticket_keys);
+    }
 }
 
 /**
- * Send a certificate.
+ * This ssl object doesn't want this session anymore.
  */
-int send_certificate(SSL *ssl)
+void kill_ssl_session(SSL *ssl)
 {
-    int ret = SSL_OK;
-    int i = 0;
-    uint8_t *buf = ssl->bm_data;
-    int offset = 7;
-    int chain_length;
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
 
-    buf[0] = HS_CERTIFICATE;
-    buf[1] = 0;
-    buf[4] = 0;
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    if (ssl_ctx->sess_remove_cb && ssl->sess_id_size)
+        ssl_ctx->sess_remove_cb(ssl_ctx->sess_cb_arg, ssl->session_id);
 
-    /* spec says we must check if the hash/sig algorithm is OK */
-    if (ssl->version >= SSL_PROTOCOL_VERSION_TLS1_2 &&
-             ((ret = check_certificate_chain(ssl)) != SSL_OK))
+    if (ssl->session)
     {
-        ret = SSL_ERROR_INVALID_CERT_HASH_ALG;
-        goto error;
+        session_recycle(ssl_ctx, ssl->session);
+        ssl->session = NULL;
     }
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+}
 
-    while (i < ssl->ssl_ctx->chain_length)
-    {
-        SSL_CERT *cert = &ssl->ssl_ctx->certs[i];
-        buf[offset++] = 0;        
-        buf[offset++] = cert->size >> 8;        /* cert 1 length */
-        buf[offset++] = cert->size & 0xff;
-        memcpy(&buf[offset], cert->buf, cert->size);
-        offset += cert->size;
-        i++;
-    }
+/**
+ * Find the latest session with a server, and use it for this connection. 
+ * Return 1 if there was one.
+ */
+int ssl_session_find_host(SSL *ssl, const char *host_name)
+{
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
+    time_t tm = time(NULL);
+    SSL_SESSION *sess;
+    int found = 0;
 
-    chain_length = offset - 7;
-    buf[5] = chain_length >> 8;        /* cert chain length */
-    buf[6] = chain_length & 0xff;
-    chain_length += 3;
-    buf[2] = chain_length >> 8;        /* handshake length */
-    buf[3] = chain_length & 0xff;
-    ssl->bm_index = offset;
-    ret = send_packet(ssl, PT_HANDSHAKE_PROTOCOL, NULL, offset);
+    if (ssl_ctx->num_sessions == 0)
+        return 0;
 
-error:
-    return ret;
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    sess = ssl_ctx->sess_hosts ? 
+                *session_host_bucket(ssl_ctx, host_name) : NULL;
+
+    for (; sess; sess = sess->host_next)
+    {
+        if (sess->id_size && strcmp(sess->host_name, host_name) == 0 &&
+                tm <= sess->conn_time + SSL_EXPIRY_TIME && 
+                tm >= sess->conn_time)
+        {
+            memcpy(ssl->session_id, sess->session_id, SSL_SESSION_ID_SIZE);
+            ssl->sess_id_size = sess->id_size;
+            found = 1;
+            break;
+        }
+    }
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return found;
 }
 
 /**
- * Create a blob of memory that we'll get rid of once the handshake is
- * complete.
+ * Remember which server the session of this connection is with.
  */
-void disposable_new(SSL *ssl)
+void ssl_session_set_host(SSL *ssl, const char *host_name)
 {
-    if (ssl->dc == NULL)
-    {
-        ssl->dc = (DISPOSABLE_CTX *)calloc(1, sizeof(DISPOSABLE_CTX));
-        SHA256_Init(&ssl->dc->sha256_ctx);
-        MD5_Init(&ssl->dc->md5_ctx);
-        SHA1_Init(&ssl->dc->sha1_ctx);
-    }
+    SSL_SESSION *sess = ssl->session;
+
+    if (sess == NULL)
+        return;
+
+    SSL_CTX_LOCK(ssl->ssl_ctx->mutex);
+    session_host_remove(ssl->ssl_ctx, sess);
+    free(sess->host_name);
+
+    if ((sess->host_name = strdup(host_name)) != NULL)
+        session_host_add(ssl->ssl_ctx, sess);
+
+    SSL_CTX_UNLOCK(ssl->ssl_ctx->mutex);
 }
 
+/*
+ * The exported sessions are "AXSC", a version byte and a 32 bit count 
+ * followed by each session (least recently used first) as
+ * id size (1) | id (32) | master secret (48) | time (4) | host name size (1)
+ * | host name | ticket size (2) | ticket
+ * All the numbers are big endian.
+ */
+#define SESSION_EXPORT_VERSION      2
+#define SESSION_EXPORT_HEADER_SIZE  9
+#define SESSION_EXPORT_FIXED_SIZE   (1+SSL_SESSION_ID_SIZE+SSL_SECRET_SIZE+4+1+2)
+
 /**
- * Remove the temporary blob of memory.
+ * Write out the session cache so that it can be kept over a restart.
  */
-void disposable_free(SSL *ssl)
+EXP_FUNC int STDCALL ssl_ctx_export_sessions(SSL_CTX *ssl_ctx, 
+        uint8_t *data, int len)
 {
-    if (ssl->dc)
+    SSL_SESSION *sess;
+    int offset = SESSION_EXPORT_HEADER_SIZE, count = 0;
+
+    if (data && len < offset)
+        return SSL_NOT_OK;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    for (sess = ssl_ctx->sess_tail; sess; sess = sess->prev)
     {
-        memset(ssl->dc, 0, sizeof(DISPOSABLE_CTX));
-        free(ssl->dc);
-        ssl->dc = NULL;
+        int host_len = sess->host_name ? strlen(sess->host_name) : 0;
+        uint32_t tm = (uint32_t)sess->conn_time;
+
+        if (sess->id_size == 0 || host_len > 255)
+            continue;
+
+        if (data)
+        {
+            if (offset + SESSION_EXPORT_FIXED_SIZE + 
+                                host_len + sess->ticket_len > len)
+            {
+                offset = SSL_NOT_OK;
+                break;
+            }
+
+            data[offset++] = sess->id_size;
+            memcpy(&data[offset], sess->session_id, SSL_SESSION_ID_SIZE);
+            offset += SSL_SESSION_ID_SIZE;
+            memcpy(&data[offset], sess->master_secret, SSL_SECRET_SIZE);
+            offset += SSL_SECRET_SIZE;
+            data[offset++] = (uint8_t)(tm >> 24);
+            data[offset++] = (uint8_t)(tm >> 16);
+            data[offset++] = (uint8_t)(tm >> 8);
+            data[offset++] = (uint8_t)tm;
+            data[offset++] = host_len;
+            memcpy(&data[offset], sess->host_name, host_len);
+            offset += host_len;
+            data[offset++] = (uint8_t)(sess->ticket_len >> 8);
+            data[offset++] = (uint8_t)(sess->ticket_len & 0xff);
+            memcpy(&data[offset], sess->ticket, sess->ticket_len);
+            offset += sess->ticket_len;
+        }
+        else
+            offset += SESSION_EXPORT_FIXED_SIZE + host_len + sess->ticket_len;
+
+        count++;
     }
-    ssl->can_free_certificates = true;
-}
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
 
-static void certificate_free(SSL* ssl)
-{
-#ifdef CONFIG_SSL_CERT_VERIFICATION
-    if (ssl->x509_ctx) {
-        x509_free(ssl->x509_ctx);
-        ssl->x509_ctx = 0;
+    if (data && offset > 0)
+    {
+        memcpy(data, "AXSC", 4);
+        data[4] = SESSION_EXPORT_VERSION;
+        data[5] = (uint8_t)(count >> 24);
+        data[6] = (uint8_t)(count >> 16);
+        data[7] = (uint8_t)(count >> 8);
+        data[8] = (uint8_t)count;
     }
-    ssl->can_free_certificates = false;
-#endif
+
+    return offset;
 }
 
-#ifndef CONFIG_SSL_SKELETON_MODE     /* no session resumption in this mode */
 /**
- * Find if an existing session has the same session id. If so, use the
- * master secret from this session for session resumption.
+ * Read back sessions that were written out with ssl_ctx_export_sessions().
  */
-SSL_SESSION *ssl_session_update(int max_sessions, SSL_SESSION *ssl_sessions[], 
-        SSL *ssl, const uint8_t *session_id)
+EXP_FUNC int STDCALL ssl_ctx_import_sessions(SSL_CTX *ssl_ctx, 
+        const uint8_t *data, int len)
 {
     time_t tm = time(NULL);
-    time_t oldest_sess_time = tm;
-    SSL_SESSION *oldest_sess = NULL;
-    int i;
+    int i, count, offset = SESSION_EXPORT_HEADER_SIZE, num_imported = 0;
 
-    /* no sessions? Then bail */
-    if (max_sessions == 0)
-        return NULL;
+    if (ssl_ctx->num_sessions == 0)
+        return 0;
 
-    SSL_CTX_LOCK(ssl->ssl_ctx->mutex);
-    if (session_id)
+    if (len < offset || memcmp(data, "AXSC", 4) || 
+                                data[4] != SESSION_EXPORT_VERSION)
+        return SSL_NOT_OK;
+
+    count = ((uint32_t)data[5] << 24) | (data[6] << 16) | 
+                                                (data[7] << 8) | data[8];
+
+    /* check it all before we touch the cache */
+    for (i = 0; i < count; i++)
     {
-        for (i = 0; i < max_sessions; i++)
-        {
-            if (ssl_sessions[i])
-            {
-                /* kill off any expired sessions (including those in 
-                   the future) */
-                if ((tm > ssl_sessions[i]->conn_time + SSL_EXPIRY_TIME) ||
-                            (tm < ssl_sessions[i]->conn_time))
-                {
-                    session_free(ssl_sessions, i);
-                    continue;
-                }
+        int host_len, ticket_len;
 
-                /* if the session id matches, it must still be less than 
-                   the expiry time */
-                if (memcmp(ssl_sessions[i]->session_id, session_id,
-                                                SSL_SESSION_ID_SIZE) == 0)
-                {
-                    ssl->session_index = i;
-                    memcpy(ssl->dc->master_secret, 
-                            ssl_sessions[i]->master_secret, SSL_SECRET_SIZE);
-                    SET_SSL_FLAG(SSL_SESSION_RESUME);
-                    SSL_CTX_UNLOCK(ssl->ssl_ctx->mutex);
-                    return ssl_sessions[i];  /* a session was found */
-                }
-            }
-        }
+        if (offset + SESSION_EXPORT_FIXED_SIZE > len || 
+                                    data[offset] > SSL_SESSION_ID_SIZE)
+            return SSL_NOT_OK;
+
+        host_len = data[offset+1+SSL_SESSION_ID_SIZE+SSL_SECRET_SIZE+4];
+        offset += SESSION_EXPORT_FIXED_SIZE + host_len;
+
+        if (offset > len)
+            return SSL_NOT_OK;
+
+        ticket_len = (data[offset-2] << 8) + data[offset-1];
+        offset += ticket_len;
+
+        if (offset > len || ticket_len > SSL_MAX_TICKET_SIZE)
+            return SSL_NOT_OK;
     }
 
-    /* If we've got here, no matching session was found - so create one */
-    for (i = 0; i < max_sessions; i++)
+    offset = SESSION_EXPORT_HEADER_SIZE;
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    for (i = 0; i < count; i++)
     {
-        if (ssl_sessions[i] == NULL)
+        const uint8_t *id = &data[offset+1];
+        int id_size = data[offset];
+        const uint8_t *p = &id[SSL_SESSION_ID_SIZE+SSL_SECRET_SIZE];
+        time_t conn_time = (time_t)(((uint32_t)p[0] << 24) | 
+                                (p[1] << 16) | (p[2] << 8) | p[3]);
+        int host_len = p[4];
+        int ticket_len = (p[5+host_len] << 8) + p[6+host_len];
+        char *host_name = NULL;
+        uint8_t *ticket = NULL;
+        SSL_SESSION *sess;
+
+        offset += SESSION_EXPORT_FIXED_SIZE + host_len + ticket_len;
+
+        /* don't bother with sessions that have expired or that we have */
+        if (id_size == 0 || tm > conn_time + SSL_EXPIRY_TIME || 
+                tm < conn_time || session_find(ssl_ctx, id))
+            continue;
+
+        /* a session that we can't copy is just left out */
+        if ((host_len && (host_name = (char *)malloc(host_len+1)) == NULL) ||
+                (ticket_len && (ticket = (uint8_t *)malloc(ticket_len)) == NULL))
+        {
+            free(host_name);
+            continue;
+        }
+
+        sess = session_new(ssl_ctx, conn_time);
+        memcpy(sess->session_id, id, SSL_SESSION_ID_SIZE);
+        sess->id_size = id_size;
+        memcpy(sess->master_secret, &id[SSL_SESSION_ID_SIZE], 
+                                                    SSL_SECRET_SIZE);
+        session_hash_add(ssl_ctx, sess);
+
+        if (host_name)
         {
-            /* perfect, this will do */
-            ssl_sessions[i] = (SSL_SESSION *)calloc(1, sizeof(SSL_SESSION));
-            ssl_sessions[i]->conn_time = tm;
-            ssl->session_index = i;
-            SSL_CTX_UNLOCK(ssl->ssl_ctx->mutex);
-            return ssl_sessions[i]; /* return the session object */
+            memcpy(host_name, &p[5], host_len);
+            host_name[host_len] = 0;
+            sess->host_name = host_name;
+            session_host_add(ssl_ctx, sess);
         }
-        else if (ssl_sessions[i]->conn_time <= oldest_sess_time)
+
+        if (ticket)
         {
-            /* find the oldest session */
-            oldest_sess_time = ssl_sessions[i]->conn_time;
-            oldest_sess = ssl_sessions[i];
-            ssl->session_index = i;
+            memcpy(ticket, &p[7+host_len], ticket_len);
+            sess->ticket = ticket;
+            sess->ticket_len = ticket_len;
         }
+
+        num_imported++;
     }
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return num_imported;
+}
 
-    /* ok, we've used up all of our sessions. So blow the oldest session away */
-    oldest_sess->conn_time = tm;
-    memset(oldest_sess->session_id, 0, SSL_SESSION_ID_SIZE);
-    memset(oldest_sess->master_secret, 0, SSL_SECRET_SIZE);
-    SSL_CTX_UNLOCK(ssl->ssl_ctx->mutex);
-    return oldest_sess;
+/**
+ * Store the sessions somewhere else as well as in our own cache.
+ */
+EXP_FUNC int STDCALL ssl_ctx_set_session_store(SSL_CTX *ssl_ctx,
+        ssl_session_new_cb new_cb, ssl_session_get_cb get_cb,
+        ssl_session_remove_cb remove_cb, void *arg)
+{
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    ssl_ctx->sess_new_cb = new_cb;
+    ssl_ctx->sess_get_cb = get_cb;
+    ssl_ctx->sess_remove_cb = remove_cb;
+    ssl_ctx->sess_cb_arg = arg;
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return SSL_OK;
 }
 
 /**
- * Free an existing session.
+ * Copy out the session ticket (if any) that was kept with the session that
+ * this connection is trying to resume. Return the size of the ticket.
  */
-static void session_free(SSL_SESSION *ssl_sessions[], int sess_index)
+int ssl_session_get_ticket(SSL *ssl, uint8_t *ticket, int max_len)
 {
-    if (ssl_sessions[sess_index])
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
+    SSL_SESSION *sess;
+    int ticket_len = 0;
+
+    if (ssl_ctx->num_sessions == 0 || ssl->sess_id_size == 0)
+        return 0;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    sess = session_find(ssl_ctx, ssl->session_id);
+
+    if (sess && sess->ticket && sess->ticket_len <= max_len)
     {
-        free(ssl_sessions[sess_index]);
-        ssl_sessions[sess_index] = NULL;
+        memcpy(ticket, sess->ticket, sess->ticket_len);
+        ticket_len = sess->ticket_len;
     }
+
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return ticket_len;
 }
 
 /**
- * This ssl object doesn't want this session anymore.
+ * Keep a session ticket from the server with the session of this connection.
  */
-void kill_ssl_session(SSL_SESSION **ssl_sessions, SSL *ssl)
+void ssl_session_set_ticket(SSL *ssl, const uint8_t *ticket, int ticket_len)
 {
+    SSL_SESSION *sess = ssl->session;
+
+    if (sess == NULL || ticket_len > SSL_MAX_TICKET_SIZE)
+        return;
+
     SSL_CTX_LOCK(ssl->ssl_ctx->mutex);
+    free(sess->ticket);
+    sess->ticket_len = 0;
 
-    if (ssl->ssl_ctx->num_sessions)
+    if ((sess->ticket = (uint8_t *)malloc(ticket_len)) != NULL)
     {
-        session_free(ssl_sessions, ssl->session_index);
-        ssl->session = NULL;
+        memcpy(sess->ticket, ticket, ticket_len);
+        sess->ticket_len = ticket_len;
     }
 
     SSL_CTX_UNLOCK(ssl->ssl_ctx->mutex);
 }
+#else
+EXP_FUNC int STDCALL ssl_ctx_export_sessions(SSL_CTX *ssl_ctx, 
+        uint8_t *data, int len)
+{
+    return SSL_NOT_OK;  /* no session resumption in skeleton mode */
+}
+
+EXP_FUNC int STDCALL ssl_ctx_import_sessions(SSL_CTX *ssl_ctx, 
+        const uint8_t *data, int len)
+{
+    return SSL_NOT_OK;
+}
+
+EXP_FUNC int STDCALL ssl_ctx_set_session_store(SSL_CTX *ssl_ctx,
+        ssl_session_new_cb new_cb, ssl_session_get_cb get_cb,
+        ssl_session_remove_cb remove_cb, void *arg)
+{
+    return SSL_NOT_OK;  /* no session resumption in skeleton mode */
+}
 #endif /* CONFIG_SSL_SKELETON_MODE */
 
 /*
@@ -2015,6 +3883,226 @@ EXP_FUNC int STDCALL ssl_handshake_status(const SSL *ssl)
     return ssl->hs_status;
 }
 
+#ifndef CONFIG_SSL_SKELETON_MODE
+/*
+ * The exported state is "AXST", a version byte and then
+ * protocol version (1) | cipher (1) | flags (1) | id size (1) | 
+ * record limit (2) | need bytes (2) | got bytes (2) | record type (1) | 
+ * hmac header (5) | read sequence (8) | write sequence (8) | 
+ * client mac (32) | server mac (32) | session id (32) | 
+ * encrypt cipher | decrypt cipher | the bytes of a part read record
+ * Each cipher is the number of rounds (1), the key schedule (as 32 bit words)
+ * and the iv (16). All the numbers are big endian.
+ */
+#define STATE_EXPORT_VERSION        1
+#define STATE_EXPORT_FIXED_SIZE     (5+4+6+1+SSL_RECORD_SIZE+8+8+ \
+                                2*SHA256_SIZE+SSL_SESSION_ID_SIZE)
+#define STATE_FLAGS                 (SSL_NEED_RECORD|SSL_TX_ENCRYPTED| \
+                                SSL_RX_ENCRYPTED|SSL_IS_CLIENT)
+#define STATE_ROUNDS(C)             ((C)->key_size/4+6)
+#define STATE_CIPHER_SIZE(C)        (1+16*(STATE_ROUNDS(C)+1)+AES_IV_SIZE)
+
+static uint8_t *state_put_cipher(uint8_t *p, const AES_CTX *ctx)
+{
+    int i;
+
+    *p++ = (uint8_t)ctx->rounds;
+
+    for (i = 0; i < 4*(ctx->rounds+1); i++)
+    {
+        *p++ = (uint8_t)(ctx->ks[i] >> 24);
+        *p++ = (uint8_t)(ctx->ks[i] >> 16);
+        *p++ = (uint8_t)(ctx->ks[i] >> 8);
+        *p++ = (uint8_t)ctx->ks[i];
+    }
+
+    memcpy(p, ctx->iv, AES_IV_SIZE);
+    return p + AES_IV_SIZE;
+}
+
+static const uint8_t *state_get_cipher(const uint8_t *p, AES_CTX *ctx)
+{
+    int i;
+
+    ctx->rounds = *p++;
+    ctx->key_size = ctx->rounds - 6;
+
+    for (i = 0; i < 4*(ctx->rounds+1); i++, p += 4)
+        ctx->ks[i] = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+    memcpy(ctx->iv, p, AES_IV_SIZE);
+    return p + AES_IV_SIZE;
+}
+
+/**
+ * Write out what is needed to carry on this connection somewhere else. The 
+ * connection goes quiet once it has been handed over.
+ */
+EXP_FUNC int STDCALL ssl_export_state(SSL *ssl, uint8_t *data, int len)
+{
+    const cipher_info_t *ciph_info = ssl->cipher_info;
+    const uint8_t *pending;
+    uint8_t *p = data;
+    int size;
+
+    /* only a finished handshake with nothing unusual going on can move */
+    if (ssl->hs_status != SSL_OK || ssl->dc || ciph_info == NULL ||
+            (ssl->flag & (SSL_SENT_CLOSE_NOTIFY|SSL_FALSE_STARTED)) ||
+            !IS_SET_SSL_FLAG(SSL_TX_ENCRYPTED) || 
+            !IS_SET_SSL_FLAG(SSL_RX_ENCRYPTED))
+        return SSL_NOT_OK;
+
+    size = STATE_EXPORT_FIXED_SIZE + 2*STATE_CIPHER_SIZE(ciph_info) + 
+                                                        ssl->got_bytes;
+
+    if (data == NULL)
+        return size;
+
+    if (len < size)
+        return SSL_NOT_OK;
+
+    memcpy(p, "AXST", 4);
+    p += 4;
+    *p++ = STATE_EXPORT_VERSION;
+    *p++ = ssl->version;
+    *p++ = ssl->cipher;
+    *p++ = (uint8_t)(ssl->flag & STATE_FLAGS);
+    *p++ = ssl->sess_id_size;
+    *p++ = (uint8_t)(ssl->record_limit >> 8);
+    *p++ = (uint8_t)(ssl->record_limit & 0xff);
+    *p++ = (uint8_t)(ssl->need_bytes >> 8);
+    *p++ = (uint8_t)(ssl->need_bytes & 0xff);
+    *p++ = (uint8_t)(ssl->got_bytes >> 8);
+    *p++ = (uint8_t)(ssl->got_bytes & 0xff);
+    *p++ = ssl->record_type;
+    memcpy(p, ssl->hmac_header, SSL_RECORD_SIZE);
+    p += SSL_RECORD_SIZE;
+    memcpy(p, ssl->read_sequence, 8);
+    p += 8;
+    memcpy(p, ssl->write_sequence, 8);
+    p += 8;
+    memcpy(p, ssl->client_mac, SHA256_SIZE);
+    p += SHA256_SIZE;
+    memcpy(p, ssl->server_mac, SHA256_SIZE);
+    p += SHA256_SIZE;
+    memcpy(p, ssl->session_id, SSL_SESSION_ID_SIZE);
+    p += SSL_SESSION_ID_SIZE;
+    p = state_put_cipher(p, (AES_CTX *)ssl->encrypt_ctx);
+    p = state_put_cipher(p, (AES_CTX *)ssl->decrypt_ctx);
+
+    /* a header read in release mode is kept apart from the buffer */
+    pending = IS_SET_SSL_FLAG(SSL_NEED_RECORD) && 
+            IS_SET_SSL_FLAG(SSL_RELEASE_BUFFERS) ? ssl->rec_hdr : ssl->bm_data;
+    memcpy(p, pending, ssl->got_bytes);
+
+    /* the new owner has the sequence numbers now, so say nothing more */
+    SET_SSL_FLAG(SSL_SENT_CLOSE_NOTIFY);
+    return size;
+}
+
+/**
+ * Make a connection from the state that ssl_export_state() wrote out.
+ */
+EXP_FUNC SSL * STDCALL ssl_import_state(SSL_CTX *ssl_ctx, int client_fd, 
+        const uint8_t *data, int len)
+{
+    const cipher_info_t *ciph_info;
+    const uint8_t *p = &data[5];
+    SSL *ssl;
+    int flags, record_limit, need_bytes, got_bytes;
+
+    if (len < STATE_EXPORT_FIXED_SIZE || memcmp(data, "AXST", 4) || 
+                                data[4] != STATE_EXPORT_VERSION)
+        return NULL;
+
+    flags = p[2];
+    record_limit = (p[4] << 8) + p[5];
+    need_bytes = (p[6] << 8) + p[7];
+    got_bytes = (p[8] << 8) + p[9];
+
+    /* check it all before the connection is made */
+    if ((ciph_info = get_cipher_info(p[1])) == NULL ||
+            p[0] < SSL_PROTOCOL_MIN_VERSION || 
+            p[0] > SSL_PROTOCOL_VERSION_MAX ||
+            (flags & ~STATE_FLAGS) || 
+            !(flags & SSL_TX_ENCRYPTED) || !(flags & SSL_RX_ENCRYPTED) ||
+            p[3] > SSL_SESSION_ID_SIZE || 
+            record_limit > RT_MAX_PLAIN_LENGTH || got_bytes > need_bytes ||
+            need_bytes > ((flags & SSL_NEED_RECORD) ? SSL_RECORD_SIZE :
+                    RT_MAX_PLAIN_LENGTH+RT_EXTRA-BM_RECORD_OFFSET) ||
+            len != STATE_EXPORT_FIXED_SIZE + 2*STATE_CIPHER_SIZE(ciph_info) +
+                                                        got_bytes ||
+            data[STATE_EXPORT_FIXED_SIZE] != STATE_ROUNDS(ciph_info) ||
+            data[STATE_EXPORT_FIXED_SIZE+STATE_CIPHER_SIZE(ciph_info)] != 
+                                                STATE_ROUNDS(ciph_info))
+        return NULL;
+
+    if ((ssl = ssl_new(ssl_ctx, client_fd)) == NULL)
+        return NULL;
+
+    disposable_free(ssl);           /* there is no handshake to do */
+    ssl->flag = (ssl->flag & ~SSL_NEED_RECORD) | flags;
+    ssl->version = p[0];
+    ssl->cipher = p[1];
+    ssl->cipher_info = ciph_info;
+    ssl->sess_id_size = p[3];
+
+    if (record_limit)
+        set_record_limit(ssl, record_limit);
+
+    ssl->need_bytes = need_bytes;
+    ssl->got_bytes = ssl->bm_read_index = got_bytes;
+    ssl->record_type = p[10];
+    p += 11;
+    memcpy(ssl->hmac_header, p, SSL_RECORD_SIZE);
+    p += SSL_RECORD_SIZE;
+    memcpy(ssl->read_sequence, p, 8);
+    p += 8;
+    memcpy(ssl->write_sequence, p, 8);
+    p += 8;
+    memcpy(ssl->client_mac, p, SHA256_SIZE);
+    p += SHA256_SIZE;
+    memcpy(ssl->server_mac, p, SHA256_SIZE);
+    p += SHA256_SIZE;
+    memcpy(ssl->session_id, p, SSL_SESSION_ID_SIZE);
+    p += SSL_SESSION_ID_SIZE;
+    p = state_get_cipher(p, (AES_CTX *)ssl->encrypt_ctx);
+    p = state_get_cipher(p, (AES_CTX *)ssl->decrypt_ctx);
+
+    /* a part read record carries on from where it got to */
+    if ((!(flags & SSL_NEED_RECORD) && need_bytes > 
+                ssl->max_plain_length+RT_EXTRA-BM_RECORD_OFFSET &&
+                increase_bm_data_size(ssl, 
+                        need_bytes+BM_RECORD_OFFSET-RT_EXTRA) != SSL_OK) ||
+            bm_data_alloc(ssl) != SSL_OK)
+    {
+        SET_SSL_FLAG(SSL_SENT_CLOSE_NOTIFY);    /* it never got going */
+        ssl_free(ssl);
+        return NULL;
+    }
+
+    if (flags & SSL_NEED_RECORD)
+        memcpy(ssl->rec_hdr, p, got_bytes);
+
+    memcpy(ssl->bm_data, p, got_bytes);
+    ssl->next_state = (flags & SSL_IS_CLIENT) ? 
+                                    HS_HELLO_REQUEST : HS_CLIENT_HELLO;
+    ssl->hs_status = SSL_OK;
+    return ssl;
+}
+#else
+EXP_FUNC int STDCALL ssl_export_state(SSL *ssl, uint8_t *data, int len)
+{
+    return SSL_NOT_OK;
+}
+
+EXP_FUNC SSL * STDCALL ssl_import_state(SSL_CTX *ssl_ctx, int client_fd, 
+        const uint8_t *data, int len)
+{
+    return NULL;
+}
+#endif /* CONFIG_SSL_SKELETON_MODE */
+
 /*
  * Retrieve various parameters about the SSL engine.
  */
@@ -2057,36 +4145,9 @@ EXP_FUNC int STDCALL ssl_get_config(int offset)
  */
 static int check_certificate_chain(SSL *ssl)
 {
-    int i = 0;
-    int ret = SSL_OK;
-
-    while (i < ssl->ssl_ctx->chain_length)
-    {
-        int j = 0;
-        uint8_t found = 0;
-        SSL_CERT *cert = &ssl->ssl_ctx->certs[i];
-
-        while (j < ssl->num_sig_algs)
-        {
-            if (ssl->sig_algs[j++] == cert->hash_alg)
-            {
-                found = 1;
-                break;
-            }
-        } 
-
-        if (!found)
-        {
-
-            ret = SSL_ERROR_INVALID_CERT_HASH_ALG;
-            goto error;
-        }
-
-        i++;
-    }
-
-error:
-    return ret;
+    /* every hash used in the chain must be one the peer can handle */
+    return (ssl->config->cert_hash_algs & ~ssl->dc->sig_algs) ? 
+                        SSL_ERROR_INVALID_CERT_HASH_ALG : SSL_OK;
 }
 
 #ifdef CONFIG_SSL_CERT_VERIFICATION
@@ -2099,7 +4160,7 @@ EXP_FUNC int STDCALL ssl_verify_cert(const SSL *ssl)
     int pathLenConstraint = 0;
 
     SSL_CTX_LOCK(ssl->ssl_ctx->mutex);
-    ret = x509_verify(ssl->ssl_ctx->ca_cert_ctx, ssl->x509_ctx,
+    ret = x509_verify(ssl->config->ca_cert_ctx, ssl->x509_ctx,
             &pathLenConstraint);
     SSL_CTX_UNLOCK(ssl->ssl_ctx->mutex);
 
@@ -2109,7 +4170,7 @@ EXP_FUNC int STDCALL ssl_verify_cert(const SSL *ssl)
 
 #if defined (CONFIG_SSL_FULL_MODE)
         if (ssl->ssl_ctx->options & SSL_DISPLAY_CERTS) {
-            x509_print(ssl->x509_ctx, ssl->ssl_ctx->ca_cert_ctx);
+            x509_print(ssl->x509_ctx, ssl->config->ca_cert_ctx);
         }
 #endif
     }
@@ -2125,66 +4186,80 @@ int process_certificate(SSL *ssl, X509_CTX **x509_ctx)
     int ret = SSL_OK;
     uint8_t *buf = &ssl->bm_data[ssl->dc->bm_proc_index];
     int pkt_size = ssl->bm_index;
-    int cert_size, offset = 5, offset_start;
-    int total_cert_len = (buf[offset]<<8) + buf[offset+1];
+    int cert_size, offset = 5, offset_start, total_cert_len;
     int is_client = IS_SET_SSL_FLAG(SSL_IS_CLIENT);
     X509_CTX *chain = 0;
     X509_CTX **certs = 0;
     int *cert_used = 0;
     int num_certs = 0;
     int i = 0;
-    offset += 2;
 
-    ax_wdt_feed();
+    /* the chain was parsed as it arrived, and the buffer has moved on */
+    if (ssl->dc->certs)
+    {
+        certs = ssl->dc->certs;
+        num_certs = ssl->dc->num_certs;
+        ssl->dc->certs = NULL;
+        ssl->dc->num_certs = 0;
+        cert_used = (int*) calloc(num_certs, sizeof(int));
+        offset = 0;
+    }
+    else
+    {
+        total_cert_len = (buf[offset]<<8) + buf[offset+1];
+        offset += 2;
+        ax_wdt_feed();
 
-    PARANOIA_CHECK(pkt_size, total_cert_len + offset);
+        PARANOIA_CHECK(pkt_size, total_cert_len + offset);
 
-    // record the start point for the second pass
-    offset_start = offset;
+        // record the start point for the second pass
+        offset_start = offset;
 
-    // first pass - count the certificates
-    while (offset < total_cert_len)
-    {
-        offset++;       /* skip empty char */
-        cert_size = (buf[offset]<<8) + buf[offset+1];
-        offset += 2;
-        offset += cert_size;
-        num_certs++;
-    }
+        // first pass - count the certificates
+        while (offset < total_cert_len)
+        {
+            offset++;       /* skip empty char */
+            cert_size = (buf[offset]<<8) + buf[offset+1];
+            offset += 2;
+            offset += cert_size;
+            num_certs++;
+        }
 
-    PARANOIA_CHECK(pkt_size, offset);
+        PARANOIA_CHECK(pkt_size, offset);
 
-    certs = (X509_CTX**) calloc(num_certs, sizeof(void*));
-    cert_used = (int*) calloc(num_certs, sizeof(int));
-    num_certs = 0;
+        certs = (X509_CTX**) calloc(num_certs, sizeof(void*));
+        cert_used = (int*) calloc(num_certs, sizeof(int));
+        num_certs = 0;
 
-    // restore the offset from the saved value 
-    offset = offset_start;
+        // restore the offset from the saved value 
+        offset = offset_start;
 
-    // second pass - load the certificates
-    while (offset < total_cert_len)
-    {
-        offset++;       /* skip empty char */
-        cert_size = (buf[offset]<<8) + buf[offset+1];
-        offset += 2;
-        ax_wdt_feed();
-        if (x509_new(&buf[offset], NULL, certs+num_certs))
+        // second pass - load the certificates
+        while (offset < total_cert_len)
         {
-            ret = SSL_ERROR_BAD_CERTIFICATE;
-            goto error;
-        }
+            offset++;       /* skip empty char */
+            cert_size = (buf[offset]<<8) + buf[offset+1];
+            offset += 2;
+            ax_wdt_feed();
+            if (x509_new(&buf[offset], NULL, certs+num_certs))
+            {
+                ret = SSL_ERROR_BAD_CERTIFICATE;
+                goto error;
+            }
 
 #if defined (CONFIG_SSL_FULL_MODE)
-        if (ssl->ssl_ctx->options & SSL_DISPLAY_CERTS)
-            x509_print(certs[num_certs], NULL);
+            if (ssl->ssl_ctx->options & SSL_DISPLAY_CERTS)
+                x509_print(certs[num_certs], NULL);
 #endif
-        num_certs++;
-        offset += cert_size;
-    }
+            num_certs++;
+            offset += cert_size;
+        }
 
-    PARANOIA_CHECK(pkt_size, offset);
+        PARANOIA_CHECK(pkt_size, offset);
+    }
 
     // third pass - link certs together, assume server cert is the first
+    x509_free(*x509_ctx);       /* from a handshake before a renegotiation */
     *x509_ctx = certs[0];
     chain = certs[0];
     cert_used[0] = 1;
@@ -2313,6 +4388,10 @@ void DISPLAY_STATE(SSL *ssl, int is_send, uint8_t state, int not_ok)
             printf("Server Hello (2)\n");
             break;
 
+        case HS_NEW_SESSION_TICKET:
+            printf("New Session Ticket (4)\n");
+            break;
+
         case HS_CERTIFICATE:
             printf("Certificate (11)\n");
             break;
@@ -48,18 +48,23 @@ extern "C" {
 #include "crypto_misc.h"
 
 #define SSL_PROTOCOL_MIN_VERSION    0x31   /* TLS v1.0 */
-#define SSL_PROTOCOL_VERSION_MAX    0x33   /* TLS v1.3 */
+#define SSL_PROTOCOL_VERSION_MAX    0x33   /* TLS v1.2 */
 #define SSL_PROTOCOL_VERSION_TLS1_1 0x32   /* TLS v1.1 */
 #define SSL_PROTOCOL_VERSION_TLS1_2 0x33   /* TLS v1.2 */
 #define SSL_RANDOM_SIZE             32
 #define SSL_SECRET_SIZE             48
 #define SSL_FINISHED_HASH_SIZE      12
+#define SSL_MAX_KEY_BLOCK_SIZE      (2*(SHA256_SIZE+32+16))
 #define SSL_RECORD_SIZE             5
 #define SSL_SERVER_READ             0
 #define SSL_SERVER_WRITE            1
 #define SSL_CLIENT_READ             2
 #define SSL_CLIENT_WRITE            3
 #define SSL_HS_HDR_SIZE             4
+#define SSL_EXPIRY_TIME             (CONFIG_SSL_EXPIRY_TIME*3600)
+#define SSL_TICKET_KEY_NAME_SIZE    16
+#define SSL_TICKET_SIZE             128     /* the tickets that we issue */
+#define SSL_MAX_TICKET_SIZE         1024    /* the tickets that we keep */
 
 /* the flags we use while establishing a connection */
 #define SSL_NEED_RECORD             0x0001
@@ -69,6 +74,11 @@ extern "C" {
 #define SSL_IS_CLIENT               0x0010
 #define SSL_HAS_CERT_REQ            0x0020
 #define SSL_SENT_CLOSE_NOTIFY       0x0040
+#define SSL_NEW_TICKET              0x0080
+#define SSL_FALSE_STARTED           0x0100
+#define SSL_BUFFER_FLIGHT           0x0200
+#define SSL_STREAM_RECORD           0x0400
+#define SSL_SHRINK_BUFFER           0x0800
 
 /* some macros to muck around with flag bits */
 #define SET_SSL_FLAG(A)             (ssl->flag |= A)
@@ -77,12 +87,13 @@ extern "C" {
 
 #define MAX_KEY_BYTE_SIZE           512     /* for a 4096 bit key */
 #define RT_MAX_PLAIN_LENGTH         16384
+#define RT_DEFAULT_PLAIN_LENGTH     (1460*4)
+#define RT_MIN_PLAIN_LENGTH         256     /* a ticket fits in a record */
 #define RT_EXTRA                    1024
 #define BM_RECORD_OFFSET            5
 
 #define NUM_PROTOCOLS               4
 
-#define MAX_SIG_ALGORITHMS          4
 #define SIG_ALG_SHA1                2
 #define SIG_ALG_SHA256              4
 #define SIG_ALG_SHA384              5
@@ -107,6 +118,7 @@ enum
     HS_HELLO_REQUEST,
     HS_CLIENT_HELLO,
     HS_SERVER_HELLO,
+    HS_NEW_SESSION_TICKET = 4,
     HS_CERTIFICATE = 11,
     HS_SERVER_KEY_XCHG,
     HS_CERT_REQ,
@@ -122,6 +134,8 @@ enum
     SSL_EXT_SERVER_NAME = 0,
     SSL_EXT_MAX_FRAGMENT_SIZE,
     SSL_EXT_SIG_ALG = 0x0d,
+    SSL_EXT_RECORD_SIZE_LIMIT = 0x1c,
+    SSL_EXT_SESSION_TICKET = 0x23,
 };
 
 typedef struct 
@@ -145,13 +159,36 @@ struct _SSLObjLoader
 
 typedef struct _SSLObjLoader SSLObjLoader;
 
-typedef struct 
+typedef struct _SSL_SESSION
 {
     time_t conn_time;
     uint8_t session_id[SSL_SESSION_ID_SIZE];
+    uint8_t id_size;
     uint8_t master_secret[SSL_SECRET_SIZE];
+    uint8_t *ticket;                    /* client only */
+    uint16_t ticket_len;
+    char *host_name;                    /* the server, or our SNI host */
+    struct _SSL_SESSION *hash_next;     /* next in the same hash bucket */
+    struct _SSL_SESSION *host_next;     /* next in the same host bucket */
+    struct _SSL_SESSION *next;          /* less recently used */
+    struct _SSL_SESSION *prev;          /* more recently used */
 } SSL_SESSION;
 
+/* a session store that can be shared with other contexts and processes */
+typedef void (*ssl_session_new_cb)(void *arg, const uint8_t *session_id, 
+        const uint8_t *master_secret, time_t conn_time);
+typedef int (*ssl_session_get_cb)(void *arg, const uint8_t *session_id, 
+        uint8_t *master_secret, time_t *conn_time);
+typedef void (*ssl_session_remove_cb)(void *arg, const uint8_t *session_id);
+
+typedef struct
+{
+    uint8_t name[SSL_TICKET_KEY_NAME_SIZE];
+    uint8_t aes_key[16];
+    uint8_t hmac_key[SHA256_SIZE];
+    time_t created;
+} SSL_TICKET_KEY;
+
 typedef struct
 {
     uint8_t *buf;
@@ -159,18 +196,71 @@ typedef struct
     uint8_t hash_alg;
 } SSL_CERT;
 
+/* 
+ * The fixed size objects of a connection come from a block that the context
+ * sets aside, so a busy server doesn't wear the heap out making them.
+ */
+#define SSL_SLAB_ALIGN              16
+
+enum
+{
+    SSL_SLAB_SSL,
+    SSL_SLAB_DISPOSABLE,
+    SSL_SLAB_CIPHER,
+    SSL_NUM_SLABS
+};
+
+typedef struct
+{
+    uint8_t *block;             /* all the objects in one allocation */
+    uint8_t *end;
+    void *free_list;            /* linked through the objects */
+    size_t obj_size;
+} SSL_SLAB;
+
+/* an idle record buffer in a context's pool */
+typedef struct _SSL_POOL_BUF
+{
+    struct _SSL_POOL_BUF *next;
+    size_t size;
+} SSL_POOL_BUF;
+
 typedef struct
 {
-    MD5_CTX md5_ctx;
-    SHA1_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
+    union       /* only the one the version needs is used */
+    {
+        SHA256_CTX sha256_ctx;          /* TLS1.2 */
+        struct
+        {
+            MD5_CTX md5_ctx;            /* TLS1.0/1.1 */
+            SHA1_CTX sha1_ctx;
+        } md5_sha1;
+    } hs_hash;
+    uint8_t *hs_msgs;           /* the messages before the version is known */
+    int hs_msgs_len;
+    uint8_t hs_hash_started;
     uint8_t client_random[SSL_RANDOM_SIZE]; /* client's random sequence */
     uint8_t server_random[SSL_RANDOM_SIZE]; /* server's random sequence */
-    uint8_t final_finish_mac[128];
+    uint8_t final_finish_mac[SHA256_SIZE];  /* the PRF works in whole hashes */
     uint8_t master_secret[SSL_SECRET_SIZE];
-    uint8_t key_block[256];
+    uint8_t key_block[SSL_MAX_KEY_BLOCK_SIZE];
     uint16_t bm_proc_index;
     uint8_t key_block_generated;
+    uint8_t *flight_buf;        /* records held back until the flight ends */
+    int flight_len;
+    int flight_rec;             /* where the last record starts */
+    uint8_t flight_can_merge;   /* the last record is a plaintext handshake */
+    int hs_carry;               /* an incomplete message at the buffer start */
+    int rec_left;               /* what is still to come of a streamed record */
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+    X509_CTX **certs;           /* a certificate chain as it arrives */
+    int num_certs;
+    int cert_left;              /* the bytes of the chain still to come */
+#endif
+    uint8_t sig_algs;           /* the hashes the peer can check (a mask) */
+    uint8_t max_fragment_size;  /* a max_fragment_length to echo back */
+    uint8_t record_size_limit;  /* answer a record_size_limit */
+    char *host_name;            /* the SNI name that picked the certificates */
 } DISPOSABLE_CTX;
 
 typedef struct 
@@ -182,35 +272,79 @@ typedef struct
     uint8_t max_fragment_size;
 } SSL_EXTENSIONS;
 
+/* 
+ * The key and certificates of a context. A connection holds on to the ones
+ * it started with, so that a new lot can be swapped in while it runs. They
+ * don't change once a connection has them, so they are read without a lock.
+ */
+typedef struct
+{
+    int ref_count;                      /* the context and its connections */
+    uint8_t chain_length;
+    RSA_CTX *rsa_ctx;
+#ifdef CONFIG_SSL_CERT_VERIFICATION
+    CA_CERT_CTX *ca_cert_ctx;
+#endif
+    SSL_CERT certs[CONFIG_SSL_MAX_CERTS];  /* these point into cert_msg */
+    uint8_t *cert_msg;                  /* the certificate handshake message */
+    int cert_msg_len;
+    uint8_t cert_hash_algs;             /* the hashes used by the chain */
+} SSL_CONFIG;
+
+#define SSL_MAX_HOST_NAME           255
+#define SSL_HOST_MIN_BUCKETS        16
+
+/* a server's key and certificates for one host name (SNI) */
+typedef struct _SSL_HOST
+{
+    struct _SSL_HOST *next;             /* the rest of the hash bucket */
+    SSL_CONFIG *config;
+    uint32_t hash;
+    uint8_t name_len;
+    char name[];                        /* lower case, not terminated */
+} SSL_HOST;
+
+/* 
+ * What each record uses is kept together at the start, so that a record
+ * only touches the first cache line or two. The handshake state is in the
+ * DISPOSABLE_CTX.
+ */
 struct _SSL
 {
     uint32_t flag;
     uint16_t need_bytes;
     uint16_t got_bytes;
+    uint16_t bm_index;
+    uint16_t bm_read_index;
     uint8_t record_type;
     uint8_t cipher;
-    uint8_t sess_id_size;
     uint8_t version;
-    uint8_t client_version;
-    int16_t next_state;
     int16_t hs_status;
-    DISPOSABLE_CTX *dc;         /* temporary data which we'll get rid of soon */
+    uint16_t record_limit;      /* negotiated with the peer, 0 if none */
     int client_fd;
+    uint8_t *bm_data;
+    uint8_t *bm_all_data;
+    size_t max_plain_length;
     const cipher_info_t *cipher_info;
     void *encrypt_ctx;
     void *decrypt_ctx;
-    uint8_t *bm_all_data;
-    uint8_t *bm_data;
-    uint16_t bm_index;
-    uint16_t bm_read_index;
-    size_t max_plain_length;
-    uint8_t sig_algs[MAX_SIG_ALGORITHMS];
-    uint8_t num_sig_algs;
-    struct _SSL *next;                  /* doubly linked list */
-    struct _SSL *prev;
+    DISPOSABLE_CTX *dc;         /* temporary data which we'll get rid of soon */
     struct _SSL_CTX *ssl_ctx;           /* back reference to a clnt/svr ctx */
+    uint8_t read_sequence[8];           /* 64 bit sequence number */
+    uint8_t write_sequence[8];          /* 64 bit sequence number */
+    uint8_t hmac_header[SSL_RECORD_SIZE];    /* rx hmac */
+    uint8_t rec_hdr[SSL_RECORD_SIZE];   /* read while the buffer is released */
+    uint8_t client_mac[SHA256_SIZE];    /* for HMAC verification */
+    uint8_t server_mac[SHA256_SIZE];    /* for HMAC verification */
+
+    /* the rest is only needed now and again */
+    int16_t next_state;
+    uint8_t client_version;
+    uint8_t sess_id_size;
+    struct _SSL *next;                  /* the rest of the hash bucket */
+    struct _SSL *prev;
+    SSL_CONFIG *config;                 /* the key and certificates in use */
 #ifndef CONFIG_SSL_SKELETON_MODE
-    uint16_t session_index;
     SSL_SESSION *session;
 #endif
 #ifdef CONFIG_SSL_CERT_VERIFICATION
@@ -218,30 +352,55 @@ struct _SSL
     bool can_free_certificates;
 #endif
     uint8_t session_id[SSL_SESSION_ID_SIZE]; 
-    uint8_t client_mac[SHA256_SIZE];    /* for HMAC verification */
-    uint8_t server_mac[SHA256_SIZE];    /* for HMAC verification */
-    uint8_t read_sequence[8];           /* 64 bit sequence number */
-    uint8_t write_sequence[8];          /* 64 bit sequence number */
-    uint8_t hmac_header[SSL_RECORD_SIZE];    /* rx hmac */
     SSL_EXTENSIONS *extensions; /* Contains the SSL (client) extensions */
 };
 
 typedef struct _SSL SSL;
 
+/* the connections are kept in a hash table by fd, split into shards */
+#ifdef CONFIG_SSL_CTX_MUTEXING
+#define SSL_CONN_SHARDS             16  /* each with its own lock */
+#else
+#define SSL_CONN_SHARDS             1
+#endif
+#define SSL_CONN_MIN_BUCKETS        8
+
+typedef struct
+{
+    SSL **buckets;
+    int num_buckets;                    /* always a power of 2 */
+    int num_conns;
+#ifdef CONFIG_SSL_CTX_MUTEXING
+    SSL_CTX_MUTEX_TYPE mutex;
+#endif
+} SSL_CONN_SHARD;
+
 struct _SSL_CTX
 {
     uint32_t options;
-    uint8_t chain_length;
-    RSA_CTX *rsa_ctx;
-#ifdef CONFIG_SSL_CERT_VERIFICATION
-    CA_CERT_CTX *ca_cert_ctx;
-#endif
-    SSL *head;
-    SSL *tail;
-    SSL_CERT certs[CONFIG_SSL_MAX_CERTS];
+    SSL_CONFIG *config;                 /* for new connections */
+    SSL_CONN_SHARD conns[SSL_CONN_SHARDS];  /* the connections, by fd */
+    SSL_POOL_BUF *buf_pool;             /* record buffers to lend out */
+    int num_pool_bufs;
+    int max_pool_bufs;
+    SSL_SLAB slabs[SSL_NUM_SLABS];      /* connection objects to hand out */
 #ifndef CONFIG_SSL_SKELETON_MODE
-    uint16_t num_sessions;
-    SSL_SESSION **ssl_sessions;
+    int num_sessions;                   /* the size of the session cache */
+    int sess_count;                     /* the number of sessions created */
+    SSL_HOST **hosts;                   /* hash buckets, by host name */
+    int num_host_buckets;
+    int num_hosts;
+    SSL_SESSION **ssl_sessions;         /* hash buckets, indexed by id */
+    SSL_SESSION **sess_hosts;           /* hash buckets, by host name */
+    SSL_SESSION *sess_head;             /* most recently used session */
+    SSL_SESSION *sess_tail;             /* least recently used session */
+    ssl_session_new_cb sess_new_cb;     /* the shared session store */
+    ssl_session_get_cb sess_get_cb;
+    ssl_session_remove_cb sess_remove_cb;
+    void *sess_cb_arg;
+    SSL_TICKET_KEY *ticket_keys;        /* the current and previous keys */
+    uint8_t num_ticket_keys;
+    uint8_t ticket_keys_fixed;          /* set by the application */
 #endif
 #ifdef CONFIG_SSL_CTX_MUTEXING
     SSL_CTX_MUTEX_TYPE mutex;
@@ -259,10 +418,17 @@ typedef struct _SSL_CTX SSLCTX;
 extern const uint8_t ssl_prot_prefs[NUM_PROTOCOLS];
 
 SSL *ssl_new(SSL_CTX *ssl_ctx, int client_fd);
-void disposable_new(SSL *ssl);
+void ssl_set_client_fd(SSL *ssl, int client_fd);
+int disposable_new(SSL *ssl);
 void disposable_free(SSL *ssl);
 int send_packet(SSL *ssl, uint8_t protocol, 
         const uint8_t *in, int length);
+void set_record_limit(SSL *ssl, int limit);
+#ifndef CONFIG_SSL_SKELETON_MODE
+int select_host(SSL *ssl, const uint8_t *name, int name_len);
+#endif
+void start_flight(SSL *ssl);
+int flush_flight(SSL *ssl);
 int do_svr_handshake(SSL *ssl, int handshake_type, uint8_t *buf, int hs_len);
 int do_clnt_handshake(SSL *ssl, int handshake_type, uint8_t *buf, int hs_len);
 int process_finished(SSL *ssl, uint8_t *buf, int hs_len);
@@ -275,6 +441,7 @@ int send_change_cipher_spec(SSL *ssl);
 int finished_digest(SSL *ssl, const char *label, uint8_t *digest);
 void generate_master_secret(SSL *ssl, const uint8_t *premaster_secret);
 void add_packet(SSL *ssl, const uint8_t *pkt, int len);
+void start_handshake_hash(SSL *ssl);
 int add_cert(SSL_CTX *ssl_ctx, const uint8_t *buf, int len);
 int add_private_key(SSL_CTX *ssl_ctx, SSLObjLoader *ssl_obj);
 void ssl_obj_free(SSLObjLoader *ssl_obj);
@@ -313,10 +480,14 @@ void DISPLAY_BYTES(SSL *ssl, const char *format,/* win32 has no variadic macros
 int process_certificate(SSL *ssl, X509_CTX **x509_ctx);
 #endif
 
-SSL_SESSION *ssl_session_update(int max_sessions, 
-        SSL_SESSION *ssl_sessions[], SSL *ssl,
-        const uint8_t *session_id);
-void kill_ssl_session(SSL_SESSION **ssl_sessions, SSL *ssl);
+SSL_SESSION *ssl_session_update(SSL *ssl, const uint8_t *session_id);
+void ssl_session_set_id(SSL *ssl, const uint8_t *session_id, int id_size);
+void kill_ssl_session(SSL *ssl);
+int ssl_session_get_ticket(SSL *ssl, uint8_t *ticket, int max_len);
+void ssl_session_set_ticket(SSL *ssl, const uint8_t *ticket, int ticket_len);
+int ssl_session_find_host(SSL *ssl, const char *host_name);
+void ssl_session_set_host(SSL *ssl, const char *host_name);
+int send_new_session_ticket(SSL *ssl);
 
 #ifdef __cplusplus
 }
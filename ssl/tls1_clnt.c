@@ -56,6 +56,9 @@ static const uint8_t g_asn1_sha256[] =
 static int send_client_hello(SSL *ssl);
 static int process_server_hello(SSL *ssl);
 static int process_server_hello_done(SSL *ssl);
+#ifndef CONFIG_SSL_SKELETON_MODE
+static int process_new_session_ticket(SSL *ssl, uint8_t *buf, int hs_len);
+#endif
 static int send_client_key_xchg(SSL *ssl);
 static int process_cert_req(SSL *ssl);
 static int send_cert_verify(SSL *ssl);
@@ -67,6 +70,10 @@ EXP_FUNC SSL * STDCALL ssl_client_new(SSL_CTX *ssl_ctx, int client_fd, const
         uint8_t *session_id, uint8_t sess_id_size, SSL_EXTENSIONS* ssl_ext)
 {
     SSL *ssl = ssl_new(ssl_ctx, client_fd);
+
+    if (ssl == NULL)
+        return NULL;
+
     ssl->version = SSL_PROTOCOL_VERSION_MAX; /* try top version first */
 
     if (session_id && ssl_ctx->num_sessions)
@@ -110,6 +117,8 @@ int do_clnt_handshake(SSL *ssl, int handshake_type, uint8_t *buf, int hs_len)
         case HS_SERVER_HELLO_DONE:
             if ((ret = process_server_hello_done(ssl)) == SSL_OK)
             {
+                start_flight(ssl);
+
                 if (IS_SET_SSL_FLAG(SSL_HAS_CERT_REQ))
                 {
                     if ((ret = send_certificate(ssl)) == SSL_OK &&
@@ -128,6 +137,19 @@ int do_clnt_handshake(SSL *ssl, int handshake_type, uint8_t *buf, int hs_len)
                 {
                     ret = send_finished(ssl);
                 }
+
+                /* the whole flight goes out in one write */
+                if (flush_flight(ssl) < 0)
+                    ret = SSL_ERROR_CONN_LOST;
+
+                /* false start - the application can send its data now and 
+                   the server's finished message is checked later */
+                if (ret == SSL_OK && IS_SET_SSL_FLAG(SSL_FALSE_START) &&
+                        !IS_SET_SSL_FLAG(SSL_SERVER_VERIFY_LATER))
+                {
+                    SET_SSL_FLAG(SSL_FALSE_STARTED);
+                    ssl->hs_status = SSL_OK;
+                }
             }
             break;
 
@@ -135,8 +157,20 @@ int do_clnt_handshake(SSL *ssl, int handshake_type, uint8_t *buf, int hs_len)
             ret = process_cert_req(ssl);
             break;
 
+#ifndef CONFIG_SSL_SKELETON_MODE
+        case HS_NEW_SESSION_TICKET:
+            ret = process_new_session_ticket(ssl, buf, hs_len);
+            break;
+#endif
+
         case HS_FINISHED:
             ret = process_finished(ssl, buf, hs_len);
+
+            if (ret == SSL_OK)
+                CLR_SSL_FLAG(SSL_FALSE_STARTED);
+            else if (IS_SET_SSL_FLAG(SSL_FALSE_STARTED))
+                ssl->hs_status = ret;   /* the handshake wasn't complete */
+
             disposable_free(ssl);
             if (ssl->ssl_ctx->options & SSL_READ_BLOCKING) {
                 ssl->flag |= SSL_READ_BLOCKING;
@@ -145,7 +179,12 @@ int do_clnt_handshake(SSL *ssl, int handshake_type, uint8_t *buf, int hs_len)
             break;
 
         case HS_HELLO_REQUEST:
-            disposable_new(ssl);
+            if (disposable_new(ssl) != SSL_OK)
+            {
+                ret = SSL_NOT_OK;
+                break;
+            }
+
             ret = do_client_connect(ssl);
             break;
 
@@ -216,6 +255,17 @@ static int send_client_hello(SSL *ssl)
     memcpy(ssl->dc->client_random, &buf[6], SSL_RANDOM_SIZE);
     offset = 6 + SSL_RANDOM_SIZE;
 
+#ifndef CONFIG_SSL_SKELETON_MODE
+    /* if we weren't told which session to resume, use the last one that we
+       had with this server */
+    if (!IS_SET_SSL_FLAG(SSL_SESSION_RESUME) && ssl->extensions && 
+            ssl->extensions->host_name &&
+            ssl_session_find_host(ssl, ssl->extensions->host_name))
+    {
+        SET_SSL_FLAG(SSL_SESSION_RESUME);
+    }
+#endif
+
     /* give session resumption a go */
     if (IS_SET_SSL_FLAG(SSL_SESSION_RESUME))    /* set initially by user */
     {
@@ -289,6 +339,21 @@ static int send_client_hello(SSL *ssl)
         }
     }
 
+#ifndef CONFIG_SSL_SKELETON_MODE
+    /* ask for a session ticket, or hand back the one for this session */
+    if (IS_SET_SSL_FLAG(SSL_SESSION_TICKETS) && ssl->ssl_ctx->num_sessions)
+    {
+        int ticket_len = ssl_session_get_ticket(ssl, 
+                                    &buf[offset+4], SSL_MAX_TICKET_SIZE);
+        buf[offset++] = 0;
+        buf[offset++] = SSL_EXT_SESSION_TICKET;
+        buf[offset++] = (uint8_t)(ticket_len >> 8);
+        buf[offset++] = (uint8_t)(ticket_len & 0xff);
+        offset += ticket_len;
+        ext_len += ticket_len + 4;
+    }
+#endif
+
     if (ext_len > 0) 
     {
     	// update the extensions length value
@@ -296,7 +361,8 @@ static int send_client_hello(SSL *ssl)
     	buf[ext_offset + 1] = (uint8_t) (ext_len & 0xff);
     }
 
-    buf[3] = offset - 4;            /* handshake size */
+    buf[2] = (uint8_t)((offset - 4) >> 8);     /* handshake size */
+    buf[3] = (uint8_t)((offset - 4) & 0xff);
     return send_packet(ssl, PT_HANDSHAKE_PROTOCOL, NULL, offset);
 }
 
@@ -326,6 +392,7 @@ static int process_server_hello(SSL *ssl)
     }
 
     ssl->version = version;
+    start_handshake_hash(ssl);
 
     /* get the server random value */
     memcpy(ssl->dc->server_random, &buf[6], SSL_RANDOM_SIZE);
@@ -340,15 +407,14 @@ static int process_server_hello(SSL *ssl)
 
     if (num_sessions)
     {
-        ssl->session = ssl_session_update(num_sessions,
-                ssl->ssl_ctx->ssl_sessions, ssl, &buf[offset]);
-        memcpy(ssl->session->session_id, &buf[offset], sess_id_size);
+        ssl->session = ssl_session_update(ssl, &buf[offset]);
+        ssl_session_set_id(ssl, &buf[offset], sess_id_size);
 
-        /* pad the rest with 0's */
-        if (sess_id_size < SSL_SESSION_ID_SIZE)
+        /* so that the next connection to this server can find it */
+        if (!IS_SET_SSL_FLAG(SSL_SESSION_RESUME) && ssl->extensions && 
+                ssl->extensions->host_name)
         {
-            memset(&ssl->session->session_id[sess_id_size], 0,
-                SSL_SESSION_ID_SIZE-sess_id_size);
+            ssl_session_set_host(ssl, ssl->extensions->host_name);
         }
     }
 
@@ -384,8 +450,19 @@ static int process_server_hello(SSL *ssl)
                         goto error;
                     }
 
-                    ssl->max_plain_length = 1 << (8 + ext_val); // 2 ^ (8 + ext_val)
+                    set_record_limit(ssl, 1 << (8 + ext_val)); // 2 ^ (8 + ext_val)
                 }
+#ifndef CONFIG_SSL_SKELETON_MODE
+                else if (ext_type == SSL_EXT_SESSION_TICKET &&
+                            IS_SET_SSL_FLAG(SSL_SESSION_TICKETS))
+                {
+                    /* a new ticket comes before the change cipher spec */
+                    SET_SSL_FLAG(SSL_NEW_TICKET);
+
+                    if (IS_SET_SSL_FLAG(SSL_SESSION_RESUME))
+                        ssl->next_state = HS_NEW_SESSION_TICKET;
+                }
+#endif
 
                 offset += ext_len;
             }
@@ -405,10 +482,49 @@ error:
  */
 static int process_server_hello_done(SSL *ssl)
 {
-    ssl->next_state = HS_FINISHED;
+    ssl->next_state = IS_SET_SSL_FLAG(SSL_NEW_TICKET) ?
+                                HS_NEW_SESSION_TICKET : HS_FINISHED;
     return SSL_OK;
 }
 
+#ifndef CONFIG_SSL_SKELETON_MODE
+/*
+ * Process a new session ticket message and keep the ticket with the session.
+ */
+static int process_new_session_ticket(SSL *ssl, uint8_t *buf, int hs_len)
+{
+    int ret = SSL_OK;
+    int ticket_len;
+
+    PARANOIA_CHECK(hs_len, 10);
+    ticket_len = (buf[8] << 8) + buf[9];
+    PARANOIA_CHECK(hs_len, 10 + ticket_len);
+
+    /* an empty ticket means the server changed its mind */
+    if (ssl->session && ticket_len)
+    {
+        /* the server doesn't have to give us a session id, but we need one
+           to find the ticket again */
+        if (ssl->sess_id_size == 0)
+        {
+            if (get_random(SSL_SESSION_ID_SIZE, ssl->session_id) < 0)
+                return SSL_NOT_OK;
+
+            ssl->sess_id_size = SSL_SESSION_ID_SIZE;
+            ssl_session_set_id(ssl, ssl->session_id, SSL_SESSION_ID_SIZE);
+        }
+
+        ssl_session_set_ticket(ssl, &buf[10], ticket_len);
+    }
+
+    CLR_SSL_FLAG(SSL_NEW_TICKET);
+    ssl->next_state = HS_FINISHED;
+
+error:
+    return ret;
+}
+#endif
+
 /*
  * Send a client key exchange message.
  */
@@ -488,7 +604,7 @@ static int process_cert_req(SSL *ssl)
                      hash_alg == SIG_ALG_SHA384 ||
                      hash_alg == SIG_ALG_SHA512))
             {
-                ssl->sig_algs[ssl->num_sig_algs++] = hash_alg;
+                ssl->dc->sig_algs |= 1 << hash_alg;
             }
         }
     }
@@ -504,7 +620,7 @@ static int send_cert_verify(SSL *ssl)
 {
     uint8_t *buf = ssl->bm_data;
     uint8_t dgst[SHA1_SIZE+MD5_SIZE+15];
-    RSA_CTX *rsa_ctx = ssl->ssl_ctx->rsa_ctx;
+    RSA_CTX *rsa_ctx = ssl->config->rsa_ctx;
     int n = 0, ret;
     int offset = 0;
     int dgst_len;
@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include "os_port.h"
 #include "ssl.h"
+#include "os_alloc.h"
 
 static const uint8_t g_hello_done[] = { HS_SERVER_HELLO_DONE, 0, 0, 0 };
 static const uint8_t g_asn1_sha256[] = 
@@ -46,6 +47,10 @@ static int send_server_hello_sequence(SSL *ssl);
 static int send_server_hello(SSL *ssl);
 static int send_server_hello_done(SSL *ssl);
 static int process_client_key_xchg(SSL *ssl);
+#ifndef CONFIG_SSL_SKELETON_MODE
+static int process_session_ticket(SSL *ssl, const uint8_t *ticket, 
+        int ticket_len);
+#endif
 #ifdef CONFIG_SSL_CERT_VERIFICATION
 static int send_certificate_request(SSL *ssl);
 static int process_cert_verify(SSL *ssl);
@@ -58,17 +63,62 @@ EXP_FUNC SSL * STDCALL ssl_server_new(SSL_CTX *ssl_ctx, int client_fd)
 {
     SSL *ssl;
 
-    ssl = ssl_new(ssl_ctx, client_fd);
+    if ((ssl = ssl_new(ssl_ctx, client_fd)) == NULL)
+        return NULL;
+
     ssl->next_state = HS_CLIENT_HELLO;
 
 #ifdef CONFIG_SSL_FULL_MODE
-    if (ssl_ctx->chain_length == 0)
+    if (ssl->config->chain_length == 0 && ssl_ctx->num_hosts == 0)
         printf("Warning - no server certificate defined\n"); TTY_FLUSH();
 #endif
 
     return ssl;
 }
 
+/*
+ * Use a fixed key for the session tickets.
+ */
+EXP_FUNC int STDCALL ssl_ctx_set_ticket_key(SSL_CTX *ssl_ctx, 
+        const uint8_t *key)
+{
+#ifndef CONFIG_SSL_SKELETON_MODE
+    SSL_TICKET_KEY *keys;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    if (ssl_ctx->ticket_keys == NULL)
+    {
+        ssl_ctx->ticket_keys = 
+            (SSL_TICKET_KEY *)calloc(2, sizeof(SSL_TICKET_KEY));
+    }
+
+    if ((keys = ssl_ctx->ticket_keys) == NULL)
+    {
+        SSL_CTX_UNLOCK(ssl_ctx->mutex);
+        return SSL_NOT_OK;
+    }
+
+    /* tickets issued under the old key are still good for a while */
+    if (ssl_ctx->num_ticket_keys)
+    {
+        memcpy(&keys[1], &keys[0], sizeof(SSL_TICKET_KEY));
+        ssl_ctx->num_ticket_keys = 2;
+    }
+    else
+        ssl_ctx->num_ticket_keys = 1;
+
+    memcpy(keys[0].name, key, SSL_TICKET_KEY_NAME_SIZE);
+    memcpy(keys[0].aes_key, &key[16], 16);
+    memcpy(keys[0].hmac_key, &key[32], SHA256_SIZE);
+    keys[0].created = time(NULL);
+    ssl_ctx->ticket_keys_fixed = 1;
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+    return SSL_OK;
+#else
+    return SSL_NOT_OK;
+#endif
+}
+
 /*
  * Process the handshake record.
  */
@@ -94,7 +144,7 @@ int do_svr_handshake(SSL *ssl, int handshake_type, uint8_t *buf, int hs_len)
                 int cert_res;
                 int pathLenConstraint = 0;
 
-                cert_res = x509_verify(ssl->ssl_ctx->ca_cert_ctx, 
+                cert_res = x509_verify(ssl->config->ca_cert_ctx, 
                         ssl->x509_ctx, &pathLenConstraint);
                 ret = (cert_res == 0) ? SSL_OK : SSL_X509_ERROR(cert_res);
             }
@@ -126,9 +176,17 @@ static int process_client_hello(SSL *ssl)
     uint8_t *buf = ssl->bm_data;
     int pkt_size = ssl->bm_index;
     int i, j, cs_len, id_len, offset = 6 + SSL_RANDOM_SIZE;
+#ifndef CONFIG_SSL_SKELETON_MODE
+    int sess_id_len, sess_id_offset, ticket_len = 0;
+    const uint8_t *ticket = NULL;
+#endif
+    int max_fragment = 0, record_size_limit = 0;
     int ret = SSL_OK;
     
     uint8_t version = (buf[4] << 4) + buf[5];
+
+    /* a ticket from an earlier handshake is no promise for this one */
+    CLR_SSL_FLAG(SSL_NEW_TICKET);
     ssl->version = ssl->client_version = version;
 
     if (version > SSL_PROTOCOL_VERSION_MAX)
@@ -143,6 +201,8 @@ static int process_client_hello(SSL *ssl)
         goto error;
     }
 
+    start_handshake_hash(ssl);
+
     memcpy(ssl->dc->client_random, &buf[6], SSL_RANDOM_SIZE);
 
     /* process the session id */
@@ -153,8 +213,8 @@ static int process_client_hello(SSL *ssl)
     }
 
 #ifndef CONFIG_SSL_SKELETON_MODE
-    ssl->session = ssl_session_update(ssl->ssl_ctx->num_sessions,
-            ssl->ssl_ctx->ssl_sessions, ssl, id_len ? &buf[offset] : NULL);
+    sess_id_len = id_len;
+    sess_id_offset = offset;
 #endif
 
     offset += id_len;
@@ -194,7 +254,7 @@ do_compression:
     if (offset == pkt_size)
     {
         /* no extensions */
-        goto error;
+        goto find_session;
     }
 
     /* extension size */
@@ -202,8 +262,8 @@ do_compression:
     id_len += buf[offset++];
     PARANOIA_CHECK(pkt_size, offset + id_len);
     
-    // Check for extensions from the client - only the signature algorithm
-    // is supported
+    // Check for extensions from the client - only the server name, the
+    // signature algorithm, record size and session ticket are supported
     while (offset < pkt_size) 
     {
         int ext = buf[offset++] << 8;
@@ -226,10 +286,50 @@ do_compression:
                          hash_alg == SIG_ALG_SHA384 ||
                          hash_alg == SIG_ALG_SHA512))
                 {
-                    ssl->sig_algs[ssl->num_sig_algs++] = hash_alg;
+                    ssl->dc->sig_algs |= 1 << hash_alg;
                 }
             }
         }
+        else if (ext == SSL_EXT_MAX_FRAGMENT_SIZE)
+        {
+            /* 1 to 4 are 512 to 4096 bytes (RFC 6066) */
+            if (ext_len == 1 && buf[offset] >= 1 && buf[offset] <= 4)
+                max_fragment = buf[offset];
+
+            offset += ext_len;
+        }
+        else if (ext == SSL_EXT_RECORD_SIZE_LIMIT)
+        {
+            /* the most plaintext the client will take (RFC 8449) */
+            if (ext_len == 2)
+                record_size_limit = (buf[offset] << 8) + buf[offset+1];
+
+            offset += ext_len;
+        }
+#ifndef CONFIG_SSL_SKELETON_MODE
+        else if (ext == SSL_EXT_SERVER_NAME)
+        {
+            /* use the certificates of the (first) host name, if we have 
+               them (RFC 6066) */
+            if (ext_len > 5 && buf[offset+2] == 0 &&
+                    (buf[offset+3] << 8) + buf[offset+4] <= ext_len-5 &&
+                    ssl->dc->host_name == NULL)
+            {
+                select_host(ssl, &buf[offset+5], 
+                            (buf[offset+3] << 8) + buf[offset+4]);
+            }
+
+            offset += ext_len;
+        }
+        else if (ext == SSL_EXT_SESSION_TICKET && 
+                            IS_SET_SSL_FLAG(SSL_SESSION_TICKETS))
+        {
+            /* looked at once we have the session */
+            ticket = &buf[offset];
+            ticket_len = ext_len;
+            offset += ext_len;
+        }
+#endif
         else
         {
             offset += ext_len;
@@ -237,10 +337,53 @@ do_compression:
     }
 
     /* default is RSA/SHA1 */
-    if (ssl->num_sig_algs == 0)
+    if (ssl->dc->sig_algs == 0)
+    {
+        ssl->dc->sig_algs = 1 << SIG_ALG_SHA1;
+    }
+
+    /* a record size limit takes the place of a max fragment length, and we 
+       keep to the same limit for what we receive. One too small for us to
+       honour is ignored */
+    if (record_size_limit >= RT_MIN_PLAIN_LENGTH)
+    {
+        if (record_size_limit > ssl->max_plain_length)
+            record_size_limit = ssl->max_plain_length;
+
+        set_record_limit(ssl, record_size_limit);
+        ssl->dc->record_size_limit = 1;
+    }
+    else if (max_fragment)
+    {
+        set_record_limit(ssl, 1 << (8 + max_fragment));
+        ssl->dc->max_fragment_size = max_fragment;
+    }
+
+find_session:
+#ifndef CONFIG_SSL_SKELETON_MODE
+    /* a session is only resumed for the host it was made for, so we don't
+       look for it until we know the host */
+    ssl->session = ssl_session_update(ssl, 
+                            sess_id_len ? &buf[sess_id_offset] : NULL);
+
+    if (ticket && !IS_SET_SSL_FLAG(SSL_SESSION_RESUME))
     {
-        ssl->sig_algs[ssl->num_sig_algs++] = SIG_ALG_SHA1;
+        /* RFC 5077 has the client send a session id with a ticket so that 
+           it can tell if the ticket was accepted */
+        if (ticket_len && sess_id_len && 
+                process_session_ticket(ssl, ticket, ticket_len) == SSL_OK)
+        {
+            /* the ticket has the state, not the session cache */
+            kill_ssl_session(ssl);
+
+            memcpy(ssl->session_id, &buf[sess_id_offset], sess_id_len);
+            ssl->sess_id_size = sess_id_len;
+            SET_SSL_FLAG(SSL_SESSION_RESUME);
+        }
+        else
+            SET_SSL_FLAG(SSL_NEW_TICKET);   /* give it a new one */
     }
+#endif
 
 error:
     return ret;
@@ -253,6 +396,8 @@ static int send_server_hello_sequence(SSL *ssl)
 {
     int ret;
 
+    start_flight(ssl);
+
     if ((ret = send_server_hello(ssl)) == SSL_OK)
     {
 #ifndef CONFIG_SSL_SKELETON_MODE
@@ -288,6 +433,10 @@ static int send_server_hello_sequence(SSL *ssl)
         }
     }
 
+    /* the whole flight goes out in one write */
+    if (flush_flight(ssl) < 0)
+        ret = SSL_ERROR_CONN_LOST;
+
     return ret;
 }
 
@@ -297,7 +446,7 @@ static int send_server_hello_sequence(SSL *ssl)
 static int send_server_hello(SSL *ssl)
 {
     uint8_t *buf = ssl->bm_data;
-    int offset = 0;
+    int offset = 0, ext_offset;
 
     buf[0] = HS_SERVER_HELLO;
     buf[1] = 0;
@@ -316,12 +465,17 @@ static int send_server_hello(SSL *ssl)
 #ifndef CONFIG_SSL_SKELETON_MODE
     if (IS_SET_SSL_FLAG(SSL_SESSION_RESUME))
     {
-        /* retrieve id from session cache */
-        buf[offset++] = SSL_SESSION_ID_SIZE;
-        memcpy(&buf[offset], ssl->session->session_id, SSL_SESSION_ID_SIZE);
-        memcpy(ssl->session_id, ssl->session->session_id, SSL_SESSION_ID_SIZE);
-        ssl->sess_id_size = SSL_SESSION_ID_SIZE;
-        offset += SSL_SESSION_ID_SIZE;
+        /* retrieve id from session cache (a ticket uses the client's id) */
+        if (ssl->session)
+        {
+            memcpy(ssl->session_id, 
+                    ssl->session->session_id, SSL_SESSION_ID_SIZE);
+            ssl->sess_id_size = SSL_SESSION_ID_SIZE;
+        }
+
+        buf[offset++] = ssl->sess_id_size;
+        memcpy(&buf[offset], ssl->session_id, ssl->sess_id_size);
+        offset += ssl->sess_id_size;
     }
     else    /* generate our own session id */
 #endif
@@ -333,11 +487,7 @@ static int send_server_hello(SSL *ssl)
         ssl->sess_id_size = SSL_SESSION_ID_SIZE;
 
         /* store id in session cache */
-        if (ssl->ssl_ctx->num_sessions)
-        {
-            memcpy(ssl->session->session_id, 
-                    ssl->session_id, SSL_SESSION_ID_SIZE);
-        }
+        ssl_session_set_id(ssl, ssl->session_id, SSL_SESSION_ID_SIZE);
 
         offset += SSL_SESSION_ID_SIZE;
 #else
@@ -347,11 +497,278 @@ static int send_server_hello(SSL *ssl)
 
     buf[offset++] = 0;      /* cipher we are using */
     buf[offset++] = ssl->cipher;
-    buf[offset++] = 0;      /* no compression and no extensions supported */
+    buf[offset++] = 0;      /* no compression */
+
+    ext_offset = offset;    /* total length of extensions is filled in later */
+    offset += 2;
+
+#ifndef CONFIG_SSL_SKELETON_MODE
+    /* an empty server name extension says that it was used, but not when 
+       resuming */
+    if (ssl->dc->host_name && !IS_SET_SSL_FLAG(SSL_SESSION_RESUME))
+    {
+        buf[offset++] = 0;
+        buf[offset++] = SSL_EXT_SERVER_NAME;
+        buf[offset++] = 0;
+        buf[offset++] = 0;
+    }
+
+    /* an empty session ticket extension promises a ticket */
+    if (IS_SET_SSL_FLAG(SSL_NEW_TICKET))
+    {
+        buf[offset++] = 0;
+        buf[offset++] = SSL_EXT_SESSION_TICKET;
+        buf[offset++] = 0;
+        buf[offset++] = 0;
+    }
+#endif
+
+    if (ssl->dc->max_fragment_size)
+    {
+        buf[offset++] = 0;
+        buf[offset++] = SSL_EXT_MAX_FRAGMENT_SIZE;
+        buf[offset++] = 0;
+        buf[offset++] = 1;
+        buf[offset++] = ssl->dc->max_fragment_size;
+    }
+
+    if (ssl->dc->record_size_limit)
+    {
+        buf[offset++] = 0;
+        buf[offset++] = SSL_EXT_RECORD_SIZE_LIMIT;
+        buf[offset++] = 0;
+        buf[offset++] = 2;
+        buf[offset++] = ssl->record_limit >> 8;
+        buf[offset++] = ssl->record_limit & 0xff;
+    }
+
+    if (offset > ext_offset+2)
+    {
+        buf[ext_offset] = (offset-ext_offset-2) >> 8;
+        buf[ext_offset+1] = (offset-ext_offset-2) & 0xff;
+    }
+    else    /* no extensions */
+        offset = ext_offset;
+
     buf[3] = offset - 4;    /* handshake size */
     return send_packet(ssl, PT_HANDSHAKE_PROTOCOL, NULL, offset);
 }
 
+#ifndef CONFIG_SSL_SKELETON_MODE
+/*
+ * The session tickets that we issue are laid out as
+ * key name (16) | IV (16) | encrypted state (64) | HMAC-SHA256 (32)
+ * where the state is the version, cipher, issue time and master secret of 
+ * the session - enough for an abbreviated handshake - and the start of a 
+ * SHA-256 digest of the host name it was for (zeros if there wasn't one).
+ */
+#define TICKET_IV_OFFSET        SSL_TICKET_KEY_NAME_SIZE
+#define TICKET_STATE_OFFSET     (TICKET_IV_OFFSET+16)
+#define TICKET_STATE_SIZE       64
+#define TICKET_MAC_OFFSET       (TICKET_STATE_OFFSET+TICKET_STATE_SIZE)
+#define TICKET_HOST_OFFSET      (6+SSL_SECRET_SIZE)
+#define TICKET_HOST_SIZE        8
+
+/*
+ * Put the host of this connection into a ticket's state.
+ */
+static void ticket_host(SSL *ssl, uint8_t *host)
+{
+    uint8_t digest[SHA256_SIZE];
+    SHA256_CTX sha256_ctx;
+
+    memset(host, 0, TICKET_HOST_SIZE);
+
+    if (ssl->dc->host_name)
+    {
+        SHA256_Init(&sha256_ctx);
+        SHA256_Update(&sha256_ctx, (const uint8_t *)ssl->dc->host_name,
+                                        strlen(ssl->dc->host_name));
+        SHA256_Final(digest, &sha256_ctx);
+        memcpy(host, digest, TICKET_HOST_SIZE);
+    }
+}
+
+/*
+ * Get the key to issue tickets with. A new key is made when the current one
+ * is as old as a session may be, and the previous key is kept so that the
+ * tickets issued with it are good until they expire. The context must be 
+ * locked.
+ */
+static const SSL_TICKET_KEY *ticket_key_current(SSL_CTX *ssl_ctx)
+{
+    SSL_TICKET_KEY *keys = ssl_ctx->ticket_keys;
+    time_t tm = time(NULL);
+
+    if (keys == NULL)
+    {
+        if ((keys = ssl_ctx->ticket_keys = 
+                (SSL_TICKET_KEY *)calloc(2, sizeof(SSL_TICKET_KEY))) == NULL)
+            return NULL;
+    }
+    else if (ssl_ctx->ticket_keys_fixed || 
+                (tm <= keys[0].created + SSL_EXPIRY_TIME && 
+                 tm >= keys[0].created))
+    {
+        return keys;
+    }
+    else
+    {
+        memcpy(&keys[1], &keys[0], sizeof(SSL_TICKET_KEY));
+    }
+
+    if (get_random(SSL_TICKET_KEY_NAME_SIZE, keys[0].name) < 0 ||
+            get_random(sizeof(keys[0].aes_key), keys[0].aes_key) < 0 ||
+            get_random(SHA256_SIZE, keys[0].hmac_key) < 0)
+    {
+        memset(keys, 0, 2*sizeof(SSL_TICKET_KEY));
+        ssl_ctx->num_ticket_keys = 0;
+        return NULL;
+    }
+
+    keys[0].created = tm;
+
+    if (ssl_ctx->num_ticket_keys < 2)
+        ssl_ctx->num_ticket_keys++;
+
+    return keys;
+}
+
+/*
+ * Send a new session ticket message. The client keeps it with the session
+ * and hands it back when it wants to resume. If there is no key to protect 
+ * it with, the ticket is empty - the client was promised a message, and 
+ * this way it knows that it doesn't have a ticket (RFC 5077 3.3).
+ */
+int send_new_session_ticket(SSL *ssl)
+{
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
+    uint8_t *buf = ssl->bm_data;
+    uint8_t *ticket = &buf[10];
+    uint8_t state[TICKET_STATE_SIZE];
+    const SSL_TICKET_KEY *key;
+    AES_CTX aes_ctx;
+    time_t tm = time(NULL);
+    int ticket_len = 0, ret;
+
+    buf[0] = HS_NEW_SESSION_TICKET;
+    buf[1] = 0;
+    buf[2] = 0;
+    buf[4] = (uint8_t)((SSL_EXPIRY_TIME >> 24) & 0xff); /* lifetime hint */
+    buf[5] = (uint8_t)((SSL_EXPIRY_TIME >> 16) & 0xff);
+    buf[6] = (uint8_t)((SSL_EXPIRY_TIME >> 8) & 0xff);
+    buf[7] = (uint8_t)(SSL_EXPIRY_TIME & 0xff);
+    buf[8] = 0;
+
+    memset(state, 0, sizeof(state));
+    state[0] = ssl->version;
+    state[1] = ssl->cipher;
+    state[2] = (uint8_t)(((long)tm & 0xff000000) >> 24);
+    state[3] = (uint8_t)(((long)tm & 0x00ff0000) >> 16);
+    state[4] = (uint8_t)(((long)tm & 0x0000ff00) >> 8);
+    state[5] = (uint8_t)(((long)tm & 0x000000ff));
+    memcpy(&state[6], ssl->dc->master_secret, SSL_SECRET_SIZE);
+    ticket_host(ssl, &state[TICKET_HOST_OFFSET]);
+
+    if (get_random(16, &ticket[TICKET_IV_OFFSET]) < 0)
+    {
+        ret = SSL_NOT_OK;
+        goto error;
+    }
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    if ((key = ticket_key_current(ssl_ctx)) != NULL)
+    {
+        memcpy(ticket, key->name, SSL_TICKET_KEY_NAME_SIZE);
+        AES_set_key(&aes_ctx, key->aes_key, 
+                            &ticket[TICKET_IV_OFFSET], AES_MODE_128);
+        AES_cbc_encrypt(&aes_ctx, state, 
+                            &ticket[TICKET_STATE_OFFSET], TICKET_STATE_SIZE);
+        hmac_sha256(ticket, TICKET_MAC_OFFSET, key->hmac_key, SHA256_SIZE,
+                            &ticket[TICKET_MAC_OFFSET]);
+        ticket_len = SSL_TICKET_SIZE;
+    }
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+
+    memset(&aes_ctx, 0, sizeof(AES_CTX));
+    buf[3] = 6 + ticket_len;
+    buf[9] = ticket_len;
+    ret = send_packet(ssl, PT_HANDSHAKE_PROTOCOL, NULL, 10 + ticket_len);
+
+error:
+    memset(state, 0, sizeof(state));
+    return ret;
+}
+
+/*
+ * Check a session ticket from the client and if it is good, get the master 
+ * secret for an abbreviated handshake from it.
+ */
+static int process_session_ticket(SSL *ssl, const uint8_t *ticket, 
+        int ticket_len)
+{
+    SSL_CTX *ssl_ctx = ssl->ssl_ctx;
+    uint8_t state[TICKET_STATE_SIZE];
+    uint8_t mac[SHA256_SIZE];
+    uint8_t host[TICKET_HOST_SIZE];
+    AES_CTX aes_ctx;
+    time_t tm = time(NULL), issued;
+    int i, ret = SSL_NOT_OK;
+
+    if (ticket_len != SSL_TICKET_SIZE)
+        return SSL_NOT_OK;
+
+    SSL_CTX_LOCK(ssl_ctx->mutex);
+    for (i = 0; i < ssl_ctx->num_ticket_keys; i++)
+    {
+        const SSL_TICKET_KEY *key = &ssl_ctx->ticket_keys[i];
+
+        if (memcmp(ticket, key->name, SSL_TICKET_KEY_NAME_SIZE))
+            continue;
+
+        hmac_sha256(ticket, TICKET_MAC_OFFSET, key->hmac_key, SHA256_SIZE, 
+                                mac);
+
+        if (memcmp(mac, &ticket[TICKET_MAC_OFFSET], SHA256_SIZE) == 0)
+        {
+            AES_set_key(&aes_ctx, key->aes_key, 
+                                &ticket[TICKET_IV_OFFSET], AES_MODE_128);
+            AES_convert_key(&aes_ctx);
+            AES_cbc_decrypt(&aes_ctx, &ticket[TICKET_STATE_OFFSET], 
+                                state, TICKET_STATE_SIZE);
+            memset(&aes_ctx, 0, sizeof(AES_CTX));
+            ret = SSL_OK;
+        }
+
+        break;
+    }
+    SSL_CTX_UNLOCK(ssl_ctx->mutex);
+
+    if (ret != SSL_OK)
+        goto error;
+
+    issued = (time_t)(((uint32_t)state[2] << 24) | (state[3] << 16) | 
+                                (state[4] << 8) | state[5]);
+
+    ticket_host(ssl, host);
+
+    /* the ticket has to be for what we are about to do, and for this host */
+    if (state[0] != ssl->version || state[1] != ssl->cipher || 
+            tm > issued + SSL_EXPIRY_TIME || tm < issued ||
+            memcmp(&state[TICKET_HOST_OFFSET], host, TICKET_HOST_SIZE))
+    {
+        ret = SSL_NOT_OK;
+        goto error;
+    }
+
+    memcpy(ssl->dc->master_secret, &state[6], SSL_SECRET_SIZE);
+
+error:
+    memset(state, 0, sizeof(state));
+    return ret;
+}
+#endif
+
 /*
  * Send the server hello done message.
  */
@@ -372,7 +789,7 @@ static int process_client_key_xchg(SSL *ssl)
     int pkt_size = ssl->bm_index;
     int premaster_size, secret_length = (buf[2] << 8) + buf[3];
     uint8_t premaster_secret[MAX_KEY_BYTE_SIZE];
-    RSA_CTX *rsa_ctx = ssl->ssl_ctx->rsa_ctx;
+    RSA_CTX *rsa_ctx = ssl->config->rsa_ctx;
     int offset = 4;
     int ret = SSL_OK;
     
@@ -41,6 +41,7 @@
 #include <sys/time.h>
 #include "os_port.h"
 #include "crypto_misc.h"
+#include "os_alloc.h"
 
 #ifdef CONFIG_SSL_CERT_VERIFICATION
 static int x509_v3_subject_alt_name(const uint8_t *cert, int offset, 
@@ -397,12 +398,14 @@ static const uint8_t sig_prefix_sha384[] PROGMEM = {0x30, 0x41, 0x30, 0x0d, 0x06
 static const uint8_t sig_prefix_sha512[] PROGMEM = {0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40};
 
 /**
- * Take a signature and decrypt it.
+ * Take a signature and decrypt it. The issuer's own key context is used, so 
+ * the reduction constants set up when the key was loaded are reused.
  */
-static bigint *sig_verify(BI_CTX *ctx, const uint8_t *sig, int sig_len, uint8_t sig_type,
-        bigint *modulus, bigint *pub_exp)
+static bigint *sig_verify(const RSA_CTX *rsa_ctx, const uint8_t *sig, 
+        int sig_len, uint8_t sig_type)
 {
     int i;
+    BI_CTX *ctx = rsa_ctx->bi_ctx;
     bigint *decrypted_bi, *dat_bi;
     bigint *bir = NULL;
     uint8_t *block = (uint8_t *)malloc(sig_len);
@@ -437,18 +440,17 @@ static bigint *sig_verify(BI_CTX *ctx, const uint8_t *sig, int sig_len, uint8_t
         hash_len = sig_prefix[sig_prefix_size - 1];
 
     /* check length (#A) */
-    if (sig_len < 2 + 8 + 1 + sig_prefix_size + hash_len)
+    if (sig_len < 2 + 8 + 1 + sig_prefix_size + hash_len ||
+            sig_len > rsa_ctx->num_octets)
         goto err;
 
     /* decrypt */
     dat_bi = bi_import(ctx, sig, sig_len);
-    ctx->mod_offset = BIGINT_M_OFFSET;
 
     /* convert to a normal block */
-    decrypted_bi = bi_mod_power2(ctx, dat_bi, modulus, pub_exp);
+    decrypted_bi = RSA_public(rsa_ctx, dat_bi);
 
     bi_export(ctx, decrypted_bi, block, sig_len);
-    ctx->mod_offset = BIGINT_M_OFFSET;
 
     /* check the first 2 bytes */
     if (block[0] != 0 || block[1] != 1)
@@ -498,8 +500,7 @@ int x509_verify(const CA_CERT_CTX *ca_cert_ctx, const X509_CTX *cert,
     int ret = X509_OK, i = 0;
     bigint *cert_sig;
     X509_CTX *next_cert = NULL;
-    BI_CTX *ctx = NULL;
-    bigint *mod = NULL, *expn = NULL;
+    const RSA_CTX *rsa_ctx = NULL;
     int match_ca_cert = 0;
     struct timeval tv;
     uint8_t is_self_signed = 0;
@@ -515,9 +516,7 @@ int x509_verify(const CA_CERT_CTX *ca_cert_ctx, const X509_CTX *cert,
     if (asn1_compare_dn(cert->ca_cert_dn, cert->cert_dn) == 0)
     {
         is_self_signed = 1;
-        ctx = cert->rsa_ctx->bi_ctx;
-        mod = cert->rsa_ctx->m;
-        expn = cert->rsa_ctx->e;
+        rsa_ctx = cert->rsa_ctx;
     }
 
     gettimeofday(&tv, NULL);
@@ -585,11 +584,7 @@ int x509_verify(const CA_CERT_CTX *ca_cert_ctx, const X509_CTX *cert,
                 {
                     /* use this CA certificate for signature verification */
                     match_ca_cert = true;
-                    ctx = ca_cert_ctx->cert[i]->rsa_ctx->bi_ctx;
-                    mod = ca_cert_ctx->cert[i]->rsa_ctx->m;
-                    expn = ca_cert_ctx->cert[i]->rsa_ctx->e;
-
-
+                    rsa_ctx = ca_cert_ctx->cert[i]->rsa_ctx;
                     break;
                 }
 
@@ -613,9 +608,7 @@ int x509_verify(const CA_CERT_CTX *ca_cert_ctx, const X509_CTX *cert,
     }
     else /* use the next certificate in the chain for signature verify */
     {
-        ctx = next_cert->rsa_ctx->bi_ctx;
-        mod = next_cert->rsa_ctx->m;
-        expn = next_cert->rsa_ctx->e;
+        rsa_ctx = next_cert->rsa_ctx;
     }
 
     /* cert is self signed */
@@ -626,8 +619,8 @@ int x509_verify(const CA_CERT_CTX *ca_cert_ctx, const X509_CTX *cert,
     }
 
     /* check the signature */
-    cert_sig = sig_verify(ctx, cert->signature, cert->sig_len, cert->sig_type,
-                        bi_clone(ctx, mod), bi_clone(ctx, expn));
+    cert_sig = sig_verify(rsa_ctx, cert->signature, cert->sig_len, 
+                        cert->sig_type);
 
     if (cert_sig && cert->digest)
     {
@@ -635,14 +628,14 @@ int x509_verify(const CA_CERT_CTX *ca_cert_ctx, const X509_CTX *cert,
             ret = X509_VFY_ERROR_BAD_SIGNATURE;
 
 
-        bi_free(ctx, cert_sig);
+        bi_free(rsa_ctx->bi_ctx, cert_sig);
     }
     else
     {
         ret = X509_VFY_ERROR_BAD_SIGNATURE;
     }
 
-    bi_clear_cache(ctx);
+    bi_clear_cache(rsa_ctx->bi_ctx);
 
     if (ret)
         goto end_verify;
@@ -111,6 +111,14 @@ basicConstraints        = critical, CA:true, pathlen:10
 keyUsage                = encipherOnly, keyCertSign, decipherOnly
 EOF
 
+# a certificate too big for a 512 byte fragment (and its buffer)
+sed -e "s/^DNS.*//" certs.conf > big_cert.conf
+i=1
+while [ $i -le 80 ]; do
+    echo "DNS.$i = www$i.example.net" >> big_cert.conf
+    i=`expr $i + 1`
+done
+
 # private key generation
 openssl genrsa -out axTLS.ca_key.pem 2048
 openssl genrsa -out axTLS.key_1024.pem 1024
@@ -137,6 +145,8 @@ openssl req -out axTLS.x509_2048.csr -key axTLS.key_2048.pem -new \
             -config ./certs.conf 
 openssl req -out axTLS.x509_4096.csr -key axTLS.key_4096.pem -new \
             -config ./certs.conf 
+openssl req -out axTLS.x509_big.csr -key axTLS.key_1024.pem -new \
+            -config ./big_cert.conf 
 openssl req -out axTLS.x509_device.csr -key axTLS.key_device.pem -new \
             -config ./device_cert.conf
 openssl req -out axTLS.x509_intermediate_ca.csr \
@@ -177,6 +187,10 @@ openssl x509 -req -in axTLS.x509_2048.csr -out axTLS.x509_2048.pem \
 openssl x509 -req -in axTLS.x509_4096.csr -out axTLS.x509_4096.pem \
             -sha1 -CAcreateserial -days 5000 \
             -CA axTLS.ca_x509.pem -CAkey axTLS.ca_key.pem
+openssl x509 -req -in axTLS.x509_big.csr -out axTLS.x509_big.pem \
+            -sha256 -CAcreateserial -days 5000 \
+            -CA axTLS.ca_x509.pem -CAkey axTLS.ca_key.pem \
+            -extfile ./big_cert.conf -extensions v3_usr_cert 
 openssl x509 -req -in axTLS.x509_device.csr -out axTLS.x509_device.pem \
             -sha1 -CAcreateserial -days 5000 \
             -CA axTLS.x509_1024.pem -CAkey axTLS.key_1024.pem